@@ -44,12 +44,13 @@ namespace CustomMouseCurve
         // public properties
         public string DeviceID { get { return this.deviceID; } }
         public double HZ { get { return this.rate; } }
-        public double CPI { get { return this.cpi; } set { this.cpi = value; } }
+        public double CPI { get { return this.cpi; } set { lock (curveLock) { this.cpi = value; publishCurve(); } } }
         public double PPI { get { return this.ppi; } }
         public double CDGain { get { return ppi / cpi; } }
-        public Queue<MouseEventLog> Events { get { return this.events; } }
-        public List<double> curve { get { return gainCurves; } }
-        public bool doLearning = false;
+        // the curve last published to the translation path; never changed once published, so it is read without locking
+        public List<double> curve { get { return publishedList; } }
+        // written on the analysis thread, read on the UI thread
+        public volatile bool doLearning = false;
 
         // constants
         const int binCount = 128; // how many bins are there
@@ -65,16 +66,43 @@ namespace CustomMouseCurve
         double ppm { get { return ppi / 0.0254; } } // pixels per meter, 0.0254 m = 1 inch
         double minTimespan { get { return 1000 / rate; } } // minimum timespan for given polling rate
 
-        Queue<MouseEventLog> events;
+        Queue<MouseEventLog> events; // analysis thread only
         const double timewindow = 5; // unit: second
         List<double> gainCurves = new List<double>(binCount);
+        // updateCurve learns on this copy of gainCurves, and swaps it in when done
+        List<double> learningCurve = new List<double>(binCount);
+        // counts the curves set by loadWindowCurve; an update learned from an older curve is dropped
+        int curveGeneration = 0;
+        // guards gainCurves and curveGeneration. Held only to copy, swap and publish the curve, never during
+        // the analysis, so Reset and CPI changes on the UI thread do not wait for updateCurve
+        readonly object curveLock = new object();
+        // serializes saveAutoGain; two saves in the same second write the same file
+        readonly object saveLock = new object();
+        // copy of the curve last passed to publishedCurve.Publish, see curve
+        volatile List<double> publishedList = new List<double>();
+        // snapshot of gainCurves read by getTranslatedValue; republish after every change of gainCurves
+        persistence1d.p1dGainCurve publishedCurve = new persistence1d.p1dGainCurve();
         int max_number_submovement = 3;
         double gain_change_rate = 0.1;
 
-        double lastSpeed = 0;
+        double lastSpeed = 0; // UI thread only: getTranslatedValue, feedMouseEvent and ToString
 
         StreamWriter logger;
 
+        // binary columnar log of every raw event, see persistence1d_eventlog.hpp
+        persistence1d.p1dEventLog eventLogger = new persistence1d.p1dEventLog();
+
+        // raw input thread -> analysis thread. The input thread only publishes events;
+        // the analysis thread drains them, runs updateCurve on clicks and writes the event log.
+        persistence1d.p1dEventQueue eventQueue = new persistence1d.p1dEventQueue(1 << 14);
+        System.Threading.AutoResetEvent eventsPublished = new System.Threading.AutoResetEvent(false);
+        System.Threading.Thread analysisThread;
+        volatile bool stopAnalysis = false;
+        const int analysisInterval = 100; // unit: ms, drain period when there is no click
+
+        // persistence1d workspace, reused across clicks so that its native buffers keep their capacity
+        persistence1d.p1d persistence = new persistence1d.p1d();
+
         //Aim point estimation
         double process_noise = 0.2;
         double sensor_noise = 40.0;
@@ -114,7 +142,9 @@ namespace CustomMouseCurve
             {
                 // load the latest log.
                 loadAutoGain();
+                // the saved ppi may come from another display; recompile the transfer table with the current one
                 this.ppi = dpi;
+                publishCurve();
             }
             else
             {
@@ -136,6 +166,11 @@ namespace CustomMouseCurve
             events = new Queue<MouseEventLog>(capacity);
 
             logger = openLog();
+            openEventLog();
+
+            analysisThread = new System.Threading.Thread(analysisLoop);
+            analysisThread.IsBackground = true;
+            analysisThread.Start();
         }
 
         // changable parameters
@@ -172,21 +207,26 @@ namespace CustomMouseCurve
 
             int slot = (int)Math.Min(mouseSpeed, 20) / 2;
 
-            gainCurves.Clear();
-            if (!isEpp)
+            lock (curveLock)
             {
-                gainCurves.Add(0);
-                for (int i = 0; i < binCount - 1; i++)
+                gainCurves.Clear();
+                if (!isEpp)
                 {
-                    gainCurves.Add(winMultipliers[slot] / CDGain);
+                    gainCurves.Add(0);
+                    for (int i = 0; i < binCount - 1; i++)
+                    {
+                        gainCurves.Add(winMultipliers[slot] / CDGain);
+                    }
                 }
-            }
-            else
-            {
-                for (int i = 0; i < binCount; i++)
+                else
                 {
-                    gainCurves.Add(epp[i] * (mouseSpeed / 10.0) / CDGain);
+                    for (int i = 0; i < binCount; i++)
+                    {
+                        gainCurves.Add(epp[i] * (mouseSpeed / 10.0) / CDGain);
+                    }
                 }
+                curveGeneration++;
+                publishCurve();
             }
             saveAutoGain();
         }
@@ -197,11 +237,67 @@ namespace CustomMouseCurve
             return useTime.TotalMinutes;
         }
 
+        /// <summary>
+        /// Publish a raw event to the analysis thread. Called on the raw input thread; never waits.
+        /// </summary>
         public void feedMouseEvent(MouseEventLog datapoint)
         {
-            events.Enqueue(datapoint);
+            eventQueue.Push(datapoint.buttonflags, datapoint.deviceDX, datapoint.deviceDY,
+                datapoint.systemDX, datapoint.systemDY, datapoint.usTimestamp, datapoint.timespan);
             reportCounter++;
 
+            // wake the analysis thread right away on a click
+            if ((datapoint.buttonflags & RawMouse.RI_MOUSE_LEFT_BUTTON_DOWN) != 0)
+            {
+                lastSpeed = 0;
+                eventsPublished.Set();
+            }
+        }
+
+        private void analysisLoop()
+        {
+            while (!stopAnalysis)
+            {
+                eventsPublished.WaitOne(analysisInterval);
+                // the mouse is idle: write the events of the partial block, so a crash cannot lose them
+                if (drainEvents() == 0) eventLogger.Flush();
+            }
+            drainEvents();
+        }
+
+        private int drainEvents()
+        {
+            int drained = 0;
+            ushort buttonflags;
+            int devDX, devDY;
+            double sysDX, sysDY, timespan;
+            long usTimestamp;
+
+            while (eventQueue.TryPop(out buttonflags, out devDX, out devDY, out sysDX, out sysDY, out usTimestamp, out timespan))
+            {
+                processMouseEvent(new MouseEventLog(buttonflags, devDX, devDY, sysDX, sysDY, usTimestamp, usTimestamp / 1000.0, timespan, deviceID));
+                drained++;
+            }
+            return drained;
+        }
+
+        /// <summary>
+        /// Stop the analysis thread after it processed the published events, and close the event log.
+        /// </summary>
+        public void shutdown()
+        {
+            stopAnalysis = true;
+            eventsPublished.Set();
+            analysisThread.Join();
+            eventLogger.Close();
+        }
+
+        private void processMouseEvent(MouseEventLog datapoint)
+        {
+            events.Enqueue(datapoint);
+            eventLogger.Write(datapoint.buttonflags, datapoint.deviceDX, datapoint.deviceDY,
+                datapoint.systemDX, datapoint.systemDY, datapoint.usTimestamp, datapoint.timespan);
+
             // button clicked!!
             //if((datapoint.buttonflags & (RawMouse.RI_MOUSE_LEFT_BUTTON_DOWN | RawMouse.RI_MOUSE_RIGHT_BUTTON_DOWN)) != 0)
             if ((datapoint.buttonflags & RawMouse.RI_MOUSE_LEFT_BUTTON_DOWN) != 0)
@@ -220,7 +316,6 @@ namespace CustomMouseCurve
                     doLearning = false;
                 }
 
-                lastSpeed = 0;
                 // update the gain curve
                 updateCurve();
                 // clear the queue
@@ -234,6 +329,18 @@ namespace CustomMouseCurve
             }
         }
 
+        /// <summary>
+        /// Publish gainCurves to getTranslatedValue, with the bin size and CD gain it is translated with
+        /// </summary>
+        void publishCurve()
+        {
+            lock (curveLock)
+            {
+                publishedCurve.Publish(gainCurves, binSize, cpm, CDGain);
+                publishedList = new List<double>(gainCurves);
+            }
+        }
+
         /// <summary>
         /// translate mouse movement
         /// </summary>
@@ -247,18 +354,13 @@ namespace CustomMouseCurve
         {
             timespan = Math.Max(minTimespan, timespan); // preventing too fast polling because of a delayed event call
 
-            double magnitude = Math.Sqrt(dx * dx + dy * dy) / cpm; // calculated unit: meter
-            double speed = magnitude / (timespan / 1000);  // unit: m/s
+            // lock-free read of the published curve, compiled with cpm, binSize and CDGain = ppi / cpi:
+            // speed = sqrt(dx * dx + dy * dy) / cpm / (timespan / 1000), gain = getInterpolatedValue(speed / binSize) * CDGain
+            double speed = publishedCurve.Translate(dx, dy, timespan, out tx, out ty) * binSize; // unit: m/s
 
             if (lastSpeed < speed)
                 lastSpeed = speed;
 
-            // CDgain = ppi / cpi;
-            double gain = getInterpolatedValue(speed / binSize, gainCurves) * CDGain;
-
-            tx = dx * gain;
-            ty = dy * gain;
-
             return true;
         }
 
@@ -269,6 +371,15 @@ namespace CustomMouseCurve
         {
             resetLoggers();
 
+            // learn on a copy of the curve, curveLock is not held during the analysis
+            int generation;
+            lock (curveLock)
+            {
+                learningCurve.Clear();
+                learningCurve.AddRange(gainCurves);
+                generation = curveGeneration;
+            }
+
             // get history from the queue
             List<MouseEventLog> history = events.ToList<MouseEventLog>();
 
@@ -286,7 +397,7 @@ namespace CustomMouseCurve
             List<double> time_sum = new List<double>();
 
             List<double> output_speeds = new List<double>();
-            List<double> filtered_speeds = new List<double>();
+            double[] filtered_speeds;
 
             List<double> input_speeds = new List<double>();
             List<double> timespans = new List<double>();
@@ -392,7 +503,6 @@ namespace CustomMouseCurve
 
             for (int j = 0; j < output_speeds.Count; j++)
             {
-                double value = 0;
                 double value_ax = 0;
                 double value_ay = 0;
 
@@ -401,14 +511,12 @@ namespace CustomMouseCurve
                 {
                     if ((j + k) >= 0 && (j + k) < output_speeds.Count)
                     {
-                        value += output_speeds[j + k] * kernel[k + 3];
                         value_ax += acc_x[j + k] * kernel[k + 3];
                         value_ay += acc_y[j + k] * kernel[k + 3];
 
                         kernel_sum += kernel[k + 3];
                     }
                 }
-                filtered_speeds.Add(value / kernel_sum);
                 filtered_acc_x.Add(value_ax / kernel_sum);
                 filtered_acc_y.Add(value_ay / kernel_sum);
             }
@@ -421,19 +529,14 @@ namespace CustomMouseCurve
             List<int> mins = new List<int>();
             List<int> maxs = new List<int>();
             #region persistence1d, finding peaks and save them to mins/maxs
-            persistence1d.p1d p;
-            p = new persistence1d.p1d();
-
-            p.RunPersistence(filtered_speeds);
-            p.GetExtremaIndices(mins, maxs, persistence1d_threshold);
-
-
-            p.Dispose();
+            // speeds are smoothed with the same kernel natively, right before the run.
+            // only features above the threshold are used, so the rest is dropped during the run
+            persistence.RunFilteredPersistence(output_speeds, kernel, 3, persistence1d_threshold);
+            filtered_speeds = persistence.GetFilteredData();
+            // extrema come back in index order, no need to sort them here
+            persistence.GetOrderedExtremaIndices(mins, maxs, persistence1d_threshold);
             #endregion
 
-            mins.Sort();
-            maxs.Sort();
-
             bool is_updated = false;
 
             // if there's too little submovements, exit.
@@ -657,7 +760,7 @@ namespace CustomMouseCurve
 
 
             //Logging data only for submovements of interest
-            List<double> part_display_speed = filtered_speeds.GetRange(mins[first_min_index], filtered_speeds.Count - mins[first_min_index]);
+            List<double> part_display_speed = new List<double>(new ArraySegment<double>(filtered_speeds, mins[first_min_index], filtered_speeds.Length - mins[first_min_index]));
             List<double> part_motor_speed = input_speeds.GetRange(mins[first_min_index], input_speeds.Count - mins[first_min_index]);
             List<double> part_postion_x = position_x.GetRange(mins[first_min_index], position_x.Count - mins[first_min_index]);
             List<double> part_postion_y = position_y.GetRange(mins[first_min_index], position_y.Count - mins[first_min_index]);
@@ -826,7 +929,7 @@ namespace CustomMouseCurve
                         speedAppearingCounts[j] = 0;
                     }
 
-                    for (int j = 1; j < gainCurves.Count; j++)
+                    for (int j = 1; j < learningCurve.Count; j++)
                     {
                         double value = 0;
                         double kernel_sum = 0;
@@ -838,10 +941,10 @@ namespace CustomMouseCurve
                                 kernel_sum += kernel[k + 3];
                             }
                         }
-                        gainCurves[j] = gainCurves[j] + value / kernel_sum;
-                        if (gainCurves[j] < 0.0)
+                        learningCurve[j] = learningCurve[j] + value / kernel_sum;
+                        if (learningCurve[j] < 0.0)
                         {
-                            gainCurves[j] = 0.0;
+                            learningCurve[j] = 0.0;
                         }
                     }
                 }
@@ -883,6 +986,26 @@ namespace CustomMouseCurve
             //            writeLog("GainChange", gainChangeSum.ToString());
             #endregion
 
+            // swap the updated curve in and publish it under one short lock, the translation path never sees it
+            // half updated. If Reset replaced the curve during the analysis, the update is dropped.
+            if (is_updated)
+            {
+                lock (curveLock)
+                {
+                    if (generation == curveGeneration)
+                    {
+                        List<double> previous = gainCurves;
+                        gainCurves = learningCurve;
+                        learningCurve = previous;
+                        publishCurve();
+                    }
+                    else
+                    {
+                        is_updated = false;
+                    }
+                }
+            }
+
             if (is_updated && doLearning)
             {
                 Console.WriteLine("Updated");
@@ -890,6 +1013,10 @@ namespace CustomMouseCurve
             }
 
             writeLog(logger, "logBundle", makeLogBundle());
+
+            String persistenceStats = makePersistenceStats();
+            if (persistenceStats != null)
+                writeLog(logger, "persistenceStats", persistenceStats);
         }
 
         /// <summary>
@@ -971,6 +1098,17 @@ namespace CustomMouseCurve
             return new StreamWriter(fileString, true, Encoding.UTF8);
         }
 
+        // events are appended in blocks; the timestamp column is absolute (us) and the source is stored once per file
+        public bool openEventLog()
+        {
+            String pathString = getLogPath();
+            String filename = "0_events.p1e";
+            String fileString = Path.Combine(pathString, filename);
+
+            Directory.CreateDirectory(pathString);
+            return eventLogger.Open(fileString, this.deviceID);
+        }
+
         public void writeLog(StreamWriter sw, String logType, String value)
         {
             sw.WriteLine("{0},{1},{2}", DateTime.Now.ToString("yyyyMMdd_HHmmss"), logType, value);
@@ -1051,23 +1189,36 @@ namespace CustomMouseCurve
 
             StreamWriter sw;
             Directory.CreateDirectory(pathString);
-            sw = new StreamWriter(fileString, false, Encoding.UTF8);
 
-            // top five lines: deviceID / rate / cpi / ppi / # function values
-            sw.WriteLine(this.DeviceID);
-            sw.WriteLine(this.rate);
-            sw.WriteLine(this.cpi);
-            sw.WriteLine(this.ppi);
-            sw.WriteLine(gainCurves.Count);
-
-            // flush all values
-            for (int i = 0; i < gainCurves.Count; i++)
+            // copy under curveLock, write without it so that the UI thread never waits for the file
+            List<double> values;
+            double savedCpi;
+            lock (curveLock)
             {
-                sw.WriteLine(gainCurves[i]);
+                values = new List<double>(gainCurves);
+                savedCpi = this.cpi;
             }
 
-            sw.Flush();
-            sw.Close();
+            lock (saveLock)
+            {
+                sw = new StreamWriter(fileString, false, Encoding.UTF8);
+
+                // top five lines: deviceID / rate / cpi / ppi / # function values
+                sw.WriteLine(this.DeviceID);
+                sw.WriteLine(this.rate);
+                sw.WriteLine(savedCpi);
+                sw.WriteLine(this.ppi);
+                sw.WriteLine(values.Count);
+
+                // flush all values
+                for (int i = 0; i < values.Count; i++)
+                {
+                    sw.WriteLine(values[i]);
+                }
+
+                sw.Flush();
+                sw.Close();
+            }
         }
 
         public bool loadAutoGain(string path)
@@ -1105,6 +1256,7 @@ namespace CustomMouseCurve
             if (!success)
                 return false;
 
+            publishCurve();
             Debug.WriteLine("Successfully loaded {0}", path);
             return true;
         }
@@ -1146,6 +1298,17 @@ namespace CustomMouseCurve
             return logStr;
         }
 
+        // phase timings and counters of the last persistence run, and latencies of the recent runs
+        // null if the wrapper is built without instrumentation
+        private String makePersistenceStats()
+        {
+            Dictionary<String, double> stats = new Dictionary<String, double>();
+            if (!persistence.GetRunStats(stats))
+                return null;
+
+            return String.Join(",", stats.Select(stat => stat.Key + "=" + stat.Value));
+        }
+
         // interpolation
         public static double getInterpolatedValue(double index, List<double> list)
         {
@@ -1195,25 +1358,22 @@ namespace CustomMouseCurve
         /// <returns>List of paired extrema (PairedExtrema struct)</returns>
         private List<PairedExtrema> getPairedExtrema(List<double> inputData, double threshold)
         {
-            persistence1d.p1d p;
-            p = new persistence1d.p1d();
-
-            p.RunPersistence(inputData);
+            // the wrapper verifies every run; false for non-empty input means the results are inconsistent
+            if (!persistence.RunPersistence(inputData) && inputData.Count > 0)
+                Debug.WriteLine("Persistence results failed verification ({0} samples)", inputData.Count);
 
             List<PairedExtrema> pairs = new List<PairedExtrema>();
             List<int> mins = new List<int>();
             List<int> maxs = new List<int>();
             List<double> pers = new List<double>();
 
-            p.GetPairedExtrema(mins, maxs, pers, threshold);
+            persistence.GetPairedExtrema(mins, maxs, pers, threshold);
             for (int i = 0; i < mins.Count; i++)
             {
                 PairedExtrema np = new PairedExtrema(mins[i], maxs[i], pers[i]);
                 pairs.Add(np);
             }
 
-            p.Dispose();
-
             return pairs;
         }
         #endregion
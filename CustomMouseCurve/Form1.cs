@@ -208,6 +208,10 @@ namespace CustomMouseCurve
         
         private void Form1_FormClosing(object sender, FormClosingEventArgs e)
         {
+            foreach (AutoGain ag in AGfunctions.Values)
+            {
+                ag.shutdown();
+            }
             notifyIcon1.Dispose();
         }
 
@@ -275,9 +279,11 @@ namespace CustomMouseCurve
 
                 if (currentAG != null)
                 {
-                    for (int i = 0; i < currentAG.curve.Count; i++)
+                    // the last published curve, never waits for the analysis thread
+                    List<double> curve = currentAG.curve;
+                    for (int i = 0; i < curve.Count; i++)
                     {
-                        curveChart.Points.AddXY(i, currentAG.curve[i]);
+                        curveChart.Points.AddXY(i, curve[i]);
                     }
                 }
             }
@@ -0,0 +1,242 @@
+/*! \file eventLogCheck.cpp
+    Check for TEventLogWriter and TEventLogReader: logs cut off while writing a block must stay appendable.
+
+	Writes a log of three blocks, cuts bytes off its end as a crash while writing the last block would,
+	appends events in a new session and reads the log back. Every event of the complete blocks and of
+	the new session must be read, in order. Also checks appending to an intact log, to an empty file
+	and to a file with garbage after the last block, and that a file that is not a log is left alone.
+	Finally checks that the writer ends blocks on its time and size bounds, so a writer that is never 
+	closed only loses the events of its last partial block, and that GetColumn joins the blocks.
+	Exits with 1 if any case fails.
+
+	Builds on Linux with
+		g++ -std=c++11 -O2 -I../persistence1dWrapper eventLogCheck.cpp -o eventLogCheck
+
+	Usage:
+		eventLogCheck [directory]
+*/
+
+#include <stdio.h>
+#include <string.h>
+
+#include <string>
+#include <vector>
+
+#include "persistence1d_eventlog_reader.hpp"
+
+using namespace p1d;
+
+static const int FIRST_SESSION = 2 * TEventLogWriter::BLOCK_EVENTS + 100;
+static const int SECOND_SESSION = 50;
+
+/*!
+	Event number i of a log; its timestamp identifies it when read back.
+*/
+static TMouseEvent MakeEvent(const int i)
+{
+	TMouseEvent event;
+	event.Timestamp = 1000000LL + 8000LL * i;
+	event.SystemDX = i * 0.5;
+	event.SystemDY = -i * 0.25;
+	event.Timespan = 8;
+	event.DeviceDX = i % 17;
+	event.DeviceDY = -(i % 13);
+	event.ButtonFlags = (unsigned short)((i % 100 == 99) ? 1 : 0);
+	return event;
+}
+
+/*!
+	Writes events [first, last) in one session, in full blocks only. Returns false if opening or writing fails.
+*/
+static bool WriteSession(const std::string& fileName, const int first, const int last)
+{
+	TEventLogWriter writer;
+	if (!writer.Open(fileName.c_str(), "046D_C077")) return false;
+	writer.SetFlushBounds(TEventLogWriter::BLOCK_EVENTS, 1000000000000LL);
+
+	for (int i = first; i != last; i++)
+	{
+		writer.Write(MakeEvent(i));
+	}
+	return writer.Close();
+}
+
+static bool ReadFile(const std::string& fileName, std::vector<char>& bytes)
+{
+	FILE* file = fopen(fileName.c_str(), "rb");
+	if (file == 0) return false;
+
+	bytes.clear();
+	char buffer[65536];
+	size_t read;
+	while ((read = fread(buffer, 1, sizeof(buffer), file)) != 0)
+	{
+		bytes.insert(bytes.end(), buffer, buffer + read);
+	}
+	fclose(file);
+	return true;
+}
+
+static bool WriteFile(const std::string& fileName, const std::vector<char>& bytes)
+{
+	FILE* file = fopen(fileName.c_str(), "wb");
+	if (file == 0) return false;
+
+	const bool written = bytes.empty() || fwrite(&bytes[0], 1, bytes.size(), file) == bytes.size();
+	return (fclose(file) == 0) && written;
+}
+
+/*!
+	Reads the log back and compares its timestamps with the expected event numbers.
+*/
+static bool Verify(const std::string& fileName, const std::vector<int>& expected, const char* name)
+{
+	TEventLogReader reader;
+	if (!reader.Open(fileName.c_str()))
+	{
+		printf("%-28s FAILED: cannot read the log\n", name);
+		return false;
+	}
+
+	std::vector<int> events;
+	for (size_t b = 0; b != reader.GetBlockCount(); b++)
+	{
+		const TEventBlock& block = reader.GetBlock(b);
+		for (int i = 0; i != block.Count; i++)
+		{
+			const int number = (int)((block.Timestamps[i] - 1000000LL) / 8000LL);
+			const TMouseEvent event = MakeEvent(number);
+			const bool same = event.Timestamp == block.Timestamps[i] && event.SystemDX == block.SystemDX[i] &&
+							  event.SystemDY == block.SystemDY[i] && event.DeviceDX == block.DeviceDX[i] &&
+							  event.DeviceDY == block.DeviceDY[i] && event.ButtonFlags == block.ButtonFlags[i];
+			events.push_back(same ? number : -1);
+		}
+	}
+
+	const bool success = events == expected && strcmp(reader.GetSource(), "046D_C077") == 0;
+	printf("%-28s %s: %lu blocks, %llu events, %lu expected\n", name, success ? "ok" : "FAILED",
+		(unsigned long)reader.GetBlockCount(), reader.GetEventCount(), (unsigned long)expected.size());
+	return success;
+}
+
+/*!
+	Writes a first session, replaces the end of the file as given, appends a second session and verifies the log.
+
+	@param[in] cut		Bytes cut off the end of the first session.
+	@param[in] garbage	Bytes appended after the cut.
+	@param[in] kept		Events of the first session that must survive.
+*/
+static bool CheckAppend(const std::string& fileName, const size_t cut, const size_t garbage, const int kept, const char* name)
+{
+	remove(fileName.c_str());
+	std::vector<char> bytes;
+	if (!WriteSession(fileName, 0, FIRST_SESSION) || !ReadFile(fileName, bytes))
+	{
+		printf("%-28s FAILED: cannot write the first session\n", name);
+		return false;
+	}
+
+	bytes.resize(bytes.size() - cut);
+	bytes.insert(bytes.end(), garbage, (char)0x5a);
+	if (!WriteFile(fileName, bytes) || !WriteSession(fileName, FIRST_SESSION, FIRST_SESSION + SECOND_SESSION))
+	{
+		printf("%-28s FAILED: cannot append the second session\n", name);
+		return false;
+	}
+
+	std::vector<int> expected;
+	for (int i = 0; i != kept; i++) expected.push_back(i);
+	for (int i = FIRST_SESSION; i != FIRST_SESSION + SECOND_SESSION; i++) expected.push_back(i);
+	return Verify(fileName, expected, name);
+}
+
+/*!
+	Writes events [0, count) with the given flush bounds and reads the file while the writer is still open,
+	as after a crash. Every event but the ones of the last partial block must be in the log, in blocks of 
+	at most expectedBlockEvents events; GetColumn must return them as one array.
+*/
+static bool CheckBounds(const std::string& fileName, const unsigned int maxEvents, const long long maxMicroseconds,
+						const int count, const int expectedBlockEvents, const char* name)
+{
+	remove(fileName.c_str());
+	TEventLogWriter writer;
+	if (!writer.Open(fileName.c_str(), "046D_C077"))
+	{
+		printf("%-28s FAILED: cannot open the log\n", name);
+		return false;
+	}
+	writer.SetFlushBounds(maxEvents, maxMicroseconds);
+	for (int i = 0; i != count; i++)
+	{
+		writer.Write(MakeEvent(i));
+	}
+
+	std::vector<int> expected;
+	for (int i = 0; i != count - count % expectedBlockEvents; i++) expected.push_back(i);
+	bool success = Verify(fileName, expected, name);
+
+	TEventLogReader reader;
+	std::vector<long long> timestamps;
+	success &= reader.Open(fileName.c_str());
+	reader.GetColumn(&TEventBlock::Timestamps, timestamps);
+	success &= timestamps.size() == expected.size();
+	for (size_t b = 0; b != reader.GetBlockCount(); b++)
+	{
+		success &= reader.GetBlock(b).Count == expectedBlockEvents;
+	}
+	for (size_t i = 0; success && i != timestamps.size(); i++)
+	{
+		success &= timestamps[i] == MakeEvent(expected[i]).Timestamp;
+	}
+	if (!success) printf("%-28s FAILED: blocks or GetColumn\n", name);
+
+	reader.Close();
+	writer.Close();
+	return success;
+}
+
+int main(int argc, char** argv)
+{
+	const std::string directory = (argc > 1) ? argv[1] : ".";
+	const std::string fileName = directory + "/eventLogCheck.p1e";
+
+	unsigned long long offsets[EVENT_COLUMN_COUNT];
+	const size_t lastBlock = (size_t)GetEventBlockLayout(FIRST_SESSION - 2 * TEventLogWriter::BLOCK_EVENTS, offsets);
+	const int fullBlocks = 2 * TEventLogWriter::BLOCK_EVENTS;
+
+	bool success = true;
+	success &= CheckAppend(fileName, 0, 0, FIRST_SESSION, "intact");
+	success &= CheckAppend(fileName, 10, 0, fullBlocks, "last block cut by 10 bytes");
+	success &= CheckAppend(fileName, lastBlock - 8, 0, fullBlocks, "last block header cut");
+	success &= CheckAppend(fileName, lastBlock - 1, 0, fullBlocks, "one byte of the last block");
+	success &= CheckAppend(fileName, lastBlock, 0, fullBlocks, "last block removed");
+	success &= CheckAppend(fileName, 0, 40, FIRST_SESSION, "garbage after the last block");
+	success &= CheckAppend(fileName, 100, 40, fullBlocks, "cut block and garbage");
+
+	//an empty file gets a header
+	{
+		remove(fileName.c_str());
+		std::vector<int> expected;
+		for (int i = 0; i != SECOND_SESSION; i++) expected.push_back(i);
+		const bool written = WriteFile(fileName, std::vector<char>()) && WriteSession(fileName, 0, SECOND_SESSION);
+		success &= written && Verify(fileName, expected, "empty file");
+	}
+
+	//a file that is not a log is neither opened nor changed
+	{
+		const std::vector<char> text(100, 't');
+		std::vector<char> after;
+		const bool rejected = WriteFile(fileName, text) && !WriteSession(fileName, 0, SECOND_SESSION) &&
+							  ReadFile(fileName, after) && after == text;
+		printf("%-28s %s\n", "not a log", rejected ? "ok" : "FAILED");
+		success &= rejected;
+	}
+
+	//events are 8 ms apart: a second of events is 125, the time bound is reached at the 126th
+	success &= CheckBounds(fileName, TEventLogWriter::BLOCK_EVENTS, TEventLogWriter::FLUSH_INTERVAL, 1000, 126, "time bound");
+	success &= CheckBounds(fileName, 300, TEventLogWriter::FLUSH_INTERVAL * 1000LL, 1000, 300, "size bound");
+	success &= CheckBounds(fileName, 1, 0, 10, 1, "every event");
+
+	remove(fileName.c_str());
+	return success ? 0 : 1;
+}
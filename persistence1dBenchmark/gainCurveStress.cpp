@@ -0,0 +1,136 @@
+/*! \file gainCurveStress.cpp
+    Stress check for TGainCurve: readers evaluate the curve while a writer keeps publishing new curves.
+
+	Curve number g holds g*BIN_COUNT*8 + i in bin i, so every correct read at index x returns
+	x plus a multiple of BIN_COUNT*8. A read that mixes bins of two curves, or reads a freed curve,
+	returns something else and is counted as torn. Each reader also checks that curve numbers never go back.
+	The longest publish is reported too: readers that never pause must not hold a publish back.
+	Build with -fsanitize=address or -fsanitize=thread to also catch use after free and data races.
+
+	Builds on Linux with
+		g++ -std=c++11 -O2 -pthread -I../persistence1dWrapper gainCurveStress.cpp ../persistence1dWrapper/persistence1d_gaincurve.cpp -o gainCurveStress
+
+	Usage:
+		gainCurveStress [--readers n] [--seconds s]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "persistence1d_gaincurve.h"
+
+using namespace p1d;
+
+static const int BIN_COUNT = 128;
+static const double CURVE_STEP = BIN_COUNT * 8;
+
+/** Results of one reader thread. */
+struct TReaderResult
+{
+	unsigned long long Reads;
+	unsigned long long Torn;
+	unsigned long long Backwards;
+	double MaxNs;
+};
+
+static void ReadLoop(const TGainCurve& curve, const std::atomic<bool>& stop, const unsigned int seed, TReaderResult& result)
+{
+	std::mt19937 random(seed);
+	std::uniform_real_distribution<double> index(0, BIN_COUNT - 1);
+
+	double lastCurve = 0;
+	result.Reads = 0;
+	result.Torn = 0;
+	result.Backwards = 0;
+	result.MaxNs = 0;
+
+	while (!stop.load(std::memory_order_relaxed))
+	{
+		const double x = index(random);
+
+		const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		const double gain = curve.Evaluate(x);
+		const std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+
+		const double curveNumber = std::floor((gain - x) / CURVE_STEP + 0.5);
+		if (std::fabs(gain - x - curveNumber * CURVE_STEP) > 1e-6) result.Torn++;
+		if (curveNumber < lastCurve) result.Backwards++;
+		lastCurve = curveNumber;
+
+		result.MaxNs = std::max(result.MaxNs, (double)std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count());
+		result.Reads++;
+	}
+}
+
+int main(int argc, char** argv)
+{
+	int readers = 2;
+	double seconds = 3;
+
+	for (int i = 1; i < argc; i++)
+	{
+		const std::string arg = argv[i];
+		const bool hasValue = i + 1 < argc;
+
+		if (arg == "--readers" && hasValue) readers = std::max(1, atoi(argv[++i]));
+		else if (arg == "--seconds" && hasValue) seconds = atof(argv[++i]);
+		else
+		{
+			fprintf(stderr, "Usage: %s [--readers n] [--seconds s]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	TGainCurve curve;
+	std::vector<double> values(BIN_COUNT);
+	for (int i = 0; i != BIN_COUNT; i++) values[i] = i;
+	curve.Publish(&values[0], values.size());
+
+	std::atomic<bool> stop(false);
+	std::vector<TReaderResult> results(readers);
+	std::vector<std::thread> threads;
+	for (int r = 0; r != readers; r++)
+	{
+		threads.push_back(std::thread(ReadLoop, std::cref(curve), std::cref(stop), (unsigned int)r + 1, std::ref(results[r])));
+	}
+
+	//writer: publish curve after curve until the time is up
+	unsigned long long publishes = 0;
+	double maxPublishNs = 0;
+	const std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now() +
+		std::chrono::microseconds((long long)(seconds * 1e6));
+	while (std::chrono::steady_clock::now() < end)
+	{
+		publishes++;
+		for (int i = 0; i != BIN_COUNT; i++) values[i] = publishes * CURVE_STEP + i;
+		const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		curve.Publish(&values[0], values.size());
+		maxPublishNs = std::max(maxPublishNs, (double)std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now() - start).count());
+	}
+
+	stop = true;
+	for (size_t t = 0; t != threads.size(); t++) threads[t].join();
+
+	unsigned long long reads = 0, torn = 0, backwards = 0;
+	double maxNs = 0;
+	for (int r = 0; r != readers; r++)
+	{
+		reads += results[r].Reads;
+		torn += results[r].Torn;
+		backwards += results[r].Backwards;
+		maxNs = std::max(maxNs, results[r].MaxNs);
+	}
+
+	printf("readers %d, publishes %llu, reads %llu, torn %llu, backwards %llu, max read %.0f ns, max publish %.0f ns, version %llu\n",
+		readers, publishes + 1, reads, torn, backwards, maxNs, maxPublishNs, curve.GetVersion());
+	return (torn == 0 && backwards == 0 && curve.GetVersion() == publishes + 1) ? 0 : 1;
+}
@@ -0,0 +1,536 @@
+/*! \file persistence1dBenchmark.cpp
+    Benchmark for persistence1d.hpp, for catching regressions and comparing engine modes.
+
+	Times RunPersistence, GetPairedExtrema and GetExtremaIndices separately, over input sizes
+	from 10^2 to 10^7 vertices and over several input shapes. For every combination it reports
+	the time per vertex, the heap allocations per run and the peak heap memory of a run,
+	also per vertex.
+
+	With --batch it instead times BatchPersistence1D on --signals signals of --signal-length vertices
+	with 1, 2, 4 and one thread per hardware thread, and reports the speedup over one thread.
+	Every thread count must find the same pairs as one thread.
+
+	Builds on Linux with
+		g++ -std=c++11 -O2 -pthread -I../persistence1dWrapper persistence1dBenchmark.cpp -o persistence1dBenchmark
+
+	Usage:
+		persistence1dBenchmark [--min-size n] [--max-size n] [--shape name] [--mode name]
+		                       [--simd none|sse2|avx2] [--threshold t] [--quantum q] [--csv]
+		persistence1dBenchmark --batch [--signals n] [--signal-length n] [--shape name] [--csv]
+
+	Shapes: walk, noise, bells, plateaus, ramp.
+	Modes:	copy		RunPersistence(std::vector), the original way of calling the engine.
+			borrow		RunPersistence on the caller's buffer.
+			compress	borrow, with extrema compression.
+			threshold	compress, dropping pairs below --threshold during the run.
+			packed		borrow, with the compact layout (packed sort keys, split components).
+			compact		compress, with the compact layout.
+			radix		borrow, sorting with the radix sort.
+			quantized	borrow, sorting with the counting sort over buckets of --quantum.
+			deferred	borrow, deferring the pair sort to the first query, so it is timed with GetPairedExtrema.
+
+	Every mode's pairs are compared with those of borrow at the same threshold;
+	a mismatch is reported on stderr and makes the benchmark exit with 2.
+	A reused object must run without allocating: a warm RunPersistence that allocates
+	is reported on stderr and makes the benchmark exit with 3.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <new>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "persistence1d.hpp"
+#include "persistence1d_batch.hpp"
+
+using namespace p1d;
+
+
+/** Heap usage, counted by the replaced global operator new and delete below. */
+struct THeapCounters
+{
+	size_t Allocations;
+	size_t LiveBytes;
+	size_t PeakBytes;
+};
+static THeapCounters HeapCounters = { 0, 0, 0 };
+
+//the counters are not atomic; cleared before starting threads, which then allocate uncounted
+static bool CountHeap = true;
+
+//every block is prefixed with its size, so delete can update LiveBytes
+static const size_t HEAP_HEADER = 16;
+
+static void* CountedAlloc(const size_t size)
+{
+	char* block = (char*)malloc(size + HEAP_HEADER);
+	if (block == 0) throw std::bad_alloc();
+	*(size_t*)block = size;
+	if (!CountHeap) return block + HEAP_HEADER;
+
+	HeapCounters.Allocations++;
+	HeapCounters.LiveBytes += size;
+	HeapCounters.PeakBytes = std::max(HeapCounters.PeakBytes, HeapCounters.LiveBytes);
+	return block + HEAP_HEADER;
+}
+
+static void CountedFree(void* ptr)
+{
+	if (ptr == 0) return;
+	char* block = (char*)ptr - HEAP_HEADER;
+	if (CountHeap) HeapCounters.LiveBytes -= *(size_t*)block;
+	free(block);
+}
+
+void* operator new(size_t size) { return CountedAlloc(size); }
+void* operator new[](size_t size) { return CountedAlloc(size); }
+void operator delete(void* ptr) noexcept { CountedFree(ptr); }
+void operator delete[](void* ptr) noexcept { CountedFree(ptr); }
+void operator delete(void* ptr, size_t) noexcept { CountedFree(ptr); }
+void operator delete[](void* ptr, size_t) noexcept { CountedFree(ptr); }
+
+
+/** Engine modes that can be compared. */
+enum TMode
+{
+	MODE_COPY,
+	MODE_BORROW,
+	MODE_COMPRESS,
+	MODE_THRESHOLD,
+	MODE_PACKED,
+	MODE_COMPACT,
+	MODE_RADIX,
+	MODE_QUANTIZED,
+	MODE_DEFERRED,
+	MODE_COUNT
+};
+static const char* ModeNames[MODE_COUNT] = { "copy", "borrow", "compress", "threshold", "packed", "compact", "radix", "quantized", "deferred" };
+
+
+/** Input shapes. */
+enum TShape
+{
+	SHAPE_WALK,
+	SHAPE_NOISE,
+	SHAPE_BELLS,
+	SHAPE_PLATEAUS,
+	SHAPE_RAMP,
+	SHAPE_COUNT
+};
+static const char* ShapeNames[SHAPE_COUNT] = { "walk", "noise", "bells", "plateaus", "ramp" };
+
+static const char* SimdLevelNames[] = { "none", "sse2", "avx2" };
+
+
+/*!
+	Fills data with size vertices of the given shape. The same seed always creates the same data.
+*/
+void CreateData(const TShape shape, const int size, std::vector<double>& data)
+{
+	std::mt19937 random(12345);
+	std::uniform_real_distribution<double> uniform(0.0, 1.0);
+	std::normal_distribution<double> normal(0.0, 1.0);
+
+	data.resize(size);
+	switch (shape)
+	{
+	case SHAPE_WALK:
+		{
+			double value = 0;
+			for (int i = 0; i != size; i++)
+			{
+				value += normal(random) * 0.01;
+				data[i] = value;
+			}
+		}
+		break;
+
+	case SHAPE_NOISE:
+		for (int i = 0; i != size; i++)
+		{
+			data[i] = uniform(random);
+		}
+		break;
+
+	case SHAPE_BELLS:
+		//speed profiles of pointing movements: bell-shaped submovements of varying length and
+		//amplitude, separated by short pauses, with sensor jitter on top
+		{
+			int i = 0;
+			while (i != size)
+			{
+				const int length = 20 + (int)(uniform(random) * 180);
+				const double amplitude = 0.05 + uniform(random);
+				for (int j = 0; j != length && i != size; j++, i++)
+				{
+					const double phase = (double)j / length;
+					const double bell = std::pow(std::sin(3.14159265358979 * phase), 2.0);
+					data[i] = std::max(0.0, amplitude * bell + normal(random) * 0.005);
+				}
+				const int pause = (int)(uniform(random) * 30);
+				for (int j = 0; j != pause && i != size; j++, i++)
+				{
+					data[i] = 0;
+				}
+			}
+		}
+		break;
+
+	case SHAPE_PLATEAUS:
+		//long runs of equal values, stressing the tie handling
+		{
+			int i = 0;
+			while (i != size)
+			{
+				const int length = 1 + (int)(uniform(random) * 1000);
+				const double value = (double)(int)(uniform(random) * 8);
+				for (int j = 0; j != length && i != size; j++, i++)
+				{
+					data[i] = value;
+				}
+			}
+		}
+		break;
+
+	default:
+		for (int i = 0; i != size; i++)
+		{
+			data[i] = (double)i / size;
+		}
+	}
+}
+
+
+/** Results of one benchmark configuration. */
+struct TMeasurement
+{
+	double RunNs;					///< ns per vertex for RunPersistence
+	double PairsNs;					///< ns per vertex for GetPairedExtrema
+	double IndicesNs;				///< ns per vertex for GetExtremaIndices
+	double ColdAllocations;			///< allocations of the first run of a new object, all three calls
+	double WarmAllocations;			///< allocations per run of a reused object, all three calls
+	size_t WarmRunAllocations;		///< allocations of all warm RunPersistence calls alone; must be 0
+	size_t PeakBytes;				///< peak heap memory of the first run, not counting the input
+	size_t Pairs;					///< number of pairs found
+	bool SameAsBorrow;				///< the pairs are the same as those of borrow at the same threshold
+};
+
+typedef std::chrono::steady_clock TClock;
+
+static double ElapsedNs(const TClock::time_point& start, const TClock::time_point& end)
+{
+	return (double)std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+}
+
+/*!
+	Runs the engine once in the given mode, and collects pairs and extrema indices.
+*/
+static void RunOnce(Persistence1D& p, const TMode mode, const std::vector<double>& data, const double threshold,
+					const double quantum, std::vector<TPairedExtrema>& pairs, std::vector<int>& mins, std::vector<int>& maxs,
+					double* runNs = 0, double* pairsNs = 0, double* indicesNs = 0, size_t* runAllocations = 0)
+{
+	TRunOptions options;
+	options.CompressExtrema = (mode == MODE_COMPRESS || mode == MODE_THRESHOLD || mode == MODE_COMPACT);
+	options.CompactLayout = (mode == MODE_PACKED || mode == MODE_COMPACT);
+	options.Threshold = (mode == MODE_THRESHOLD) ? threshold : 0;
+	options.SortEngine = (mode == MODE_RADIX) ? SORT_RADIX : (mode == MODE_QUANTIZED) ? SORT_QUANTIZED : SORT_COMPARISON;
+	options.SortQuantum = quantum;
+	options.DeferPairSort = (mode == MODE_DEFERRED);
+
+	const size_t allocationsBefore = HeapCounters.Allocations;
+	TClock::time_point start = TClock::now();
+	if (mode == MODE_COPY)
+	{
+		p.RunPersistence(data);
+	}
+	else
+	{
+		p.RunPersistence(&data[0], (int)data.size(), 1, options);
+	}
+	TClock::time_point ran = TClock::now();
+	if (runAllocations) *runAllocations += HeapCounters.Allocations - allocationsBefore;
+	p.GetPairedExtrema(pairs, options.Threshold);
+	TClock::time_point paired = TClock::now();
+	p.GetExtremaIndices(mins, maxs, options.Threshold);
+	TClock::time_point indexed = TClock::now();
+
+	if (runNs) *runNs += ElapsedNs(start, ran);
+	if (pairsNs) *pairsNs += ElapsedNs(ran, paired);
+	if (indicesNs) *indicesNs += ElapsedNs(paired, indexed);
+}
+
+/*!
+	Measures one configuration. Repeats the run until about 2*10^6 vertices are processed, at least 3 times.
+*/
+TMeasurement Measure(const TMode mode, const std::vector<double>& data, const double threshold, const double quantum)
+{
+	TMeasurement m;
+	std::vector<TPairedExtrema> pairs;
+	std::vector<int> mins;
+	std::vector<int> maxs;
+
+	//cold run: a new object and new result vectors
+	{
+		const size_t liveBefore = HeapCounters.LiveBytes;
+		const size_t allocationsBefore = HeapCounters.Allocations;
+		HeapCounters.PeakBytes = liveBefore;
+
+		Persistence1D cold;
+		RunOnce(cold, mode, data, threshold, quantum, pairs, mins, maxs);
+
+		m.ColdAllocations = (double)(HeapCounters.Allocations - allocationsBefore);
+		m.PeakBytes = HeapCounters.PeakBytes - liveBefore;
+		m.Pairs = pairs.size();
+	}
+
+	//reference: borrow, reporting the pairs at the threshold of this mode
+	{
+		Persistence1D reference;
+		std::vector<TPairedExtrema> referencePairs;
+		reference.RunPersistence(&data[0], (int)data.size());
+		reference.GetPairedExtrema(referencePairs, (mode == MODE_THRESHOLD) ? threshold : 0);
+
+		m.SameAsBorrow = (referencePairs.size() == pairs.size());
+		for (size_t i = 0; m.SameAsBorrow && i != pairs.size(); i++)
+		{
+			m.SameAsBorrow = (referencePairs[i].MinIndex == pairs[i].MinIndex && referencePairs[i].MaxIndex == pairs[i].MaxIndex &&
+							  referencePairs[i].Persistence == pairs[i].Persistence);
+		}
+	}
+
+	//warm runs: one object and one set of result vectors, reused
+	Persistence1D p;
+	RunOnce(p, mode, data, threshold, quantum, pairs, mins, maxs);
+
+	const int repeats = std::max(3, (int)(2000000 / data.size()));
+	const size_t allocationsBefore = HeapCounters.Allocations;
+	double runNs = 0, pairsNs = 0, indicesNs = 0;
+	m.WarmRunAllocations = 0;
+	for (int r = 0; r != repeats; r++)
+	{
+		RunOnce(p, mode, data, threshold, quantum, pairs, mins, maxs, &runNs, &pairsNs, &indicesNs, &m.WarmRunAllocations);
+	}
+
+	const double vertices = (double)repeats * data.size();
+	m.WarmAllocations = (double)(HeapCounters.Allocations - allocationsBefore) / repeats;
+	m.RunNs = runNs / vertices;
+	m.PairsNs = pairsNs / vertices;
+	m.IndicesNs = indicesNs / vertices;
+	return m;
+}
+
+
+/*!
+	Times BatchPersistence1D on signalCount signals of signalLength vertices each, cut from one input of the given shape,
+	with 1, 2, 4 and one thread per hardware thread. Returns false if a thread count finds other pairs than one thread.
+*/
+static bool MeasureBatch(const TShape shape, const int signalCount, const int signalLength, const bool csv)
+{
+	std::vector<double> data;
+	CreateData(shape, signalCount * signalLength, data);
+
+	std::vector<size_t> offsets(signalCount + 1);
+	for (int i = 0; i <= signalCount; i++) offsets[i] = (size_t)i * signalLength;
+
+	const unsigned int hardwareThreads = std::max(1u, std::thread::hardware_concurrency());
+	std::vector<unsigned int> threadCounts;
+	threadCounts.push_back(1);
+	threadCounts.push_back(2);
+	threadCounts.push_back(4);
+	if (hardwareThreads > 4) threadCounts.push_back(hardwareThreads);
+
+	if (csv)
+	{
+		printf("shape,signals,signal_length,threads,batch_ms,vertices_per_s,speedup,efficiency\n");
+	}
+	else
+	{
+		printf("Batch: %s, %d signals of %d vertices, %u hardware threads\n\n", ShapeNames[shape], signalCount, signalLength, hardwareThreads);
+		printf("%7s %11s %14s %9s %11s\n", "threads", "batch ms", "vertices/s", "speedup", "efficiency");
+	}
+
+	bool allSame = true;
+	double oneThreadNs = 0;
+	TBatchResults reference;
+	for (size_t t = 0; t != threadCounts.size(); t++)
+	{
+		BatchPersistence1D batch(threadCounts[t]);
+		TBatchResults results;
+
+		//warm run: starts the workspaces of all threads
+		batch.RunPersistence(data, offsets, results);
+
+		int repeats = 0;
+		const TClock::time_point start = TClock::now();
+		TClock::time_point end = start;
+		while (repeats < 3 || ElapsedNs(start, end) < 5e8)
+		{
+			batch.RunPersistence(data, offsets, results);
+			end = TClock::now();
+			repeats++;
+		}
+		const double batchNs = ElapsedNs(start, end) / repeats;
+
+		if (t == 0)
+		{
+			oneThreadNs = batchNs;
+			reference = results;
+		}
+
+		bool same = (results.PairOffsets == reference.PairOffsets && results.GlobalMinimumIndices == reference.GlobalMinimumIndices);
+		for (size_t i = 0; same && i != results.Pairs.size(); i++)
+		{
+			same = (results.Pairs[i].MinIndex == reference.Pairs[i].MinIndex && results.Pairs[i].MaxIndex == reference.Pairs[i].MaxIndex &&
+					results.Pairs[i].Persistence == reference.Pairs[i].Persistence);
+		}
+		if (!same)
+		{
+			fprintf(stderr, "Mismatch: %u threads find other pairs than 1 thread\n", threadCounts[t]);
+			allSame = false;
+		}
+
+		//efficiency is relative to the threads that can actually run at once
+		const double speedup = oneThreadNs / batchNs;
+		const double efficiency = speedup / std::min(threadCounts[t], hardwareThreads);
+		if (csv)
+		{
+			printf("%s,%d,%d,%u,%.3f,%.0f,%.2f,%.2f\n", ShapeNames[shape], signalCount, signalLength, threadCounts[t],
+				batchNs / 1e6, data.size() / batchNs * 1e9, speedup, efficiency);
+		}
+		else
+		{
+			printf("%7u %11.3f %14.0f %9.2f %11.2f\n", threadCounts[t], batchNs / 1e6, data.size() / batchNs * 1e9, speedup, efficiency);
+		}
+		fflush(stdout);
+	}
+	return allSame;
+}
+
+
+static int FindName(const char* name, const char** names, const int count)
+{
+	for (int i = 0; i != count; i++)
+	{
+		if (strcmp(name, names[i]) == 0) return i;
+	}
+	fprintf(stderr, "Unknown name: %s\n", name);
+	exit(1);
+}
+
+int main(int argc, char** argv)
+{
+	int minSize = 100;
+	int maxSize = 10000000;
+	int onlyShape = -1;
+	int onlyMode = -1;
+	double threshold = 0.03;
+	double quantum = 1e-4;
+	bool csv = false;
+	bool batch = false;
+	int signals = 4096;
+	int signalLength = 2048;
+
+	for (int i = 1; i < argc; i++)
+	{
+		const std::string arg = argv[i];
+		const bool hasValue = i + 1 < argc;
+
+		if (arg == "--min-size" && hasValue) minSize = atoi(argv[++i]);
+		else if (arg == "--max-size" && hasValue) maxSize = atoi(argv[++i]);
+		else if (arg == "--shape" && hasValue) onlyShape = FindName(argv[++i], ShapeNames, SHAPE_COUNT);
+		else if (arg == "--mode" && hasValue) onlyMode = FindName(argv[++i], ModeNames, MODE_COUNT);
+		else if (arg == "--threshold" && hasValue) threshold = atof(argv[++i]);
+		else if (arg == "--quantum" && hasValue) quantum = atof(argv[++i]);
+		else if (arg == "--csv") csv = true;
+		else if (arg == "--batch") batch = true;
+		else if (arg == "--signals" && hasValue) signals = atoi(argv[++i]);
+		else if (arg == "--signal-length" && hasValue) signalLength = atoi(argv[++i]);
+		else if (arg == "--simd" && hasValue)
+		{
+			SetSimdLevel((TSimdLevel)FindName(argv[++i], SimdLevelNames, 3));
+		}
+		else
+		{
+			fprintf(stderr, "Usage: %s [--min-size n] [--max-size n] [--shape name] [--mode name] "
+							"[--simd none|sse2|avx2] [--threshold t] [--quantum q] [--csv]\n"
+							"       %s --batch [--signals n] [--signal-length n] [--shape name] [--csv]\n", argv[0], argv[0]);
+			return 1;
+		}
+	}
+
+	if (batch)
+	{
+		if (signals <= 0 || signalLength <= 0)
+		{
+			fprintf(stderr, "--signals and --signal-length must be positive\n");
+			return 1;
+		}
+		CountHeap = false;
+		return MeasureBatch((onlyShape >= 0) ? (TShape)onlyShape : SHAPE_WALK, signals, signalLength, csv) ? 0 : 2;
+	}
+
+	if (csv)
+	{
+		printf("shape,mode,size,run_ns,pairs_ns,indices_ns,cold_allocs,warm_allocs,peak_bytes,bytes_per_vertex,pairs\n");
+	}
+	else
+	{
+		printf("SIMD: %s, threshold: %g, quantum: %g\n\n", SimdLevelNames[GetSimdLevel()], threshold, quantum);
+		printf("%-9s %-9s %9s %9s %9s %9s %11s %11s %11s %9s %9s\n",
+			"shape", "mode", "size", "run ns", "pairs ns", "index ns", "cold alloc", "warm alloc", "peak KiB", "B/vertex", "pairs");
+	}
+
+	bool allSame = true;
+	bool warmAllocates = false;
+	std::vector<double> data;
+	for (int shape = 0; shape != SHAPE_COUNT; shape++)
+	{
+		if (onlyShape >= 0 && shape != onlyShape) continue;
+
+		for (long long size = 100; size <= maxSize; size *= 10)
+		{
+			if (size < minSize) continue;
+			CreateData((TShape)shape, (int)size, data);
+
+			for (int mode = 0; mode != MODE_COUNT; mode++)
+			{
+				if (onlyMode >= 0 && mode != onlyMode) continue;
+
+				const TMeasurement m = Measure((TMode)mode, data, threshold, quantum);
+				if (!m.SameAsBorrow)
+				{
+					fprintf(stderr, "Mismatch: %s %s %lld pairs differ from borrow\n", ShapeNames[shape], ModeNames[mode], size);
+					allSame = false;
+				}
+				if (m.WarmRunAllocations != 0)
+				{
+					fprintf(stderr, "Allocations: %s %s %lld warm RunPersistence allocated %lu times\n", ShapeNames[shape], ModeNames[mode],
+						size, (unsigned long)m.WarmRunAllocations);
+					warmAllocates = true;
+				}
+				printf(csv ? "%s,%s,%lld,%.3f,%.3f,%.3f,%.0f,%.2f,%lu,%.2f,%lu\n"
+						   : "%-9s %-9s %9lld %9.3f %9.3f %9.3f %11.0f %11.2f %11lu %9.2f %9lu\n",
+					ShapeNames[shape], ModeNames[mode], size, m.RunNs, m.PairsNs, m.IndicesNs,
+					m.ColdAllocations, m.WarmAllocations,
+					(unsigned long)(csv ? m.PeakBytes : m.PeakBytes / 1024), (double)m.PeakBytes / size,
+					(unsigned long)m.Pairs);
+				fflush(stdout);
+			}
+		}
+	}
+
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	if (!csv) printf("\nMaximum resident set size: %ld KiB\n", usage.ru_maxrss);
+
+	return !allSame ? 2 : warmAllocates ? 3 : 0;
+}
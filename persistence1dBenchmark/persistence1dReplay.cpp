@@ -0,0 +1,238 @@
+/*! \file persistence1dReplay.cpp
+    Replays recorded mouse event logs through the submovement analysis of AutoGain, for a grid of parameters.
+
+	Every log is split into click windows like AutoGain splits the live stream, and every window is analysed
+	with every parameter set of the grid, see persistence1d_replay.hpp. The grid is the product of the lists
+	given for each parameter; parameters without a list keep the value AutoGain uses. Results are written as
+	binary TReplayWindow records, or with --csv as one line per window and parameter set.
+
+	Builds on Linux with
+		g++ -std=c++11 -O2 -pthread -I../persistence1dWrapper persistence1dReplay.cpp -o persistence1dReplay
+
+	Usage:
+		persistence1dReplay --out file [--csv] [--curves file] [--threads n]
+		                    [--curve autogain.csv] [--cpi c] [--ppi p]
+		                    [--threshold list] [--clutch list] [--angle list] [--overshoot list]
+		                    [--interrupted list] [--rate list] [--ballistic list] log...
+
+	Lists are comma separated, e.g. --threshold 0.02,0.03,0.04. Angles are in degrees, clutch timespans in ms.
+	--curve reads a gain curve saved by AutoGain, with its cpi and ppi, as the curve every log starts with.
+	--curves writes the curve each parameter set learned from each log, one line per log and parameter set.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include "persistence1d_replay.hpp"
+
+using namespace p1d;
+
+/*!
+	Parses a comma separated list of numbers. Returns false if it is empty or a number is malformed.
+*/
+static bool ParseList(const char* text, std::vector<double>& values)
+{
+	values.clear();
+	const char* p = text;
+	for (;;)
+	{
+		char* end = 0;
+		const double value = strtod(p, &end);
+		if (end == p) return false;
+		values.push_back(value);
+
+		if (*end == 0) return true;
+		if (*end != ',') return false;
+		p = end + 1;
+	}
+}
+
+/*!
+	Reads a gain curve saved by AutoGain.saveAutoGain: device id, rate, cpi, ppi, number of values, then the values,
+	one per line.
+*/
+static bool LoadCurve(const char* fileName, TReplaySettings& settings)
+{
+	FILE* file = fopen(fileName, "r");
+	if (file == 0) return false;
+
+	char line[256];
+	double rate = 0;
+	int count = 0;
+	bool success = fgets(line, sizeof(line), file) != 0 &&
+				   fscanf(file, "%lf %lf %lf %d", &rate, &settings.Cpi, &settings.Ppi, &count) == 4 && count > 0;
+
+	settings.InitialCurve.resize(success ? count : 0);
+	for (int i = 0; success && i != count; i++)
+	{
+		success = fscanf(file, "%lf", &settings.InitialCurve[i]) == 1;
+	}
+	fclose(file);
+	return success;
+}
+
+int main(int argc, char** argv)
+{
+	const char* outName = 0;
+	const char* curvesName = 0;
+	bool csv = false;
+	unsigned int threads = 0;
+	TReplaySettings settings;
+	double cpi = 0, ppi = 0;
+	std::vector<const char*> logs;
+
+	//one list per parameter, in the order of TReplayParams
+	enum { THRESHOLD, CLUTCH, ANGLE, OVERSHOOT, INTERRUPTED, RATE, BALLISTIC, PARAM_COUNT };
+	static const char* listNames[PARAM_COUNT] = { "--threshold", "--clutch", "--angle", "--overshoot", "--interrupted", "--rate", "--ballistic" };
+	const TReplayParams defaults;
+	std::vector<double> lists[PARAM_COUNT];
+	lists[THRESHOLD].assign(1, defaults.PersistenceThreshold);
+	lists[CLUTCH].assign(1, defaults.ClutchTimespan);
+	lists[ANGLE].assign(1, defaults.UnaimedAngle * 180 / 3.14159265358979323846);
+	lists[OVERSHOOT].assign(1, defaults.OvershootThreshold);
+	lists[INTERRUPTED].assign(1, defaults.InterruptedThreshold);
+	lists[RATE].assign(1, defaults.GainChangeRate);
+	lists[BALLISTIC].assign(1, defaults.BallisticSubmovements);
+
+	bool valid = true;
+	for (int i = 1; i < argc && valid; i++)
+	{
+		const std::string arg = argv[i];
+		const bool hasValue = i + 1 < argc;
+
+		int list = -1;
+		for (int l = 0; l != PARAM_COUNT; l++)
+		{
+			if (arg == listNames[l]) list = l;
+		}
+
+		if (list >= 0 && hasValue) valid = ParseList(argv[++i], lists[list]);
+		else if (arg == "--out" && hasValue) outName = argv[++i];
+		else if (arg == "--curves" && hasValue) curvesName = argv[++i];
+		else if (arg == "--csv") csv = true;
+		else if (arg == "--threads" && hasValue) threads = (unsigned int)atoi(argv[++i]);
+		else if (arg == "--curve" && hasValue)
+		{
+			valid = LoadCurve(argv[++i], settings);
+			if (!valid) fprintf(stderr, "Cannot read gain curve %s\n", argv[i]);
+		}
+		else if (arg == "--cpi" && hasValue) cpi = atof(argv[++i]);
+		else if (arg == "--ppi" && hasValue) ppi = atof(argv[++i]);
+		else if (arg.compare(0, 2, "--") != 0) logs.push_back(argv[i]);
+		else valid = false;
+	}
+
+	if (!valid || outName == 0 || logs.empty())
+	{
+		fprintf(stderr, "Usage: %s --out file [--csv] [--curves file] [--threads n] [--curve autogain.csv] [--cpi c] [--ppi p] "
+						"[--threshold list] [--clutch list] [--angle list] [--overshoot list] [--interrupted list] "
+						"[--rate list] [--ballistic list] log...\n", argv[0]);
+		return 1;
+	}
+	if (cpi > 0) settings.Cpi = cpi;
+	if (ppi > 0) settings.Ppi = ppi;
+
+	//the grid: every combination of the lists, the last parameter varying fastest
+	std::vector<TReplayParams> grid(1);
+	for (int l = 0; l != PARAM_COUNT; l++)
+	{
+		std::vector<TReplayParams> expanded;
+		for (size_t g = 0; g != grid.size(); g++)
+		{
+			for (size_t v = 0; v != lists[l].size(); v++)
+			{
+				TReplayParams params = grid[g];
+				const double value = lists[l][v];
+				switch (l)
+				{
+				case THRESHOLD: params.PersistenceThreshold = value; break;
+				case CLUTCH: params.ClutchTimespan = value; break;
+				case ANGLE: params.UnaimedAngle = value * 3.14159265358979323846 / 180; break;
+				case OVERSHOOT: params.OvershootThreshold = value; break;
+				case INTERRUPTED: params.InterruptedThreshold = value; break;
+				case RATE: params.GainChangeRate = value; break;
+				case BALLISTIC: params.BallisticSubmovements = (int)value; break;
+				}
+				expanded.push_back(params);
+			}
+		}
+		grid.swap(expanded);
+	}
+
+	printf("%-6s %9s %9s %9s %9s %11s %9s %9s\n", "params", "threshold", "clutch", "angle", "overshoot", "interrupted", "rate", "ballistic");
+	for (size_t g = 0; g != grid.size(); g++)
+	{
+		printf("%-6lu %9g %9g %9g %9g %11g %9g %9d\n", (unsigned long)g, grid[g].PersistenceThreshold, grid[g].ClutchTimespan,
+			grid[g].UnaimedAngle * 180 / 3.14159265358979323846, grid[g].OvershootThreshold, grid[g].InterruptedThreshold,
+			grid[g].GainChangeRate, grid[g].BallisticSubmovements);
+	}
+
+	TReplayFileWriter writer;
+	if (!writer.Open(outName, grid, csv))
+	{
+		fprintf(stderr, "Cannot write %s\n", outName);
+		return 1;
+	}
+
+	FILE* curves = 0;
+	if (curvesName != 0 && (curves = fopen(curvesName, "w")) == 0)
+	{
+		fprintf(stderr, "Cannot write %s\n", curvesName);
+		return 1;
+	}
+
+	TReplayEngine engine(threads);
+	printf("\n%u threads, %lu parameter sets\n\n", engine.GetThreadCount(), (unsigned long)grid.size());
+	printf("%-7s %12s %10s %9s %12s  %s\n", "session", "events", "windows", "seconds", "events/s", "log");
+
+	bool success = true;
+	unsigned long long totalEvents = 0;
+	const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	for (size_t session = 0; session != logs.size(); session++)
+	{
+		TEventLogReader log;
+		if (!log.Open(logs[session]))
+		{
+			fprintf(stderr, "Cannot read event log %s\n", logs[session]);
+			success = false;
+			continue;
+		}
+
+		const unsigned long long windowsBefore = writer.GetCount();
+		const std::chrono::steady_clock::time_point logStart = std::chrono::steady_clock::now();
+		engine.Replay(log, (unsigned int)session, grid, settings, writer);
+		const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - logStart).count();
+
+		printf("%-7lu %12llu %10llu %9.3f %12.0f  %s\n", (unsigned long)session, log.GetEventCount(),
+			(writer.GetCount() - windowsBefore) / grid.size(), seconds, log.GetEventCount() / std::max(seconds, 1e-9), logs[session]);
+		totalEvents += log.GetEventCount();
+
+		for (size_t g = 0; curves != 0 && g != grid.size(); g++)
+		{
+			const std::vector<double>& curve = engine.GetCurve(g);
+			fprintf(curves, "%lu,%lu", (unsigned long)session, (unsigned long)g);
+			for (size_t i = 0; i != curve.size(); i++) fprintf(curves, ",%.17g", curve[i]);
+			fprintf(curves, "\n");
+		}
+	}
+
+	if (!writer.Close())
+	{
+		fprintf(stderr, "Writing %s failed\n", outName);
+		success = false;
+	}
+	if (curves != 0 && fclose(curves) != 0)
+	{
+		fprintf(stderr, "Writing %s failed\n", curvesName);
+		success = false;
+	}
+
+	const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	printf("\n%llu events, %llu results in %.3f s, %.0f events/s per parameter set\n",
+		totalEvents, writer.GetCount(), seconds, totalEvents * (double)grid.size() / std::max(seconds, 1e-9));
+	return success ? 0 : 1;
+}
@@ -4,4 +4,8 @@
 
 #pragma once
 #include "persistence1d.hpp"
+#include "persistence1d_sliding.hpp"
+#include "persistence1d_eventlog.hpp"
+#include "persistence1d_eventqueue.h"
+#include "persistence1d_gaincurve.h"
 
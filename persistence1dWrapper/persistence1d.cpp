@@ -17,12 +17,147 @@ namespace persistence1d
 
 	bool p1d::RunPersistence(Collections::Generic::List<double>^ InputData)
 	{
-		std::vector<double> vec;
-		for each (double i in InputData)
+		return this->RunPersistence(InputData, 0);
+	}
+
+	int p1d::CopyToInputBuffer(Collections::Generic::List<double>^ data)
+	{
+		//List<T> does not expose its buffer to pin, so it is copied in bulk into an array that is 
+		//kept and pinned instead; it only grows, so runs on lists of similar length do not allocate
+		if (inputBuffer == nullptr || inputBuffer->Length < data->Count)
+		{
+			inputBuffer = gcnew array<double>(data->Capacity);
+		}
+		data->CopyTo(inputBuffer);
+		return data->Count;
+	}
+
+	bool p1d::RunPersistence(Collections::Generic::List<double>^ InputData, double threshold)
+	{
+		P1D_STATS_ONLY(const long long start = StatsNow());
+		const int length = CopyToInputBuffer(InputData);
+		P1D_STATS_ONLY(const long long copied = StatsNow());
+
+		const bool success = this->RunPersistence(inputBuffer, length, threshold);
+		P1D_STATS_ONLY(p->AddPhaseTime(PHASE_MARSHAL, copied - start));
+		return success;
+	}
+
+	bool p1d::RunPersistence(array<double>^ InputData)
+	{
+		return this->RunPersistence(InputData, 0);
+	}
+
+	bool p1d::RunPersistence(array<double>^ InputData, double threshold)
+	{
+		return this->RunPersistence(InputData, InputData->Length, threshold);
+	}
+
+	bool p1d::RunPersistence(array<double>^ InputData, int length, double threshold)
+	{
+		//AutoGain feeds smoothed speed profiles, which are mostly monotone runs
+		//verification is linear, so every run is checked
+		TRunOptions options;
+		options.CompressExtrema = true;
+		options.Threshold = threshold;
+		options.Verify = true;
+		//the ordered queries of AutoGain work on unsorted pairs; GetPairedExtrema sorts them on first use
+		options.DeferPairSort = true;
+
+		if (length == 0)
+		{
+			return p->RunPersistence((const double*)0, 0, 1, options);
+		}
+
+		//the array is pinned for the duration of the run, the native code reads it in place
+		pin_ptr<double> pinned = &InputData[0];
+		return p->RunPersistence(pinned, length, 1, options);
+	}
+
+	bool p1d::RunFilteredPersistence(Collections::Generic::List<double>^ InputData, array<double>^ kernel, int kernelCenter, double threshold)
+	{
+		P1D_STATS_ONLY(const long long start = StatsNow());
+		const int length = CopyToInputBuffer(InputData);
+		P1D_STATS_ONLY(const long long copied = StatsNow());
+
+		const bool success = this->RunFilteredPersistence(inputBuffer, length, kernel, kernelCenter, threshold);
+		P1D_STATS_ONLY(p->AddPhaseTime(PHASE_MARSHAL, copied - start));
+		return success;
+	}
+
+	bool p1d::RunFilteredPersistence(array<double>^ InputData, array<double>^ kernel, int kernelCenter, double threshold)
+	{
+		return this->RunFilteredPersistence(InputData, InputData->Length, kernel, kernelCenter, threshold);
+	}
+
+	bool p1d::RunFilteredPersistence(array<double>^ InputData, int length, array<double>^ kernel, int kernelCenter, double threshold)
+	{
+		TRunOptions options;
+		options.CompressExtrema = true;
+		options.Threshold = threshold;
+		options.Verify = true;
+		//the ordered queries of AutoGain work on unsorted pairs; GetPairedExtrema sorts them on first use
+		options.DeferPairSort = true;
+
+		if (kernel->Length == 0 || kernelCenter < 0 || kernelCenter >= kernel->Length)
 		{
-			vec.push_back(i);
+			throw gcnew ArgumentOutOfRangeException("kernelCenter");
 		}
-		return p->RunPersistence(vec);
+
+		//smoothing and persistence both run natively on the pinned arrays
+		pin_ptr<double> pinnedKernel = &kernel[0];
+		if (length == 0)
+		{
+			return p->RunFilteredPersistence((const double*)0, 0, pinnedKernel, kernel->Length, kernelCenter, options);
+		}
+
+		pin_ptr<double> pinned = &InputData[0];
+		return p->RunFilteredPersistence(pinned, length, pinnedKernel, kernel->Length, kernelCenter, options);
+	}
+
+	void p1d::GetFilteredData(Collections::Generic::List<double>^ filteredData)
+	{
+		filteredData->Clear();
+		filteredData->AddRange(GetFilteredData());
+	}
+
+	array<double>^ p1d::GetFilteredData()
+	{
+		//sized once and filled with one copy from the native data
+		const TDataView data = p->GetFilteredDataView();
+		array<double>^ filteredData = gcnew array<double>(data.Size);
+		if (data.Size != 0)
+		{
+			Runtime::InteropServices::Marshal::Copy(IntPtr((void*)data.Ptr), filteredData, 0, data.Size);
+		}
+		return filteredData;
+	}
+
+	bool p1d::AppendSamples(Collections::Generic::List<double>^ Samples)
+	{
+		const int length = CopyToInputBuffer(Samples);
+		return this->AppendSamples(inputBuffer, length);
+	}
+
+	bool p1d::AppendSamples(array<double>^ Samples)
+	{
+		return this->AppendSamples(Samples, Samples->Length);
+	}
+
+	bool p1d::AppendSamples(array<double>^ Samples, int length)
+	{
+		if (length == 0)
+		{
+			return p->AppendSamples((const double*)0, 0);
+		}
+
+		pin_ptr<double> pinned = &Samples[0];
+		return p->AppendSamples(pinned, length);
+	}
+
+	int p1d::DiscardSamples()
+	{
+		return p->DiscardSamples();
 	}
 
 	bool p1d::GetPairedExtrema(Collections::Generic::List<int>^ mins,
@@ -51,6 +186,7 @@ namespace persistence1d
 		if (success == false)
 			return false;
 
+		P1D_STATS_ONLY(const long long start = StatsNow());
 		mins->Clear();
 		maxs->Clear();
 		persistents->Clear();
@@ -61,11 +197,37 @@ namespace persistence1d
 			maxs->Add(tp.MaxIndex);
 			persistents->Add(tp.Persistence);
 		}
+		P1D_STATS_ONLY(p->AddPhaseTime(PHASE_MARSHAL, StatsNow() - start));
 
 		return success;
 	}
 
 
+	bool p1d::GetTopPairs(int count,
+		Collections::Generic::List<int>^ mins,
+		Collections::Generic::List<int>^ maxs,
+		Collections::Generic::List<double>^ persistents)
+	{
+		mins->Clear();
+		maxs->Clear();
+		persistents->Clear();
+
+		std::vector<TPairedExtrema> vec;
+		if (count <= 0 || !p->GetTopPairs(vec, (size_t)count)) return false;
+
+		P1D_STATS_ONLY(const long long start = StatsNow());
+		for each(TPairedExtrema tp in vec)
+		{
+			mins->Add(tp.MinIndex);
+			maxs->Add(tp.MaxIndex);
+			persistents->Add(tp.Persistence);
+		}
+		P1D_STATS_ONLY(p->AddPhaseTime(PHASE_MARSHAL, StatsNow() - start));
+
+		return true;
+	}
+
+
 	bool p1d::GetExtremaIndices(
 		Collections::Generic::List<int>^ min,
 		Collections::Generic::List<int>^ max)
@@ -96,6 +258,86 @@ namespace persistence1d
 
 		if (!success) return false;
 
+		P1D_STATS_ONLY(const long long start = StatsNow());
+		for each (int val in minvec)
+		{
+			min->Add(val);
+		}
+		for each (int val in maxvec)
+		{
+			max->Add(val);
+		}
+		P1D_STATS_ONLY(p->AddPhaseTime(PHASE_MARSHAL, StatsNow() - start));
+
+		return true;
+	}
+
+	bool p1d::GetSegments(
+		Collections::Generic::List<int>^ startMins,
+		Collections::Generic::List<int>^ peakMaxs,
+		Collections::Generic::List<int>^ endMins,
+		Collections::Generic::List<double>^ persistents,
+		double threshold)
+	{
+		std::vector<TSegment> vec;
+		bool success = p->GetSegments(vec, threshold);
+
+		startMins->Clear();
+		peakMaxs->Clear();
+		endMins->Clear();
+		persistents->Clear();
+
+		for each(TSegment segment in vec)
+		{
+			startMins->Add(segment.StartMinIndex);
+			peakMaxs->Add(segment.PeakMaxIndex);
+			endMins->Add(segment.EndMinIndex);
+			persistents->Add(segment.Persistence);
+		}
+
+		return success;
+	}
+
+	int p1d::CountFeatures(double threshold)
+	{
+		return (int)p->CountFeatures(threshold);
+	}
+
+	void p1d::GetFeatureCounts(
+		Collections::Generic::List<double>^ thresholds,
+		Collections::Generic::List<int>^ counts)
+	{
+		std::vector<double> thresholdvec;
+		std::vector<size_t> countvec;
+		thresholdvec.reserve(thresholds->Count);
+		for each (double val in thresholds)
+		{
+			thresholdvec.push_back(val);
+		}
+
+		p->GetFeatureCounts(thresholdvec, countvec);
+
+		counts->Clear();
+		for each (size_t val in countvec)
+		{
+			counts->Add((int)val);
+		}
+	}
+
+	bool p1d::GetOrderedExtremaIndices(
+		Collections::Generic::List<int>^ min,
+		Collections::Generic::List<int>^ max,
+		double threshold)
+	{
+		std::vector<int> minvec;
+		std::vector<int> maxvec;
+		min->Clear();
+		max->Clear();
+
+		bool success = p->GetOrderedExtremaIndices(minvec, maxvec, threshold);
+
+		if (!success) return false;
+
 		for each (int val in minvec)
 		{
 			min->Add(val);
@@ -126,4 +368,290 @@ namespace persistence1d
 	{
 		return p->VerifyResults();
 	}
+
+	bool p1d::GetRunStats(Collections::Generic::Dictionary<String^, double>^ stats)
+	{
+		stats->Clear();
+#ifdef P1D_STATS
+		const TRunStats& run = p->GetRunStats();
+		const TLatencyHistogram& latency = p->GetLatencyHistogram();
+
+		stats["copy_ns"] = (double)run.PhaseNs[PHASE_COPY];
+		stats["sort_ns"] = (double)run.PhaseNs[PHASE_SORT];
+		stats["watershed_ns"] = (double)run.PhaseNs[PHASE_WATERSHED];
+		stats["sort_pairs_ns"] = (double)run.PhaseNs[PHASE_SORT_PAIRS];
+		stats["marshal_ns"] = (double)run.PhaseNs[PHASE_MARSHAL];
+		stats["total_ns"] = (double)run.TotalNs;
+		stats["vertices"] = run.Vertices;
+		stats["components_created"] = run.ComponentsCreated;
+		stats["components_merged"] = run.ComponentsMerged;
+		stats["pairs_emitted"] = run.PairsEmitted;
+		stats["grown_vectors"] = run.GrownVectors;
+		stats["grown_bytes"] = (double)run.GrownBytes;
+		stats["runs"] = latency.Size();
+		stats["p50_ns"] = (double)latency.Percentile(0.5);
+		stats["p99_ns"] = (double)latency.Percentile(0.99);
+		stats["max_ns"] = (double)latency.Max();
+		return true;
+#else
+		return false;
+#endif
+	}
+
+	p1dWindow::p1dWindow()
+	{
+		p = new SlidingPersistence1D();
+	}
+
+	p1dWindow::~p1dWindow()
+	{
+		delete p;
+	}
+
+	void p1dWindow::PushBack(double sample)
+	{
+		p->PushBack(sample);
+	}
+
+	void p1dWindow::PopFront()
+	{
+		p->PopFront();
+	}
+
+	void p1dWindow::Clear()
+	{
+		p->Clear();
+	}
+
+	int p1dWindow::Count()
+	{
+		return p->Size();
+	}
+
+	bool p1dWindow::GetPairedExtrema(Collections::Generic::List<int>^ mins,
+		Collections::Generic::List<int>^ maxs,
+		Collections::Generic::List<double>^ persistents,
+		double threshold)
+	{
+		std::vector<TPairedExtrema> vec;
+		bool success = p->GetPairedExtrema(vec, threshold);
+
+		mins->Clear();
+		maxs->Clear();
+		persistents->Clear();
+
+		for each(TPairedExtrema tp in vec)
+		{
+			mins->Add(tp.MinIndex);
+			maxs->Add(tp.MaxIndex);
+			persistents->Add(tp.Persistence);
+		}
+
+		return success;
+	}
+
+	bool p1dWindow::GetExtremaIndices(
+		Collections::Generic::List<int>^ min,
+		Collections::Generic::List<int>^ max,
+		double threshold)
+	{
+		std::vector<int> minvec;
+		std::vector<int> maxvec;
+		min->Clear();
+		max->Clear();
+
+		bool success = p->GetExtremaIndices(minvec, maxvec, threshold);
+
+		if (!success) return false;
+
+		for each (int val in minvec)
+		{
+			min->Add(val);
+		}
+		for each (int val in maxvec)
+		{
+			max->Add(val);
+		}
+
+		return true;
+	}
+
+	int p1dWindow::CountFeatures(double threshold)
+	{
+		return (int)p->CountFeatures(threshold);
+	}
+
+	int p1dWindow::GetGlobalMinimumIndex()
+	{
+		return p->GetGlobalMinimumIndex();
+	}
+
+	double p1dWindow::GetGlobalMinimumValue()
+	{
+		return p->GetGlobalMinimumValue();
+	}
+
+	p1dEventLog::p1dEventLog()
+	{
+		w = new TEventLogWriter();
+	}
+
+	p1dEventLog::~p1dEventLog()
+	{
+		delete w;
+	}
+
+	bool p1dEventLog::Open(String^ fileName, String^ source)
+	{
+		IntPtr file = Runtime::InteropServices::Marshal::StringToHGlobalAnsi(fileName);
+		IntPtr device = Runtime::InteropServices::Marshal::StringToHGlobalAnsi(source);
+
+		bool success = w->Open((const char*)file.ToPointer(), (const char*)device.ToPointer());
+
+		Runtime::InteropServices::Marshal::FreeHGlobal(file);
+		Runtime::InteropServices::Marshal::FreeHGlobal(device);
+		return success;
+	}
+
+	void p1dEventLog::Write(unsigned short buttonflags, int deviceDX, int deviceDY,
+		double systemDX, double systemDY, long long usTimestamp, double timespan)
+	{
+		TMouseEvent e;
+		e.Timestamp = usTimestamp;
+		e.SystemDX = systemDX;
+		e.SystemDY = systemDY;
+		e.Timespan = timespan;
+		e.DeviceDX = deviceDX;
+		e.DeviceDY = deviceDY;
+		e.ButtonFlags = buttonflags;
+		w->Write(e);
+	}
+
+	bool p1dEventLog::Flush()
+	{
+		return w->Flush();
+	}
+
+	bool p1dEventLog::Close()
+	{
+		return w->Close();
+	}
+
+	long long p1dEventLog::Count()
+	{
+		return (long long)w->GetCount();
+	}
+
+	p1dEventQueue::p1dEventQueue(int capacity)
+	{
+		q = new TEventQueue(capacity);
+	}
+
+	p1dEventQueue::~p1dEventQueue()
+	{
+		delete q;
+	}
+
+	bool p1dEventQueue::Push(unsigned short buttonflags, int deviceDX, int deviceDY,
+		double systemDX, double systemDY, long long usTimestamp, double timespan)
+	{
+		TMouseEvent e;
+		e.Timestamp = usTimestamp;
+		e.SystemDX = systemDX;
+		e.SystemDY = systemDY;
+		e.Timespan = timespan;
+		e.DeviceDX = deviceDX;
+		e.DeviceDY = deviceDY;
+		e.ButtonFlags = buttonflags;
+		return q->Push(e);
+	}
+
+	bool p1dEventQueue::TryPop(unsigned short% buttonflags, int% deviceDX, int% deviceDY,
+		double% systemDX, double% systemDY, long long% usTimestamp, double% timespan)
+	{
+		TMouseEvent e;
+		if (!q->Pop(e)) return false;
+
+		buttonflags = e.ButtonFlags;
+		deviceDX = e.DeviceDX;
+		deviceDY = e.DeviceDY;
+		systemDX = e.SystemDX;
+		systemDY = e.SystemDY;
+		usTimestamp = e.Timestamp;
+		timespan = e.Timespan;
+		return true;
+	}
+
+	long long p1dEventQueue::Dropped()
+	{
+		return (long long)q->GetDropped();
+	}
+
+	p1dGainCurve::p1dGainCurve()
+	{
+		c = new TGainCurve();
+	}
+
+	p1dGainCurve::~p1dGainCurve()
+	{
+		delete c;
+	}
+
+	void p1dGainCurve::Publish(Collections::Generic::List<double>^ values)
+	{
+		array<double>^ curve = values->ToArray();
+		if (curve->Length == 0)
+		{
+			c->Publish(0, 0);
+			return;
+		}
+
+		//Publish copies the values into a new snapshot
+		pin_ptr<double> pinned = &curve[0];
+		c->Publish(pinned, curve->Length);
+	}
+
+	void p1dGainCurve::Publish(Collections::Generic::List<double>^ values, double binSize, double countsPerMeter, double cdGain)
+	{
+		//the caller clamps the timespan itself, since its minimum changes with the polling rate
+		TTransferParams params;
+		params.BinSize = binSize;
+		params.CountsPerMeter = countsPerMeter;
+		params.CDGain = cdGain;
+		params.MinTimespan = 0;
+
+		array<double>^ curve = values->ToArray();
+		if (curve->Length == 0)
+		{
+			c->Publish(0, 0, params);
+			return;
+		}
+
+		pin_ptr<double> pinned = &curve[0];
+		c->Publish(pinned, curve->Length, params);
+	}
+
+	double p1dGainCurve::Evaluate(double index)
+	{
+		return c->Evaluate(index);
+	}
+
+	double p1dGainCurve::Translate(double dx, double dy, double timespan, double% tx, double% ty)
+	{
+		double x, y;
+		const double speed = c->Translate(dx, dy, timespan, x, y);
+		tx = x;
+		ty = y;
+		return speed;
+	}
+
+	int p1dGainCurve::Count()
+	{
+		return (int)c->Size();
+	}
+
+	long long p1dGainCurve::Version()
+	{
+		return (long long)c->GetVersion();
+	}
 }
\ No newline at end of file
@@ -11,6 +11,12 @@ namespace persistence1d {
 		// TODO: ⿡  Ŭ  ޼带 ߰մϴ.
 	protected:
 		Persistence1D* p;
+		array<double>^ inputBuffer;	// copy of the last List input, reused by the next runs
+
+		int CopyToInputBuffer(Collections::Generic::List<double>^ data);
+		bool RunPersistence(array<double>^ InputData, int length, double threshold);
+		bool RunFilteredPersistence(array<double>^ InputData, int length, array<double>^ kernel, int kernelCenter, double threshold);
+		bool AppendSamples(array<double>^ Samples, int length);
 
 	public:
 		p1d();
@@ -18,6 +24,16 @@ namespace persistence1d {
 
 
 		bool RunPersistence(Collections::Generic::List<double>^ InputData);
+		bool RunPersistence(Collections::Generic::List<double>^ InputData, double threshold);
+		bool RunPersistence(array<double>^ InputData);
+		bool RunPersistence(array<double>^ InputData, double threshold);
+		bool RunFilteredPersistence(Collections::Generic::List<double>^ InputData, array<double>^ kernel, int kernelCenter, double threshold);
+		bool RunFilteredPersistence(array<double>^ InputData, array<double>^ kernel, int kernelCenter, double threshold);
+		void GetFilteredData(Collections::Generic::List<double>^ filteredData);
+		array<double>^ GetFilteredData();
+		bool AppendSamples(Collections::Generic::List<double>^ Samples);
+		bool AppendSamples(array<double>^ Samples);
+		int DiscardSamples();
 		
 		bool GetPairedExtrema(
 			Collections::Generic::List<int>^ mins,
@@ -34,6 +50,12 @@ namespace persistence1d {
 			Collections::Generic::List<double>^ persistents,
 			double threshold, 
 			bool matlabIndexing);
+
+		/// The count most persistent pairs, from least to most persistent. Selects them without sorting all pairs.
+		bool GetTopPairs(int count,
+			Collections::Generic::List<int>^ mins,
+			Collections::Generic::List<int>^ maxs,
+			Collections::Generic::List<double>^ persistents);
 		
 
 		bool GetExtremaIndices(
@@ -51,11 +73,125 @@ namespace persistence1d {
 			double threshold,
 			bool matlabIndexing);
 
+		bool GetOrderedExtremaIndices(
+			Collections::Generic::List<int>^ min,
+			Collections::Generic::List<int>^ max,
+			double threshold);
+
+		bool GetSegments(
+			Collections::Generic::List<int>^ startMins,
+			Collections::Generic::List<int>^ peakMaxs,
+			Collections::Generic::List<int>^ endMins,
+			Collections::Generic::List<double>^ persistents,
+			double threshold);
+
+		int CountFeatures(double threshold);
+
+		void GetFeatureCounts(
+			Collections::Generic::List<double>^ thresholds,
+			Collections::Generic::List<int>^ counts);
+
 		int GetGlobalMinimumIndex();
 		int GetGlobalMinimumIndex(const bool matlabIndexing);
 
 		double GetGlobalMinimumValue();
 
 		bool VerifyResults();
+
+		/// Statistics of the last run and latencies of the recent runs, by name, see persistence1d_stats.hpp.
+		/// Returns false, and leaves stats empty, if the wrapper is built without P1D_STATS.
+		bool GetRunStats(Collections::Generic::Dictionary<String^, double>^ stats);
+	};
+
+	/// Paired extrema of a sliding window of samples, updated as samples are added and removed.
+	public ref class p1dWindow
+	{
+	protected:
+		SlidingPersistence1D* p;
+
+	public:
+		p1dWindow();
+		virtual ~p1dWindow();
+
+		void PushBack(double sample);
+		void PopFront();
+		void Clear();
+		int Count();
+
+		bool GetPairedExtrema(
+			Collections::Generic::List<int>^ mins,
+			Collections::Generic::List<int>^ maxs,
+			Collections::Generic::List<double>^ persistents,
+			double threshold);
+
+		bool GetExtremaIndices(
+			Collections::Generic::List<int>^ min,
+			Collections::Generic::List<int>^ max,
+			double threshold);
+
+		int CountFeatures(double threshold);
+		int GetGlobalMinimumIndex();
+		double GetGlobalMinimumValue();
+	};
+
+	/// Binary columnar log of raw mouse events, see persistence1d_eventlog.hpp.
+	public ref class p1dEventLog
+	{
+	protected:
+		TEventLogWriter* w;
+
+	public:
+		p1dEventLog();
+		virtual ~p1dEventLog();
+
+		bool Open(String^ fileName, String^ source);
+		void Write(unsigned short buttonflags, int deviceDX, int deviceDY,
+			double systemDX, double systemDY, long long usTimestamp, double timespan);
+		bool Flush();
+		bool Close();
+		long long Count();
+	};
+
+	/// Lock-free queue of raw mouse events from the input thread to one analysis thread, see persistence1d_eventqueue.h.
+	public ref class p1dEventQueue
+	{
+	protected:
+		TEventQueue* q;
+
+	public:
+		p1dEventQueue(int capacity);
+		virtual ~p1dEventQueue();
+
+		bool Push(unsigned short buttonflags, int deviceDX, int deviceDY,
+			double systemDX, double systemDY, long long usTimestamp, double timespan);
+		bool TryPop(
+			[Runtime::InteropServices::Out] unsigned short% buttonflags,
+			[Runtime::InteropServices::Out] int% deviceDX,
+			[Runtime::InteropServices::Out] int% deviceDY,
+			[Runtime::InteropServices::Out] double% systemDX,
+			[Runtime::InteropServices::Out] double% systemDY,
+			[Runtime::InteropServices::Out] long long% usTimestamp,
+			[Runtime::InteropServices::Out] double% timespan);
+		long long Dropped();
+	};
+
+	/// Gain curve published by the learning thread and read without locks on the translation path, see persistence1d_gaincurve.h.
+	public ref class p1dGainCurve
+	{
+	protected:
+		TGainCurve* c;
+
+	public:
+		p1dGainCurve();
+		virtual ~p1dGainCurve();
+
+		void Publish(Collections::Generic::List<double>^ values);
+		void Publish(Collections::Generic::List<double>^ values, double binSize, double countsPerMeter, double cdGain);
+		double Evaluate(double index);
+		double Translate(double dx, double dy, double timespan,
+			[Runtime::InteropServices::Out] double% tx,
+			[Runtime::InteropServices::Out] double% ty);
+		int Count();
+		long long Version();
 	};
 }
@@ -6,11 +6,17 @@
 #define PERSISTENCE_H
 
 #include <assert.h>
+#include <stddef.h>
+#include <string.h>
 #include <algorithm>
 #include <iostream>
 #include <iterator>
+#include <memory>
 #include <vector>
 
+#include "persistence1d_simd.hpp"
+#include "persistence1d_stats.hpp"
+
 #define NO_COLOR -1
 #define RESIZE_FACTOR 20
 #define MATLAB_INDEX_FACTOR 1
@@ -23,11 +29,12 @@ namespace p1d
 	A collection of TIdxAndData is sorted according to its data value (if values are equal, according
 	to indices). The index allows access back to the vertex in the Data vector. 
 */
-struct TIdxAndData
+template <typename TValue>
+struct TBasicIdxAndData
 {
-	TIdxAndData():Idx(-1),Data(0){}
+	TBasicIdxAndData():Idx(-1),Data(0){}
 
-	bool operator<(const TIdxAndData& other) const
+	bool operator<(const TBasicIdxAndData& other) const
 	{
 		if (Data < other.Data) return true;
 		if (Data > other.Data) return false;
@@ -38,7 +45,129 @@ struct TIdxAndData
 	int Idx;
 
 	///Vertex data value from the original Data vector sent as an argument to RunPersistence.
-	double Data;
+	TValue Data;
+};
+typedef TBasicIdxAndData<double> TIdxAndData;
+
+
+#pragma pack(push, 4)
+/** Sort key of a double vertex for the compact layout, see TRunOptions::CompactLayout: 
+	the value mapped to an unsigned integer of the same order, and the vertex index. 12 bytes instead of 16.
+*/
+struct TPackedDoubleKey
+{
+	bool operator<(const TPackedDoubleKey& other) const
+	{
+		if (Key != other.Key) return Key < other.Key;
+		return Idx < other.Idx;
+	}
+
+	unsigned long long Key;
+	int Idx;
+};
+#pragma pack(pop)
+
+/** Maps vertices to sort keys for the compact layout. Keys order like TIdxAndData: by value, 
+	equal values by index. Value types without a packed key use TIdxAndData itself.
+
+	RadixKey maps a value to an unsigned integer of the same order, for SORT_RADIX; 
+	RADIX_BYTES is the number of its low bytes that are used, 0 for types without a radix key.
+*/
+template <typename TValue>
+struct TSortKeyTraits
+{
+	typedef TBasicIdxAndData<TValue> TKey;
+	enum { RADIX_BYTES = 0 };
+
+	static unsigned long long RadixKey(const TValue) { return 0; }
+
+	static TKey Pack(const TValue value, const int idx)
+	{
+		TKey key;
+		key.Data = value;
+		key.Idx = idx;
+		return key;
+	}
+	static int Index(const TKey& key) { return key.Idx; }
+	static TValue Value(const TKey& key) { return key.Data; }
+};
+
+template <>
+struct TSortKeyTraits<double>
+{
+	typedef TPackedDoubleKey TKey;
+	enum { RADIX_BYTES = 8 };
+
+	static unsigned long long RadixKey(const double value)
+	{
+		//-0 and +0 are equal, so they must get the same key
+		const double canonical = (value == 0) ? 0.0 : value;
+		unsigned long long bits;
+		memcpy(&bits, &canonical, sizeof(bits));
+		return (bits >> 63) ? ~bits : (bits | 0x8000000000000000ULL);
+	}
+	static TKey Pack(const double value, const int idx)
+	{
+		TKey key;
+		key.Key = RadixKey(value);
+		key.Idx = idx;
+		return key;
+	}
+	static int Index(const TKey& key) { return key.Idx; }
+	static double Value(const TKey& key)
+	{
+		const unsigned long long bits = (key.Key >> 63) ? (key.Key & 0x7FFFFFFFFFFFFFFFULL) : ~key.Key;
+		double value;
+		memcpy(&value, &bits, sizeof(value));
+		return value;
+	}
+};
+
+//32 bit values and the index fit into one 64 bit integer, value in the upper half
+template <>
+struct TSortKeyTraits<float>
+{
+	typedef unsigned long long TKey;
+	enum { RADIX_BYTES = 4 };
+
+	static unsigned long long RadixKey(const float value)
+	{
+		const float canonical = (value == 0) ? 0.0f : value;
+		unsigned int bits;
+		memcpy(&bits, &canonical, sizeof(bits));
+		return (bits >> 31) ? ~bits : (bits | 0x80000000u);
+	}
+	static TKey Pack(const float value, const int idx)
+	{
+		return (RadixKey(value) << 32) | (unsigned int)idx;
+	}
+	static int Index(const TKey& key) { return (int)(unsigned int)key; }
+	static float Value(const TKey& key)
+	{
+		unsigned int bits = (unsigned int)(key >> 32);
+		bits = (bits >> 31) ? (bits & 0x7FFFFFFFu) : ~bits;
+		float value;
+		memcpy(&value, &bits, sizeof(value));
+		return value;
+	}
+};
+
+template <>
+struct TSortKeyTraits<int>
+{
+	typedef unsigned long long TKey;
+	enum { RADIX_BYTES = 4 };
+
+	static unsigned long long RadixKey(const int value)
+	{
+		return (unsigned int)value ^ 0x80000000u;
+	}
+	static TKey Pack(const int value, const int idx)
+	{
+		return (RadixKey(value) << 32) | (unsigned int)idx;
+	}
+	static int Index(const TKey& key) { return (int)(unsigned int)key; }
+	static int Value(const TKey& key) { return (int)((unsigned int)(key >> 32) ^ 0x80000000u); }
 };
 
 
@@ -46,7 +175,8 @@ struct TIdxAndData
 	A component is created at a local minimum - a vertex whose value is smaller than both of its neighboring 
 	vertices' values.
 */
-struct TComponent
+template <typename TValue>
+struct TBasicComponent
 {
 	///A component is defined by the indices of its edges.
 	///Both variables hold the respective indices of the vertices in Data vector.
@@ -58,20 +188,23 @@ struct TComponent
 	int MinIndex;
 
 	///The value of the Data[MinIndex].
-	double MinValue; //redundant, but makes life easier
+	TValue MinValue; //redundant, but makes life easier
 
 	///Set to true when a component is created. Once components are merged,
 	///the destroyed component Alive value is set to false. 
 	///Used to verify correctness of algorithm.
 	bool Alive;
 };
+typedef TBasicComponent<double> TComponent;
 
 
 /** A pair of matched local minimum and local maximum
 	that define a component above a certain persistence threshold.
 	The persistence value is their (absolute) data difference.
+	For integer value types, the difference must fit into the value type.
 */
-struct TPairedExtrema
+template <typename TValue>
+struct TBasicPairedExtrema
 {
 	///Index of local minimum, as per Data vector.
 	int MinIndex;
@@ -82,15 +215,204 @@ struct TPairedExtrema
 	///The persistence of the two extrema.
 	///Data[MaxIndex] - Data[MinIndex]		 
 	///Guaranteed to be >= 0.
-	double Persistence;	
+	TValue Persistence;	
 
-	bool operator<(const TPairedExtrema& other) const
+	bool operator<(const TBasicPairedExtrema& other) const
 	{
 		if (Persistence < other.Persistence) return true;
 		if (Persistence > other.Persistence) return false;
 		return (MinIndex < other.MinIndex);
 	}
 };
+typedef TBasicPairedExtrema<double> TPairedExtrema;
+
+
+/** A submovement of the simplified data: the data rises from a local minimum to a local maximum
+	and falls to the next local minimum. Consecutive segments share their minima.
+*/
+template <typename TValue>
+struct TBasicSegment
+{
+	///Index of the minimum the segment starts at, as per Data vector.
+	int StartMinIndex;
+
+	///Index of the maximum of the segment, as per Data vector.
+	int PeakMaxIndex;
+
+	///Index of the minimum the segment ends at, as per Data vector.
+	int EndMinIndex;
+
+	///Persistence of the pair PeakMaxIndex belongs to.
+	TValue Persistence;
+};
+typedef TBasicSegment<double> TSegment;
+
+
+/** A read-only view of caller-owned data: a pointer, a number of vertices and the distance
+	between consecutive vertices. The data is read in place and never copied.
+*/
+template <typename TValue>
+struct TBasicDataView
+{
+	TBasicDataView():Ptr(0),Size(0),Stride(1){}
+	TBasicDataView(const TValue* ptr, const int size, const int stride = 1):Ptr(ptr),Size(size),Stride(stride){}
+
+	TValue operator[](const int i) const
+	{
+		return Ptr[(ptrdiff_t)i * Stride];
+	}
+
+	///First vertex of the data.
+	const TValue* Ptr;
+
+	///Number of vertices in the data.
+	int Size;
+
+	///Distance between consecutive vertices, in elements. 1 for contiguous data.
+	int Stride;
+};
+typedef TBasicDataView<double> TDataView;
+
+
+/** A read-only view of the paired extrema of a Persistence1D object, sorted according to persistence, 
+	from least to most persistent. It refers to the object's results and is invalidated by the next 
+	RunPersistence or AppendSamples call. No pairs are copied.
+
+	After AppendSamples, the pairs are split into resolved pairs and the pairs of still open minima.
+	Both ranges are sorted; iterating the view merges them.
+*/
+template <typename TValue>
+class TBasicPairsView
+{
+public:
+	typedef TBasicPairedExtrema<TValue> TPairedExtrema;
+
+	/** Forward iterator over the pairs of the view, in persistence order. */
+	class const_iterator
+	{
+	public:
+		typedef std::forward_iterator_tag iterator_category;
+		typedef TPairedExtrema value_type;
+		typedef ptrdiff_t difference_type;
+		typedef const TPairedExtrema* pointer;
+		typedef const TPairedExtrema& reference;
+
+		const_iterator():Resolved(0),ResolvedEnd(0),Open(0),OpenEnd(0){}
+		const_iterator(const TPairedExtrema* resolved, const TPairedExtrema* resolvedEnd, 
+					   const TPairedExtrema* open, const TPairedExtrema* openEnd):
+			Resolved(resolved),ResolvedEnd(resolvedEnd),Open(open),OpenEnd(openEnd){}
+
+		reference operator*() const { return UseResolved() ? *Resolved : *Open; }
+		pointer operator->() const { return &**this; }
+
+		const_iterator& operator++()
+		{
+			if (UseResolved()) Resolved++;
+			else Open++;
+			return *this;
+		}
+
+		const_iterator operator++(int)
+		{
+			const_iterator previous = *this;
+			++*this;
+			return previous;
+		}
+
+		bool operator==(const const_iterator& other) const { return Resolved == other.Resolved && Open == other.Open; }
+		bool operator!=(const const_iterator& other) const { return !(*this == other); }
+
+	private:
+		//same order as the merge in GetPairedExtrema
+		bool UseResolved() const
+		{
+			return Open == OpenEnd || (Resolved != ResolvedEnd && !(*Open < *Resolved));
+		}
+
+		const TPairedExtrema* Resolved;
+		const TPairedExtrema* ResolvedEnd;
+		const TPairedExtrema* Open;
+		const TPairedExtrema* OpenEnd;
+	};
+
+	TBasicPairsView():Resolved(0),ResolvedEnd(0),Open(0),OpenEnd(0){}
+	TBasicPairsView(const TPairedExtrema* resolved, const TPairedExtrema* resolvedEnd, 
+					const TPairedExtrema* open, const TPairedExtrema* openEnd):
+		Resolved(resolved),ResolvedEnd(resolvedEnd),Open(open),OpenEnd(openEnd){}
+
+	const_iterator begin() const { return const_iterator(Resolved, ResolvedEnd, Open, OpenEnd); }
+	const_iterator end() const { return const_iterator(ResolvedEnd, ResolvedEnd, OpenEnd, OpenEnd); }
+
+	size_t size() const { return (size_t)((ResolvedEnd - Resolved) + (OpenEnd - Open)); }
+	bool empty() const { return Resolved == ResolvedEnd && Open == OpenEnd; }
+
+	///Resolved pairs of the view, a contiguous sorted range. All pairs, unless AppendSamples was used.
+	const TPairedExtrema* Resolved;
+	const TPairedExtrema* ResolvedEnd;
+
+	///Pairs of open minima of the view, a contiguous sorted range. Empty unless AppendSamples was used.
+	const TPairedExtrema* Open;
+	const TPairedExtrema* OpenEnd;
+};
+typedef TBasicPairsView<double> TPairsView;
+
+
+/** Algorithms for sorting the vertices by value, see TRunOptions::SortEngine. 
+	All of them produce the order of TIdxAndData: by value, equal values by index.
+	Data with fewer than 1024 vertices to sort is always sorted with std::sort.
+*/
+enum TSortEngine
+{
+	///std::sort.
+	SORT_COMPARISON = 0,
+
+	///Stable LSD radix sort over 11-bit digits of TSortKeyTraits::RadixKey, skipping digits that are equal 
+	///for all vertices. Value types without a radix key are sorted by comparison.
+	SORT_RADIX = 1,
+
+	///Counting sort into buckets of TRunOptions::SortQuantum, then each bucket sorted by comparison.
+	///Fast when values only need to be told apart to some resolution, such as speeds, so most buckets 
+	///hold a few vertices. Uses SORT_RADIX instead if the data would need more buckets than vertices.
+	SORT_QUANTIZED = 2
+};
+
+
+/** Selects how RunPersistence processes the data. 
+	Unless noted otherwise, options produce the same results; they only change the amount of work done.
+*/
+struct TRunOptions
+{
+	TRunOptions():CompressExtrema(false),Threshold(0),CompactLayout(false),SortEngine(SORT_COMPARISON),SortQuantum(1e-4),
+		Verify(false),DeferPairSort(false){}
+
+	///Compress the data to its local extrema in a linear scan before sorting.
+	///Only local extrema can be paired, so monotone runs are skipped by the sort and the watershed.
+	bool CompressExtrema;
+
+	///Minimal persistence of the pairs to keep. Pairs below it are dropped as soon as they are created, 
+	///and are neither stored nor sorted. Queries can then only use thresholds at or above this value.
+	///Compared to the persistence in double precision, so it works for any value type.
+	double Threshold;
+
+	///Use the compact layout for the sort and the watershed, which needs less memory per vertex on large data: 
+	///packed sort keys (12 bytes for double, 8 bytes for float and int, instead of 16), components split into 
+	///their edges, which the watershed touches for every vertex, and their minima, which it only reads when pairing,
+	///and no per-component Alive flag outside of debug builds.
+	bool CompactLayout;
+
+	///Sort algorithm for the default layout, see TSortEngine. The compact layout sorts its packed keys by comparison.
+	TSortEngine SortEngine;
+
+	///Bucket width of SORT_QUANTIZED, in data units. Only changes the speed of the sort, never the order.
+	double SortQuantum;
+
+	///Check the results with VerifyResults at the end of the run, and return false if they fail. Takes O(n).
+	bool Verify;
+
+	///Do not sort the pairs by persistence at the end of the run. GetTopPairs, GetOrderedExtremaIndices and 
+	///GetSegments then work on the unsorted pairs in O(n); the other queries sort them on first use.
+	bool DeferPairSort;
+};
 
 
 
@@ -102,16 +424,124 @@ struct TPairedExtrema
 
 	We assume a connected one-dimensional domain.
 	Think of "data on a line", or a function f(x) over some domain xmin <= x <= xmax.
+
+	An instance is a reusable workspace: its working vectors keep their capacity between runs, 
+	so once an instance has processed data of a given size, further runs of up to that size 
+	do not allocate memory. Use Reserve to warm it up in advance.
+	All working vectors are allocated through TAllocator, rebound to their element types.
+	Const queries may still fill caches on first use, such as the pairs sorted after a deferred sort, 
+	so one instance must not be queried from several threads at once.
+
+	TValue is the type of the data values. Smaller types, such as float or int for raw device counts, 
+	shrink Data and SortedData, and integer types compare ties exactly. Thresholds are always given as double.
+	Use Persistence1D for double values and the default allocator.
 */
-class Persistence1D
+template <typename TValue = double, class TAllocator = std::allocator<TValue> >
+class BasicPersistence1D
 {
 public:
-	Persistence1D()
+	typedef TBasicIdxAndData<TValue> TIdxAndData;
+	typedef TBasicComponent<TValue> TComponent;
+	typedef TBasicPairedExtrema<TValue> TPairedExtrema;
+	typedef TBasicDataView<TValue> TDataView;
+	typedef TBasicPairsView<TValue> TPairsView;
+	typedef TBasicSegment<TValue> TSegment;
+
+protected:
+	typedef std::allocator_traits<TAllocator> TAllocatorTraits;
+	typedef std::vector<TValue, typename TAllocatorTraits::template rebind_alloc<TValue> > TDataVector;
+	typedef std::vector<int, typename TAllocatorTraits::template rebind_alloc<int> > TIndexVector;
+	typedef std::vector<TIdxAndData, typename TAllocatorTraits::template rebind_alloc<TIdxAndData> > TIdxAndDataVector;
+	typedef std::vector<TComponent, typename TAllocatorTraits::template rebind_alloc<TComponent> > TComponentVector;
+	typedef std::vector<TPairedExtrema, typename TAllocatorTraits::template rebind_alloc<TPairedExtrema> > TPairVector;
+	typedef std::vector<unsigned long long, typename TAllocatorTraits::template rebind_alloc<unsigned long long> > TBitVector;
+
+	typedef TSortKeyTraits<TValue> TKeyTraits;
+	typedef typename TKeyTraits::TKey TSortKey;
+	typedef std::vector<TSortKey, typename TAllocatorTraits::template rebind_alloc<TSortKey> > TSortKeyVector;
+
+	/** Edges of a component in the compact layout. The only part of a component the watershed touches for every vertex. */
+	struct TComponentEdges
+	{
+		int Left;
+		int Right;
+	};
+	typedef std::vector<TComponentEdges, typename TAllocatorTraits::template rebind_alloc<TComponentEdges> > TEdgeVector;
+
+public:
+	/*!
+		@param[in] allocator	Allocator for the working vectors, e.g. one drawing from an arena.
+	*/
+	explicit BasicPersistence1D(const TAllocator& allocator = TAllocator()):
+		Data(allocator),SortedData(allocator),SortBuffer(allocator),SortBuckets(allocator),
+		ExtremaIndices(allocator),Colors(allocator),Components(allocator),PairedExtrema(allocator),PairsSorted(true),
+		TotalComponents(0),PairThreshold(0),SortEngine(SORT_COMPARISON),SortQuantum(0),AliveComponentsVerified(false),
+		OpenMinima(allocator),OpenMaxima(allocator),OpenPairs(allocator),TailAdded(allocator),TailRemoved(allocator),MergeBuffer(allocator),
+		MinimaBits(allocator),MaximaBits(allocator),MaximaRanks(allocator),
+		OrderedMinima(allocator),OrderedMaxima(allocator),OrderedPersistence(allocator),
+		SortKeys(allocator),ComponentEdges(allocator),ComponentMinIndices(allocator),ComponentMinValues(allocator),
+#ifdef _DEBUG
+		ComponentAlive(allocator),
+#endif
+		DomainSize(0),DiscardedSamples(0),StreamedCount(0),Descending(false),IncrementalValid(false)
+#ifdef P1D_STATS
+		,StatsRunning(false),RunStart(0),PhaseStart(0)
+#endif
+	{
+	}
+
+	~BasicPersistence1D()
 	{
 	}
 
-	~Persistence1D()
+	/*!
+		Reserves the working vectors for data of up to size vertices, so that runs on such data 
+		do not allocate. Vectors only grow, existing capacity is kept.
+
+		@param[in] size		Number of vertices to prepare for.
+		@param[in] options	Options of the runs to prepare for. Only the vectors of the chosen layout are reserved.
+	*/
+	void Reserve(const int size, const TRunOptions& options = TRunOptions())
 	{
+		if (size <= 0) return;
+
+		Data.reserve(size);
+		ExtremaIndices.reserve(size);
+		Colors.reserve(size);
+
+		//a local minimum needs a higher vertex on each side, so there are at most (size+1)/2 components
+		if (options.CompactLayout)
+		{
+			SortKeys.reserve(size);
+			ComponentEdges.reserve(size/2 + 1);
+			ComponentMinIndices.reserve(size/2 + 1);
+			ComponentMinValues.reserve(size/2 + 1);
+#ifdef _DEBUG
+			ComponentAlive.reserve(size/2 + 1);
+#endif
+		}
+		else
+		{
+			SortedData.reserve(size);
+			if (options.SortEngine != SORT_COMPARISON && size >= DISTRIBUTION_SORT_MIN_SIZE) 
+			{
+				SortBuffer.reserve(size);
+				SortBuckets.reserve(std::max(size + 1, (int)RADIX_MAX_PASSES * (int)RADIX_DIGITS));
+			}
+		}
+		Components.reserve(size/2 + 1);
+		PairedExtrema.reserve(size/2 + 1);
+		OpenMinima.reserve(size/2 + 1);
+		OpenMaxima.reserve(size/2 + 1);
+		OpenPairs.reserve(size/2 + 1);
+		MergeBuffer.reserve(size/2 + 1);
+
+		MinimaBits.reserve(size/64 + 1);
+		MaximaBits.reserve(size/64 + 1);
+		MaximaRanks.reserve(size/64 + 1);
+		OrderedMinima.reserve(size/2 + 1);
+		OrderedMaxima.reserve(size/2 + 1);
+		OrderedPersistence.reserve(size/2 + 1);
 	}
 			
 	/*!
@@ -125,24 +555,273 @@ public:
 
 		@param[in] InputData Vector of data to find features on, ordered according to its axis.
 	*/
-	bool RunPersistence(const std::vector<double>& InputData)
+	bool RunPersistence(const std::vector<TValue>& InputData)
+	{	
+		return RunPersistence(InputData, TRunOptions());
+	}
+
+	/*!
+		Same as RunPersistence(InputData), with control over how the data is processed.
+
+		@param[in] InputData	Vector of data to find features on, ordered according to its axis.
+		@param[in] options		Processing options, see TRunOptions.
+	*/
+	bool RunPersistence(const std::vector<TValue>& InputData, const TRunOptions& options)
+	{	
+		P1D_STATS_ONLY(BeginStats());
+		Data.assign(InputData.begin(), InputData.end()); 
+		P1D_STATS_ONLY(MarkPhase(PHASE_COPY));
+		return RunPersistence(TDataView(Data.empty() ? 0 : &Data[0], (int)Data.size()), options);
+	}
+
+	/*!
+		Same as RunPersistence(InputData), running directly on a caller-owned buffer without copying it.
+		The buffer is only read during the call; the results do not refer to it.
+
+		Since the data is not kept, a following AppendSamples starts a new sequence 
+		instead of continuing this one.
+
+		@param[in] InputData	First vertex of the data, ordered according to its axis.
+		@param[in] length		Number of vertices.
+		@param[in] stride		Distance between consecutive vertices, in elements.
+		@param[in] options		Processing options, see TRunOptions.
+	*/
+	bool RunPersistence(const TValue* InputData, const int length, const int stride = 1, const TRunOptions& options = TRunOptions())
+	{	
+		Data.clear();
+		return RunPersistence(TDataView(InputData, length, stride), options);
+	}
+
+	/*!
+		Smooths the data with a FIR kernel, see FilterSamples, and runs persistence on the smoothed data.
+		The smoothed data is kept in the object's own buffer, so repeated runs do not allocate.
+
+		Samples appended with AppendSamples afterwards are not smoothed.
+
+		@param[in] InputData	First vertex of the raw data, ordered according to its axis.
+		@param[in] length		Number of vertices.
+		@param[in] kernel		Filter taps.
+		@param[in] kernelSize	Number of taps.
+		@param[in] kernelCenter	Tap applied to the vertex being smoothed.
+		@param[in] options		Processing options, see TRunOptions.
+	*/
+	bool RunFilteredPersistence(const TValue* InputData, const int length, 
+								const double* kernel, const int kernelSize, const int kernelCenter,
+								const TRunOptions& options = TRunOptions())
+	{
+		assert(kernelCenter >= 0 && kernelCenter < kernelSize);
+
+		P1D_STATS_ONLY(BeginStats());
+		Data.resize(std::max(length, 0));
+		if (!Data.empty()) FilterSamples(InputData, length, kernel, kernelSize, kernelCenter, &Data[0]);
+		P1D_STATS_ONLY(MarkPhase(PHASE_COPY));
+		return RunPersistence(TDataView(Data.empty() ? 0 : &Data[0], (int)Data.size()), options);
+	}
+
+	/*!
+		Copies the smoothed data of the last RunFilteredPersistence call, or the data copied by 
+		RunPersistence(std::vector), to filteredData. filteredData is cleared otherwise.
+
+		@param[out] filteredData	Data the results refer to.
+	*/
+	template <class TContainer>
+	void GetFilteredData(TContainer& filteredData) const
+	{
+		filteredData.assign(Data.begin(), Data.end());
+	}
+
+	/*!
+		Same as GetFilteredData, returning a view of the data instead of a copy.
+		The view is invalidated by the next RunPersistence, RunFilteredPersistence or AppendSamples call.
+	*/
+	TDataView GetFilteredDataView() const
+	{
+		return TDataView(Data.empty() ? 0 : &Data[0], (int)Data.size());
+	}
+
+	/*!
+		Same as RunPersistence(InputData), running directly on a view of caller-owned data.
+
+		@param[in] InputData	View of the data, see TDataView. 
+		@param[in] options		Processing options, see TRunOptions.
+	*/
+	bool RunPersistence(const TDataView& InputData, const TRunOptions& options = TRunOptions())
 	{	
-		Data = InputData; 
+		P1D_STATS_ONLY(BeginStats());
+		Input = InputData;
 		Init();
+		PairThreshold = options.Threshold;
+		SortEngine = options.SortEngine;
+		SortQuantum = options.SortQuantum;
 
 		//If a user runs this on an empty vector, then they should not get the results of the previous run.
-		if (Data.empty()) return false;
+		if (Input.Size <= 0)
+		{
+			P1D_STATS_ONLY(EndStats());
+			return false;
+		}
 
-		CreateIndexValueVector();
-		Watershed();
-		SortPairedExtrema();
+		if (options.CompactLayout)
+		{
+			CreateSortKeys(options.CompressExtrema);
+			P1D_STATS_ONLY(MarkPhase(PHASE_SORT));
+			CompactWatershed();
+		}
+		else
+		{
+			if (options.CompressExtrema)
+			{
+				CreateExtremaIndexValueVector();
+			}
+			else
+			{
+				CreateIndexValueVector();
+			}
+			P1D_STATS_ONLY(MarkPhase(PHASE_SORT));
+			Watershed();
+		}
+		P1D_STATS_ONLY(MarkPhase(PHASE_WATERSHED));
+		if (options.CompressExtrema)
+		{
+			RestoreExtremaIndices();
+		}
+		if (options.DeferPairSort)
+		{
+			PairsSorted = false;
+		}
+		else
+		{
+			SortPairedExtrema();
+		}
+		P1D_STATS_ONLY(MarkPhase(PHASE_SORT_PAIRS));
 #ifdef _DEBUG
 		VerifyAliveComponents();	
 #endif
+		const bool verified = !options.Verify || VerifyResults();
+		P1D_STATS_ONLY(EndStats());
+		return verified;
+	}
+
+
+	/*!
+		Appends samples to the end of the data and updates the results without reprocessing 
+		the samples that were already seen. Results are identical to calling RunPersistence 
+		on the concatenated data.
+
+		A minimum is only paired once a lower vertex appears to its right. Until then it is kept 
+		on a stack of open minima, whose values increase from left to right. Each new sample 
+		resolves at most the minima it is lower than, and OpenPairs is only updated for the minima 
+		pushed, popped or passed by the new samples, so the cost of a call is proportional to 
+		the number of appended samples and the number of pairs they change, not to the length of the data.
+
+		The samples are kept in Data until DiscardSamples is called, see there.
+		If the current results were created by RunPersistence, the existing data is streamed once 
+		to build the incremental state. To start over, call RunPersistence with an empty vector.
+
+		Use PrintResults, GetPairedExtrema or GetExtremaIndices to get results of the function.
+
+		@param[in] Samples Vector of data to append, ordered according to its axis.
+	*/
+	bool AppendSamples(const std::vector<TValue>& Samples)
+	{
+		return AppendSamples(Samples.empty() ? 0 : &Samples[0], (int)Samples.size());
+	}
+
+	/*!
+		Same as AppendSamples(Samples), reading the samples from a caller-owned buffer.
+
+		@param[in] Samples	First sample to append.
+		@param[in] length	Number of samples.
+	*/
+	bool AppendSamples(const TValue* Samples, const int length)
+	{
+		if (!IncrementalValid)
+		{
+			InitIncremental();
+		}
+
+		if (length > 0)
+		{
+			Data.insert(Data.end(), Samples, Samples + length);
+		}
+		Input = TDataView(Data.empty() ? 0 : &Data[0], (int)Data.size());
+		DomainSize = DiscardedSamples + (int)Data.size();
+		if (Data.empty()) return false;
+
+		typename TPairVector::size_type resolvedPairs = PairedExtrema.size();
+		RevertTailPairs();
+
+		for (; StreamedCount != Data.size(); StreamedCount++)
+		{
+			StreamVertex((int)StreamedCount);
+		}
+
+		MergeResolvedPairs(resolvedPairs);
+
+		UpdateOpenPairs();
 		return true;
 	}
 
 
+	/*!
+		Frees the samples appended so far, except the last one. The incremental state keeps the values 
+		of the open minima and of their barriers, and the next sample is only compared with the last one, 
+		so no other sample can change the results of later AppendSamples calls. Call it between appends 
+		to keep memory proportional to the open minima instead of to the length of the stream.
+
+		Indices in the results still count from the first sample ever appended. 
+		Does nothing unless the results were created by AppendSamples.
+		Returns the number of samples freed.
+	*/
+	int DiscardSamples()
+	{
+		if (!IncrementalValid || Data.size() < 2) return 0;
+
+		const int discarded = (int)Data.size() - 1;
+		Data.erase(Data.begin(), Data.end() - 1);
+		DiscardedSamples += discarded;
+		StreamedCount = Data.size();
+		Input = TDataView(&Data[0], (int)Data.size());
+		return discarded;
+	}
+
+
+
+#ifdef P1D_STATS
+	/*!
+		Returns the statistics of the last RunPersistence or RunFilteredPersistence call.
+	*/
+	const TRunStats& GetRunStats() const
+	{
+		return Stats;
+	}
+
+	/*!
+		Returns the histogram of the durations of the recent runs, see TRunStats::TotalNs.
+	*/
+	const TLatencyHistogram& GetLatencyHistogram() const
+	{
+		return Latency;
+	}
+
+	/*!
+		Adds time spent outside of the run to a phase of the last run, e.g. PHASE_MARSHAL by a wrapper.
+	*/
+	void AddPhaseTime(const TStatsPhase phase, const long long ns)
+	{
+		Stats.PhaseNs[phase] += ns;
+	}
+
+	/*!
+		Clears the statistics of the last run and the latency histogram.
+	*/
+	void ResetStats()
+	{
+		Stats.Clear();
+		Latency.Clear();
+	}
+#endif
+
 
 	/*!
 		Prints the contents of the TPairedExtrema vector.
@@ -150,9 +829,10 @@ public:
 
 		@param[in] pairs	Vector of pairs to be printed. 
 	*/	
-	void PrintPairs(const std::vector<TPairedExtrema>& pairs) const 
+	template <class TPairs>
+	void PrintPairs(const TPairs& pairs) const 
 	{
-		for (std::vector<TPairedExtrema>::const_iterator it = pairs.begin(); 
+		for (typename TPairs::const_iterator it = pairs.begin(); 
 			it != pairs.end(); it++)
 		{
 			std::cout	<< "Persistence: " << (*it).Persistence
@@ -171,11 +851,12 @@ public:
 	*/	
 	void PrintResults(const double threshold = 0.0, const bool matlabIndexing = false) const
 	{
+		EnsurePairsSorted();
 		if (threshold < 0)
 		{
 			std::cout << "Error. Threshold value must be greater than or equal to 0" << std::endl;
 		}
-		if (threshold==0 && !matlabIndexing)
+		if (threshold==0 && !matlabIndexing && OpenPairs.empty())
 		{
 			PrintPairs(PairedExtrema);
 		}
@@ -207,18 +888,21 @@ public:
 	{
 		//make sure the user does not use previous results that do not match the data
 		pairs.clear();
+		EnsurePairsSorted();
 
-		if (PairedExtrema.empty() || threshold < 0.0) return false;
+		if ((PairedExtrema.empty() && OpenPairs.empty()) || threshold < 0.0) return false;
 
-		std::vector<TPairedExtrema>::const_iterator lower_bound = FilterByPersistence(threshold);
+		typename TPairVector::const_iterator lower_bound = FilterByPersistence(PairedExtrema, threshold);
+		typename TPairVector::const_iterator open_lower_bound = FilterByPersistence(OpenPairs, threshold);
 
-		if (lower_bound == PairedExtrema.end()) return false;
+		if (lower_bound == PairedExtrema.end() && open_lower_bound == OpenPairs.end()) return false;
 		
-		pairs = std::vector<TPairedExtrema>(lower_bound, PairedExtrema.end());
+		pairs.reserve((PairedExtrema.end() - lower_bound) + (OpenPairs.end() - open_lower_bound));
+		std::merge(lower_bound, PairedExtrema.cend(), open_lower_bound, OpenPairs.end(), std::back_inserter(pairs));
 		
 		if (matlabIndexing) //match matlab indices by adding one
 		{
-			for (std::vector<TPairedExtrema>::iterator p = pairs.begin(); p != pairs.end(); p++)
+			for (typename std::vector<TPairedExtrema>::iterator p = pairs.begin(); p != pairs.end(); p++)
 			{
 				(*p).MinIndex += MATLAB_INDEX_FACTOR;
 				(*p).MaxIndex += MATLAB_INDEX_FACTOR;			
@@ -243,28 +927,201 @@ public:
 		//before doing anything, make sure the user does not use old results
 		min.clear();
 		max.clear();
+		EnsurePairsSorted();
 				
-		if (PairedExtrema.empty() || threshold < 0.0) return false;
+		if ((PairedExtrema.empty() && OpenPairs.empty()) || threshold < 0.0) return false;
 		
-		min.reserve(PairedExtrema.size());
-		max.reserve(PairedExtrema.size());
+		min.reserve(PairedExtrema.size() + OpenPairs.size());
+		max.reserve(PairedExtrema.size() + OpenPairs.size());
 		
 		int matlabIndexFactor = 0;
 		if (matlabIndexing) matlabIndexFactor = MATLAB_INDEX_FACTOR;
 
-		std::vector<TPairedExtrema>::const_iterator lower_bound = FilterByPersistence(threshold);
+		typename TPairVector::const_iterator p = FilterByPersistence(PairedExtrema, threshold);
+		typename TPairVector::const_iterator o = FilterByPersistence(OpenPairs, threshold);
 
-		for (std::vector<TPairedExtrema>::const_iterator p = lower_bound; p != PairedExtrema.end(); p++)
+		//merge resolved and open pairs, keeping the persistence order
+		while (p != PairedExtrema.end() || o != OpenPairs.end())
 		{
-			min.push_back((*p).MinIndex + matlabIndexFactor);
-			max.push_back((*p).MaxIndex + matlabIndexFactor);
+			const TPairedExtrema& pair = (o == OpenPairs.end() || (p != PairedExtrema.end() && !(*o < *p))) ? *p++ : *o++;
+			min.push_back(pair.MinIndex + matlabIndexFactor);
+			max.push_back(pair.MaxIndex + matlabIndexFactor);
 		}
 		return true;
 	}
 	/*!
-		Returns the index of the global minimum. 
-		The global minimum does not get paired and is not returned 
-		via GetPairedExtrema and GetExtremaIndices.
+		Returns a view of all paired extrema whose persistence is greater than or equal to threshold,
+		in the order of GetPairedExtrema, without copying them. Takes O(log n).
+		The view is invalidated by the next RunPersistence or AppendSamples call.
+
+		@param[in]	threshold	Minimal persistence of the pairs in the view.
+	*/
+	TPairsView GetPairsView(const double threshold = 0) const
+	{
+		EnsurePairsSorted();
+		const TPairedExtrema* resolved = PairedExtrema.empty() ? 0 : &PairedExtrema[0];
+		const TPairedExtrema* open = OpenPairs.empty() ? 0 : &OpenPairs[0];
+
+		return TPairsView(resolved + (FilterByPersistence(PairedExtrema, threshold) - PairedExtrema.begin()), 
+						  resolved + PairedExtrema.size(),
+						  open + (FilterByPersistence(OpenPairs, threshold) - OpenPairs.begin()), 
+						  open + OpenPairs.size());
+	}
+
+	/*!
+		Returns the number of paired extrema whose persistence is greater than or equal to threshold. 
+		The global minimum is not counted. Takes O(log n).
+
+		@param[in]	threshold	Minimal persistence of the counted pairs.
+	*/
+	size_t CountFeatures(const double threshold = 0) const
+	{
+		EnsurePairsSorted();
+		return (size_t)((PairedExtrema.end() - FilterByPersistence(PairedExtrema, threshold)) + 
+						(OpenPairs.end() - FilterByPersistence(OpenPairs, threshold)));
+	}
+
+	/*!
+		Counts the paired extrema at or above each of several thresholds, e.g. to sweep the threshold 
+		or to draw a persistence barcode histogram. No pairs are copied. Takes O(m log n) for m thresholds.
+
+		@param[in]	thresholds	Thresholds to count at, in any order.
+		@param[out]	counts		counts[i] is CountFeatures(thresholds[i]). Overwritten.
+	*/
+	void GetFeatureCounts(const std::vector<double>& thresholds, std::vector<size_t>& counts) const
+	{
+		counts.resize(thresholds.size());
+		for (size_t i = 0; i != thresholds.size(); i++)
+		{
+			counts[i] = CountFeatures(thresholds[i]);
+		}
+	}
+
+	/*!
+		Returns the k most persistent pairs, i.e. the last k pairs GetPairedExtrema would return, 
+		in the same order. If the run used TRunOptions::DeferPairSort, the pairs are partially selected 
+		instead of sorted, which takes O(n + k log k). This reorders the stored pairs, so it is not const.
+
+		@param[out]	pairs			The most persistent pairs, from least to most persistent. Overwritten.
+		@param[in]	k				Maximal number of pairs to return.
+		@param[in]	matlabIndexing	Set this to true to change all indices of features to Matlab's 1-indexing.
+	*/
+	bool GetTopPairs(std::vector<TPairedExtrema> & pairs, const size_t k, const bool matlabIndexing = false)
+	{
+		pairs.clear();
+
+		const size_t count = std::min(k, PairedExtrema.size() + OpenPairs.size());
+		if (count == 0) return false;
+
+		//the top k of the union are within the top k of PairedExtrema and of OpenPairs, which is always sorted
+		const size_t resolvedCount = std::min(count, PairedExtrema.size());
+		if (!PairsSorted && resolvedCount != 0)
+		{
+			typename TPairVector::iterator first = PairedExtrema.end() - resolvedCount;
+			if (first != PairedExtrema.begin())
+			{
+				std::nth_element(PairedExtrema.begin(), first, PairedExtrema.end());
+			}
+			std::sort(first, PairedExtrema.end());
+		}
+
+		//merge from the back, taking the more persistent pair first
+		pairs.resize(count);
+		typename TPairVector::const_iterator p = PairedExtrema.end();
+		typename TPairVector::const_iterator o = OpenPairs.end();
+		for (size_t i = count; i != 0; i--)
+		{
+			const bool takeOpen = (p == PairedExtrema.end() - resolvedCount) || 
+								  (o != OpenPairs.begin() && !(*(o - 1) < *(p - 1)));
+			pairs[i - 1] = takeOpen ? *--o : *--p;
+		}
+
+		if (matlabIndexing)
+		{
+			for (typename std::vector<TPairedExtrema>::iterator q = pairs.begin(); q != pairs.end(); q++)
+			{
+				(*q).MinIndex += MATLAB_INDEX_FACTOR;
+				(*q).MaxIndex += MATLAB_INDEX_FACTOR;
+			}
+		}
+		return true;
+	}
+
+	/*!
+		Same as GetExtremaIndices, with min and max each sorted by index instead of by persistence.
+		Extrema are ordered by marking them in a bitmap over the data, without a comparison sort.
+		Takes O(n/64 + k) for k pairs.
+
+		@param[out] min				Indices of paired local minima, ascending. 
+		@param[out]	max				Indices of paired local maxima, ascending.
+		@param[in]	threshold		Return only indices for pairs whose persistence is greater than or equal to threshold. 
+		@param[in]	matlabIndexing	Set this to true to change all indices to match Matlab's 1-indexing.
+	*/
+	bool GetOrderedExtremaIndices(std::vector<int> & min, std::vector<int> & max, const double threshold = 0, const bool matlabIndexing = false) const
+	{
+		min.clear();
+		max.clear();
+
+		if ((PairedExtrema.empty() && OpenPairs.empty()) || threshold < 0.0) return false;
+
+		CreateOrderedExtrema(threshold, false);
+
+		int matlabIndexFactor = 0;
+		if (matlabIndexing) matlabIndexFactor = MATLAB_INDEX_FACTOR;
+
+		min.resize(OrderedMinima.size());
+		max.resize(OrderedMaxima.size());
+		for (size_t i = 0; i != OrderedMinima.size(); i++)
+		{
+			min[i] = OrderedMinima[i] + matlabIndexFactor;
+			max[i] = OrderedMaxima[i] + matlabIndexFactor;
+		}
+		return true;
+	}
+
+	/*!
+		Returns the data simplified to the paired extrema whose persistence is greater than or equal to threshold, 
+		and the global minimum, as segments ordered by index. Minima and maxima of the simplified data alternate, 
+		starting and ending with a minimum, so there is one segment per pair.
+
+		Extrema are ordered by marking them in a bitmap over the data, without a comparison sort.
+		Takes O(n/64 + k) for k pairs.
+
+		@param[out]	segments		Segments ordered by index. Overwritten.
+		@param[in]	threshold		Minimal persistence of the pairs to keep.
+		@param[in]	matlabIndexing	Set this to true to change all indices to match Matlab's 1-indexing.
+	*/
+	bool GetSegments(std::vector<TSegment>& segments, const double threshold = 0, const bool matlabIndexing = false) const
+	{
+		segments.clear();
+
+		if ((PairedExtrema.empty() && OpenPairs.empty()) || threshold < 0.0) return false;
+
+		CreateOrderedExtrema(threshold, true);
+		if (OrderedMaxima.empty()) return false;
+		assert(OrderedMinima.size() == OrderedMaxima.size() + 1);
+
+		int matlabIndexFactor = 0;
+		if (matlabIndexing) matlabIndexFactor = MATLAB_INDEX_FACTOR;
+
+		segments.resize(OrderedMaxima.size());
+		for (size_t i = 0; i != OrderedMaxima.size(); i++)
+		{
+			TSegment& segment = segments[i];
+			segment.StartMinIndex = OrderedMinima[i] + matlabIndexFactor;
+			segment.PeakMaxIndex = OrderedMaxima[i] + matlabIndexFactor;
+			segment.EndMinIndex = OrderedMinima[i + 1] + matlabIndexFactor;
+			segment.Persistence = OrderedPersistence[i];
+
+			assert(OrderedMinima[i] < OrderedMaxima[i] && OrderedMaxima[i] < OrderedMinima[i + 1]);
+		}
+		return true;
+	}
+
+	/*!
+		Returns the index of the global minimum. 
+		The global minimum does not get paired and is not returned 
+		via GetPairedExtrema and GetExtremaIndices.
 	*/
 	int GetGlobalMinimumIndex(const bool matlabIndexing = false) const
 	{
@@ -284,7 +1141,7 @@ public:
 		The global minimum does not get paired and is not returned 
 		via GetPairedExtrema and GetExtremaIndices.
 	*/
-	double GetGlobalMinimumValue() const
+	TValue GetGlobalMinimumValue() const
 	{
 		if (Components.empty()) return 0;
 
@@ -298,58 +1155,76 @@ public:
 		- Global minimum is within domain indices or at default value	
 		- Global minimum is not returned as any other extrema.
 		- Global minimum is not paired.
+		- Only the component of the global minimum is alive.
 		
 		Returns true if run results pass these sanity checks.
+
+		Takes O(n): every extremum is marked in a bitmap over the domain, in one pass over the pairs, 
+		so an index that is used twice is found when it is marked the second time. The bitmap is 
+		the scratch space of the ordered queries, so warm calls do not allocate.
+		Also run by RunPersistence when TRunOptions::Verify is set.
 	*/
-	bool VerifyResults() 
+	bool VerifyResults() const
 	{
-		bool flag = true; 
-		std::vector<int> min, max;
-		std::vector<int> combinedIndices;
-		
-		GetExtremaIndices(min, max);
+		const int globalMinIdx = GetGlobalMinimumIndex();
+		if ((globalMinIdx > DomainSize-1) || (globalMinIdx < -1)) return false;
+		if (globalMinIdx == -1) return PairedExtrema.empty() && OpenPairs.empty();
 
-		int globalMinIdx = GetGlobalMinimumIndex();
-				
-		std::sort(min.begin(), min.end());
-		std::sort(max.begin(), max.end());
-		combinedIndices.reserve(min.size() + max.size());		
-		std::set_union(min.begin(), min.end(), max.begin(), max.end(), std::inserter(combinedIndices, combinedIndices.begin())); 
-		
-		//check the combined unique indices are equal to size of min and max
-		if (combinedIndices.size() != (min.size() + max.size()) ||
-			 std::binary_search(combinedIndices.begin(), combinedIndices.end(), globalMinIdx) == true)
-		{
-		   flag = false;
-		}
+		MinimaBits.assign(DomainSize / 64 + 1, 0);
+		MarkExtremum(globalMinIdx);
 
-		if ((globalMinIdx > (int)Data.size()-1) || (globalMinIdx < -1)) flag = false;
-		if (globalMinIdx == -1 && min.size() != 0) flag = false;
-		
-		std::vector<int>::iterator minUniqueEnd = std::unique(min.begin(), min.end());
-		std::vector<int>::iterator maxUniqueEnd = std::unique(max.begin(), max.end());
-				
-		if (minUniqueEnd != min.end() ||
-			maxUniqueEnd != max.end() ||
-			(minUniqueEnd - min.begin()) != (maxUniqueEnd - max.begin()))
+		if (!MarkPairs(PairedExtrema) || !MarkPairs(OpenPairs)) return false;
+
+		//only the component of the global minimum is alive, see VerifyAliveComponents
+		if (!Components.front().Alive) return false;
+		for (typename TComponentVector::const_iterator c = Components.begin() + 1; c != Components.end(); c++)
 		{
-			flag = false;
+			if ((*c).Alive) return false;
 		}
-
-		return flag;
+		return true;
 	}
 
 protected:
 	/*!
 		Contain a copy of the original input data.
+		Empty if RunPersistence was called on a caller-owned buffer.
+	*/
+	TDataVector Data;
+
+
+	/*!
+		The data of the current run - either a view of Data or of a caller-owned buffer.
+		Only valid during RunPersistence and AppendSamples.
+	*/
+	TDataView Input;
+
+
+	/*!
+		Number of vertices the results refer to, for VerifyResults and the ordered queries: Input.Size 
+		after RunPersistence, and every sample appended so far, including discarded ones, after AppendSamples.
 	*/
-	std::vector<double> Data;
+	int DomainSize;
 	
 	
 	/*!
 		Contains a copy the value and index pairs of Data, sorted according to the data values.
 	*/
-	std::vector<TIdxAndData> SortedData; 
+	TIdxAndDataVector SortedData; 
+
+
+	/*!
+		Scratch space of SortVertices: the other half of the radix and counting sorts, 
+		and the histograms of RadixSort or the start of each bucket of SORT_QUANTIZED.
+	*/
+	TIdxAndDataVector SortBuffer;
+	TIndexVector SortBuckets;
+
+
+	/*!
+		Maps vertex indices used by the watershed back to Data indices when CompressExtrema is used.
+		ExtremaIndices[i] is the Data index of the i-th local extremum.
+	*/
+	TIndexVector ExtremaIndices;
 
 
 	/*!
@@ -357,24 +1232,189 @@ protected:
 		Only edges of destroyed components are updated to the new component color.
 		The Component values in this vector are invalid at the end of the algorithm.
 	*/
-	std::vector<int> Colors;		//need to init to empty
+	TIndexVector Colors;		//need to init to empty
 
 
 	/*!
 		A vector of Components. 
 		The component index within the vector is used as its Colors in the Watershed function.
 	*/
-	std::vector<TComponent> Components;
+	TComponentVector Components;
 
 
 	/*!
 		A vector of paired extrema features - always a minimum and a maximum.
+		Unsorted after a run with TRunOptions::DeferPairSort, until a query sorts it, 
+		so concurrent queries on such results are not safe.
 	*/
-	std::vector<TPairedExtrema> PairedExtrema;
+	mutable TPairVector PairedExtrema;
+	mutable bool PairsSorted;		//PairedExtrema is sorted by persistence, see SortPairedExtrema
 	
 		
 	unsigned int TotalComponents;	//keeps track of component vector size and newest component "color"
+	double PairThreshold;			//pairs whose persistence is below this value are not stored, see TRunOptions
+	TSortEngine SortEngine;			//sort algorithm of the current run, see TRunOptions
+	double SortQuantum;				//bucket width of SORT_QUANTIZED
+
+	//digits of RadixSort: 11 bits keep the histograms of a pass in L1 and sort doubles in 6 passes instead of 8
+	enum { RADIX_DIGIT_BITS = 11, RADIX_DIGITS = 1 << RADIX_DIGIT_BITS, RADIX_MAX_PASSES = (64 + RADIX_DIGIT_BITS - 1) / RADIX_DIGIT_BITS };
+	//below this many vertices SortVertices uses std::sort for every engine: clearing and scanning the histograms costs more than it saves
+	enum { DISTRIBUTION_SORT_MIN_SIZE = 1024 };
 	bool AliveComponentsVerified;	//Index of global minimum in Data vector. This minimum is never paired.
+
+
+	/*!
+		Minima that were not paired yet by AppendSamples, ordered by their index.
+		Their values increase from left to right, so the front is the global minimum so far.
+	*/
+	TIdxAndDataVector OpenMinima;
+
+
+	/*!
+		OpenMaxima[i] is the highest vertex between OpenMinima[i] and OpenMinima[i+1].
+	*/
+	TIdxAndDataVector OpenMaxima;
+
+
+	/*!
+		Pairs the open minima would get if the data ended at its current last vertex, sorted like PairedExtrema. 
+		Holds the pair of each open minimum with the maximum to its left, kept up to date as the stack changes, 
+		except where the descent at the end of the data pairs a minimum differently, see UpdateOpenPairs.
+		Always empty after RunPersistence.
+	*/
+	TPairVector OpenPairs;
+
+
+	/*!
+		Changes UpdateOpenPairs made to OpenPairs for the descent at the end of the data: the pairs it added, 
+		and the pairs of the stack it replaced. Undone by RevertTailPairs before the next samples are streamed.
+	*/
+	TPairVector TailAdded;
+	TPairVector TailRemoved;
+
+
+	/*!
+		Scratch space for merging newly resolved pairs into PairedExtrema.
+	*/
+	TPairVector MergeBuffer;
+
+
+	/*!
+		Scratch space of CreateOrderedExtrema: bitmaps of the extrema to return, one bit per vertex,
+		the extrema in index order, and the persistence of the pair of each ordered maximum.
+		Kept between calls so queries do not allocate.
+	*/
+	mutable TBitVector MinimaBits;
+	mutable TBitVector MaximaBits;
+	mutable TIndexVector MaximaRanks;	//number of maxima in the words of MaximaBits before each word
+	mutable TIndexVector OrderedMinima;
+	mutable TIndexVector OrderedMaxima;
+	mutable TDataVector OrderedPersistence;
+
+
+	/*!
+		Working vectors of the compact layout, see TRunOptions::CompactLayout and CompactWatershed.
+		SortKeys replaces SortedData, and the component vectors replace Components during the watershed.
+	*/
+	TSortKeyVector SortKeys;
+	TEdgeVector ComponentEdges;
+	TIndexVector ComponentMinIndices;
+	TDataVector ComponentMinValues;
+#ifdef _DEBUG
+	std::vector<bool, typename TAllocatorTraits::template rebind_alloc<bool> > ComponentAlive;
+#endif
+
+
+	TIdxAndData RunMaximum;						//highest vertex since the last open minimum
+	int DiscardedSamples;						//samples removed from the front of Data by DiscardSamples
+	typename TDataVector::size_type StreamedCount;	//number of vertices of Data processed by AppendSamples
+	bool Descending;							//true if the last streamed vertex is lower than its left neighbor
+	bool IncrementalValid;						//true if the incremental state matches Data
+
+#ifdef P1D_STATS
+	enum { STATS_VECTORS = 12 };
+
+	TRunStats Stats;
+	TLatencyHistogram Latency;
+	bool StatsRunning;							//between BeginStats and EndStats
+	long long RunStart;
+	long long PhaseStart;						//end of the last marked phase
+	size_t StatsCapacities[STATS_VECTORS];		//bytes reserved by the working vectors when the run started
+
+
+	/*!
+		Starts the statistics of a run. Does nothing if they are already started, 
+		so RunPersistence(std::vector) can time its copy before calling RunPersistence(TDataView).
+	*/
+	void BeginStats()
+	{
+		if (StatsRunning) return;
+
+		StatsRunning = true;
+		Stats.Clear();
+		GetWorkingCapacities(StatsCapacities);
+		RunStart = PhaseStart = StatsNow();
+	}
+
+	/*!
+		Adds the time since the previous mark to phase.
+	*/
+	void MarkPhase(const TStatsPhase phase)
+	{
+		const long long now = StatsNow();
+		Stats.PhaseNs[phase] += now - PhaseStart;
+		PhaseStart = now;
+	}
+
+	/*!
+		Finishes the statistics of a run: total time, counters derived from the results, and capacity growth.
+	*/
+	void EndStats()
+	{
+		Stats.TotalNs = StatsNow() - RunStart;
+		Stats.Vertices = std::max(Input.Size, 0);
+		Stats.ComponentsCreated = (int)TotalComponents;
+		Stats.ComponentsMerged = (TotalComponents > 0) ? (int)TotalComponents - 1 : 0;
+		Stats.PairsEmitted = (int)PairedExtrema.size();
+
+		size_t capacities[STATS_VECTORS];
+		GetWorkingCapacities(capacities);
+		for (int v = 0; v != STATS_VECTORS; v++)
+		{
+			if (capacities[v] == StatsCapacities[v]) continue;
+			Stats.GrownVectors++;
+			if (capacities[v] > StatsCapacities[v]) Stats.GrownBytes += (long long)(capacities[v] - StatsCapacities[v]);
+		}
+
+		Latency.Add(Stats.TotalNs);
+		StatsRunning = false;
+	}
+
+	template <class TVector>
+	static size_t CapacityBytes(const TVector& v)
+	{
+		return v.capacity() * sizeof(typename TVector::value_type);
+	}
+
+	/*!
+		Fills capacities with the bytes reserved by each working vector of a run.
+	*/
+	void GetWorkingCapacities(size_t* capacities) const
+	{
+		capacities[0] = CapacityBytes(Data);
+		capacities[1] = CapacityBytes(SortedData);
+		capacities[2] = CapacityBytes(SortBuffer);
+		capacities[3] = CapacityBytes(SortBuckets);
+		capacities[4] = CapacityBytes(ExtremaIndices);
+		capacities[5] = CapacityBytes(Colors);
+		capacities[6] = CapacityBytes(Components);
+		capacities[7] = CapacityBytes(PairedExtrema);
+		capacities[8] = CapacityBytes(SortKeys);
+		capacities[9] = CapacityBytes(ComponentEdges);
+		capacities[10] = CapacityBytes(ComponentMinIndices);
+		capacities[11] = CapacityBytes(ComponentMinValues);
+	}
+#endif
 	
 	
 	/*!
@@ -432,21 +1472,24 @@ protected:
 	
 	/*!
 		Creates a new PairedExtrema from the two indices, and adds it to PairedFeatures.
+		Pairs whose persistence is below PairThreshold are dropped.
 
-		@param[in] firstIdx, secondIdx Indices of vertices to be paired. Order does not matter. 
+		@param[in] firstIdx, secondIdx		Indices of vertices to be paired. Order does not matter. 
+		@param[in] firstValue, secondValue	Data values of the vertices.
 	*/
-	void CreatePairedExtrema(const int firstIdx, const int secondIdx)
+	void CreatePairedExtrema(const int firstIdx, const TValue firstValue, const int secondIdx, const TValue secondValue)
 	{
 		TPairedExtrema pair; 
+		TValue minValue, maxValue;
 		
 		//There might be a potential bug here, todo (we're checking data, not sorted data)
 		//example case: 1 1 1 1 1 1 -5 might remove if after else
-		if (Data[firstIdx] > Data[secondIdx])
+		if (firstValue > secondValue)
 		{
 			pair.MaxIndex = firstIdx; 
 			pair.MinIndex = secondIdx;
 		}
-		else if (Data[secondIdx] > Data[firstIdx])
+		else if (secondValue > firstValue)
 		{
 			pair.MaxIndex = secondIdx; 
 			pair.MinIndex = firstIdx;
@@ -462,12 +1505,25 @@ protected:
 			pair.MinIndex = secondIdx;
 			pair.MaxIndex = firstIdx;
 		}
+
+		if (pair.MinIndex == firstIdx)
+		{
+			minValue = firstValue;
+			maxValue = secondValue;
+		}
+		else
+		{
+			minValue = secondValue;
+			maxValue = firstValue;
+		}
 				
-		pair.Persistence = Data[pair.MaxIndex] - Data[pair.MinIndex];
+		pair.Persistence = maxValue - minValue;
 
 #ifdef _DEBUG
 		assert(pair.Persistence >= 0);
 #endif
+		if (pair.Persistence < PairThreshold) return;
+
 		if (PairedExtrema.capacity() == PairedExtrema.size()) 
 		{
 			PairedExtrema.reserve(PairedExtrema.size() * 2 + 1);
@@ -486,16 +1542,17 @@ protected:
 	- Initializes its edges and minimum index to minIdx.
 	- Updates Colors[minIdx] to the component's color.
 
-	@param[in]	minIdx Index of a local minimum. 
+	@param[in]	minIdx		Index of a local minimum. 
+	@param[in]	minValue	Data value of the local minimum.
 	*/
-	void CreateComponent(const int minIdx)
+	void CreateComponent(const int minIdx, const TValue minValue)
 	{
 		TComponent comp;
 		comp.Alive = true;
 		comp.LeftEdgeIndex = minIdx;
 		comp.RightEdgeIndex = minIdx;
 		comp.MinIndex = minIdx;
-		comp.MinValue = Data[minIdx];
+		comp.MinValue = minValue;
 
 		//place at the end of component vector and get the current size
 		if (Components.capacity() <= TotalComponents)
@@ -549,120 +1606,686 @@ protected:
 
 	/*!
 		Initializes main data structures used in class:
-		- Sets Colors[] to NO_COLOR
-		- Reserves memory for Components and PairedExtrema
+		- Reserves memory for SortedData, Components and PairedExtrema
 	
-		Note: SortedData is should be created before, separately, using CreateIndexValueVector()
+		Note: SortedData and Colors should be created after, separately, using CreateIndexValueVector()
+		or CreateExtremaIndexValueVector().
 	*/
 	void Init()
 	{
 		SortedData.clear();
-		SortedData.reserve(Data.size());
+		ExtremaIndices.clear();
 		
 		Colors.clear();
-		Colors.resize(Data.size());
-		std::fill(Colors.begin(), Colors.end(), NO_COLOR);
 		
-		int vectorSize = (int)(Data.size()/RESIZE_FACTOR) + 1; //starting reserved size >= 1 at least
+		int vectorSize = std::max(Input.Size, 0)/RESIZE_FACTOR + 1; //starting reserved size >= 1 at least
 		
 		Components.clear();
 		Components.reserve(vectorSize);
 
 		PairedExtrema.clear();
 		PairedExtrema.reserve(vectorSize);
+		PairsSorted = true;
 
 		TotalComponents = 0;
 		AliveComponentsVerified = false;
+
+		OpenMinima.clear();
+		OpenMaxima.clear();
+		OpenPairs.clear();
+		TailAdded.clear();
+		TailRemoved.clear();
+		DomainSize = Input.Size;
+		DiscardedSamples = 0;
+		IncrementalValid = false;
 	}
 
 
 	/*!
-		Creates SortedData vector.
-		Assumes Data is already set.
-	*/	
-	void CreateIndexValueVector()
+		Resets the results and prepares AppendSamples to stream Data from its first vertex.
+	*/
+	void InitIncremental()
 	{
-		if (Data.size()==0) return;
-				
-		for (std::vector<double>::size_type i = 0; i != Data.size(); i++)
-		{
-			TIdxAndData dataidxpair; 
-
-			//this is going to make problems
-			dataidxpair.Data = Data[i]; 
-			dataidxpair.Idx = (int)i; 
-
-			SortedData.push_back(dataidxpair);
-		}
+		SortedData.clear();
+		Colors.clear();
+		Components.clear();
+		PairedExtrema.clear();
+		PairsSorted = true;
+		TotalComponents = 0;
+		PairThreshold = 0;
+		AliveComponentsVerified = false;
 
-		std::sort(SortedData.begin(), SortedData.end());
+		OpenMinima.clear();
+		OpenMaxima.clear();
+		OpenPairs.clear();
+		TailAdded.clear();
+		TailRemoved.clear();
+		DiscardedSamples = 0;
+		StreamedCount = 0;
+		Descending = false;
+		IncrementalValid = true;
 	}
 
 
 	/*!
-		Main algorithm - all of the work happen here.
+		Processes the next vertex of Data for AppendSamples.
 
-		Use only after calling CreateIndexValueVector and Init functions.
+		A vertex is a local minimum if it is lower than both of its neighbors. Equal values are ordered 
+		from left to right, as in SortedData. Only once the right neighbor is known to be higher, the 
+		vertex is committed as an open minimum.
 
-		Iterates over each vertex in the graph according to their ordered values:
-		- Creates a segment for each local minima
-		- Extends a segment is data has only one neighboring component
-		- Merges segments and creates new PairedExtrema when a vertex has two neighboring components. 
+		@param[in]	dataIdx	Position of the vertex in Data, one past the last streamed vertex.
 	*/
-	void Watershed()
+	void StreamVertex(const int dataIdx)
 	{
-		if (SortedData.size()==1)
+		TIdxAndData vertex;
+		vertex.Idx = DiscardedSamples + dataIdx;
+		vertex.Data = Data[dataIdx];
+
+		//left most vertex - a local minimum if its right neighbor is higher
+		if (vertex.Idx == 0)
 		{
-			CreateComponent(0);
+			Descending = true;
 			return;
 		}
 
-		for (std::vector<TIdxAndData>::iterator p = SortedData.begin(); p != SortedData.end(); p++)
+		TIdxAndData previous;
+		previous.Idx = vertex.Idx - 1;
+		previous.Data = Data[dataIdx - 1];
+
+		if (previous < vertex)
 		{
-			int i = (*p).Idx;
+			if (Descending) 
+			{
+				CommitOpenMinimum(previous);
+			}
+			RunMaximum = vertex;
+			Descending = false;
+		}
+		else 
+		{
+			Descending = true;
+		}
+	}
 
-			//left most vertex - no left neighbor
-			//two options - either local minimum, or extend component
-			if (i==0)
+
+	/*!
+		Pushes a local minimum to the open minima stack.
+		
+		Every open minimum that is higher than the new one found its lower vertex to the right. 
+		It is paired with the lower of its two barriers - the highest vertex towards the open minimum 
+		on its left, or the highest vertex towards the new minimum.
+
+		@param[in]	minimum	The new local minimum. RunMaximum must hold the highest vertex between
+							the last open minimum and it.
+	*/
+	void CommitOpenMinimum(const TIdxAndData& minimum)
+	{
+		TIdxAndData barrier = RunMaximum;
+
+		while (!OpenMinima.empty() && minimum < OpenMinima.back())
+		{
+			//the pair with its left barrier is no longer open
+			if (!OpenMaxima.empty()) EraseOpenPair(MakePair(OpenMinima.back(), OpenMaxima.back()));
+
+			if (!OpenMaxima.empty() && OpenMaxima.back() < barrier) //left barrier is lower - merge to the left
 			{
-				if (Colors[i+1] == NO_COLOR) 
-				{
-					CreateComponent(i);
-				}
-				else
-				{
-					ExtendComponent(Colors[i+1], i);  //in this case, local max as well
-				}
-				
-				continue;
+				CreatePairedExtrema(OpenMinima.back().Idx, OpenMinima.back().Data, OpenMaxima.back().Idx, OpenMaxima.back().Data);
+				OpenMinima.pop_back();
+				OpenMaxima.pop_back();
 			}
-			else if (i == Colors.size()-1) //right most vertex - look only to the left
+			else //right barrier is lower, or there is nothing lower to the left
 			{
-				if (Colors[i-1] == NO_COLOR) 
+				CreatePairedExtrema(OpenMinima.back().Idx, OpenMinima.back().Data, barrier.Idx, barrier.Data);
+				OpenMinima.pop_back();
+				if (!OpenMaxima.empty())
 				{
-					CreateComponent(i);
+					barrier = OpenMaxima.back();
+					OpenMaxima.pop_back();
 				}
-				else
-				{
-					ExtendComponent(Colors[i-1], i);
-				}				
-				continue;
 			}
+		}
 
-			//look left and right
-			if (Colors[i-1] == NO_COLOR && Colors[i+1] == NO_COLOR) //local minimum - create new component
-			{
-				CreateComponent(i);
-			}
-			else if (Colors[i-1] != NO_COLOR && Colors[i+1] == NO_COLOR) //single neighbor on the left - extnd
-			{
-				ExtendComponent(Colors[i-1], i);
-			}
-			else if (Colors[i-1] == NO_COLOR && Colors[i+1] != NO_COLOR) //single component on the right - extend
-			{
-				ExtendComponent(Colors[i+1], i);
-			}
-			else if (Colors[i-1] != NO_COLOR && Colors[i+1] != NO_COLOR) //local maximum - merge components
+		if (!OpenMinima.empty())
+		{
+			OpenMaxima.push_back(barrier);
+			InsertOpenPair(MakePair(minimum, barrier));
+		}
+		OpenMinima.push_back(minimum);
+	}
+
+
+	/*!
+		Completes OpenPairs and creates the global minimum component for the data as it currently ends.
+		Open minima have no lower vertex to their right, so each is paired with its left barrier; 
+		OpenPairs already holds these pairs. If the data ends in a descent, the last vertex is a local minimum 
+		as well; it is resolved against the stack without modifying it, and only the pairs of the minima 
+		it is lower than change. The changes are recorded in TailAdded and TailRemoved.
+	*/
+	void UpdateOpenPairs()
+	{
+		Components.clear();
+		TotalComponents = 0;
+
+		int top = (int)OpenMinima.size() - 1;
+		TIdxAndData globalMinimum;
+
+		if (Descending)
+		{
+			TIdxAndData last; 
+			last.Idx = DomainSize - 1;
+			last.Data = Data.back();
+			TIdxAndData barrier = RunMaximum;
+
+			while (top >= 0 && last < OpenMinima[top])
+			{
+				//otherwise the minimum keeps the pair with its left barrier
+				if (!(top > 0 && OpenMaxima[top-1] < barrier))
+				{
+					if (top > 0) TailRemoved.push_back(MakePair(OpenMinima[top], OpenMaxima[top-1]));
+					TailAdded.push_back(MakePair(OpenMinima[top], barrier));
+					if (top > 0) barrier = OpenMaxima[top-1];
+				}
+				top--;
+			}
+
+			if (top >= 0) 
+			{
+				TailAdded.push_back(MakePair(last, barrier));
+			}
+			else 
+			{
+				globalMinimum = last;
+			}
+		}
+
+		if (top >= 0)
+		{
+			globalMinimum = OpenMinima.front();
+		}
+
+		for (typename TPairVector::const_iterator p = TailRemoved.begin(); p != TailRemoved.end(); p++) EraseOpenPair(*p);
+		for (typename TPairVector::const_iterator p = TailAdded.begin(); p != TailAdded.end(); p++) InsertOpenPair(*p);
+
+		//the single surviving component, so the global minimum queries work as after RunPersistence
+		TComponent comp;
+		comp.Alive = true;
+		comp.LeftEdgeIndex = 0;
+		comp.RightEdgeIndex = DomainSize - 1;
+		comp.MinIndex = globalMinimum.Idx;
+		comp.MinValue = globalMinimum.Data;
+		Components.push_back(comp);
+		TotalComponents = 1;
+	}
+
+
+	/*!
+		Undoes the changes UpdateOpenPairs made for the descent at the end of the data, 
+		so OpenPairs holds the pairs of the stack only.
+	*/
+	void RevertTailPairs()
+	{
+		for (typename TPairVector::const_iterator p = TailAdded.begin(); p != TailAdded.end(); p++) EraseOpenPair(*p);
+		for (typename TPairVector::const_iterator p = TailRemoved.begin(); p != TailRemoved.end(); p++) InsertOpenPair(*p);
+		TailAdded.clear();
+		TailRemoved.clear();
+	}
+
+
+	/*!
+		Returns the pair of an open minimum and a maximum.
+	*/
+	static TPairedExtrema MakePair(const TIdxAndData& minimum, const TIdxAndData& maximum)
+	{
+		TPairedExtrema pair;
+		pair.MinIndex = minimum.Idx;
+		pair.MaxIndex = maximum.Idx;
+		pair.Persistence = maximum.Data - minimum.Data;
+		return pair;
+	}
+
+
+	/*!
+		Inserts a pair into OpenPairs at its sorted position.
+	*/
+	void InsertOpenPair(const TPairedExtrema& pair)
+	{
+		OpenPairs.insert(std::upper_bound(OpenPairs.begin(), OpenPairs.end(), pair), pair);
+	}
+
+
+	/*!
+		Removes a pair from OpenPairs. Every open minimum has one pair, so the minimum identifies it;
+		the search falls back to a scan if the persistence does not order, as for NaN.
+	*/
+	void EraseOpenPair(const TPairedExtrema& pair)
+	{
+		typename TPairVector::iterator p = std::lower_bound(OpenPairs.begin(), OpenPairs.end(), pair);
+		if (p == OpenPairs.end() || (*p).MinIndex != pair.MinIndex)
+		{
+			for (p = OpenPairs.begin(); p != OpenPairs.end() && (*p).MinIndex != pair.MinIndex; p++);
+			if (p == OpenPairs.end()) return;
+		}
+		OpenPairs.erase(p);
+	}
+
+
+	/*!
+		Sorts the pairs resolved by the last AppendSamples and merges them into PairedExtrema.
+		The merge runs from the back, so only pairs more persistent than the least persistent 
+		new pair are moved. MergeBuffer holds the new pairs meanwhile.
+
+		@param[in]	resolvedPairs	Number of pairs in PairedExtrema before the call; they are already sorted.
+	*/
+	void MergeResolvedPairs(const typename TPairVector::size_type resolvedPairs)
+	{
+		if (resolvedPairs == PairedExtrema.size()) return;
+
+		MergeBuffer.assign(PairedExtrema.begin() + resolvedPairs, PairedExtrema.end());
+		std::sort(MergeBuffer.begin(), MergeBuffer.end());
+
+		ptrdiff_t older = (ptrdiff_t)resolvedPairs - 1;
+		ptrdiff_t newer = (ptrdiff_t)MergeBuffer.size() - 1;
+		ptrdiff_t target = (ptrdiff_t)PairedExtrema.size() - 1;
+
+		while (newer >= 0)
+		{
+			if (older >= 0 && MergeBuffer[newer] < PairedExtrema[older])
+			{
+				PairedExtrema[target--] = PairedExtrema[older--];
+			}
+			else
+			{
+				PairedExtrema[target--] = MergeBuffer[newer--];
+			}
+		}
+	}
+
+
+	/*!
+		Creates SortedData vector.
+		Assumes Input is already set.
+	*/	
+	void CreateIndexValueVector()
+	{
+		if (Input.Size <= 0) return;
+				
+		SortedData.reserve(Input.Size);
+		for (int i = 0; i != Input.Size; i++)
+		{
+			TIdxAndData dataidxpair; 
+
+			//this is going to make problems
+			dataidxpair.Data = Input[i]; 
+			dataidxpair.Idx = i; 
+
+			SortedData.push_back(dataidxpair);
+		}
+
+		SortVertices();
+		InitColors(SortedData.size());
+	}
+
+
+	/*!
+		Creates SortedData vector from the local extrema of Input only, and fills ExtremaIndices.
+		Assumes Input is already set.
+
+		The first and last vertices are always kept. An inner vertex is kept if it is lower or higher 
+		than both of its neighbors, where equal values are ordered from left to right as in SortedData. 
+		Vertices in between are monotone and never get paired, so the watershed over the kept 
+		vertices creates the same pairs. SortedData indices refer to ExtremaIndices, see RestoreExtremaIndices.
+	*/	
+	void CreateExtremaIndexValueVector()
+	{
+		if (Input.Size <= 0) return;
+
+		CreateExtremaIndices();
+
+		SortedData.reserve(ExtremaIndices.size());
+		for (int i = 0; i != (int)ExtremaIndices.size(); i++)
+		{
+			TIdxAndData dataidxpair; 
+			dataidxpair.Data = Input[ExtremaIndices[i]]; 
+			dataidxpair.Idx = i; 
+
+			SortedData.push_back(dataidxpair);
+		}
+
+		SortVertices();
+		InitColors(SortedData.size());
+	}
+
+
+	/*!
+		Fills ExtremaIndices with the indices of the local extrema of Input, see CreateExtremaIndexValueVector.
+	*/
+	void CreateExtremaIndices()
+	{
+		const int last = Input.Size - 1;
+		
+		if (Input.Stride == 1)
+		{
+			//contiguous input: classify with the vectorized kernel, see persistence1d_simd.hpp
+			ExtremaIndices.resize(Input.Size);
+			ExtremaIndices.resize(FindExtremaIndices(Input.Ptr, Input.Size, &ExtremaIndices[0]));
+		}
+		else
+		{
+			ExtremaIndices.reserve(Input.Size);
+			for (int i = 0; i <= last; i++)
+			{
+				if (i != 0 && i != last)
+				{
+					bool lowerThanLeft = Input[i-1] > Input[i];
+					bool lowerThanRight = Input[i+1] >= Input[i];
+					if (lowerThanLeft != lowerThanRight) continue; //monotone vertex
+				}
+				ExtremaIndices.push_back(i);
+			}
+		}
+	}
+
+
+	/*!
+		Sorts SortedData with the algorithm selected by SortEngine. 
+		Every algorithm produces the order of TIdxAndData::operator<.
+		Inputs below DISTRIBUTION_SORT_MIN_SIZE are sorted with std::sort whatever the engine.
+	*/
+	void SortVertices()
+	{
+		if (SortedData.size() < DISTRIBUTION_SORT_MIN_SIZE)
+		{
+			std::sort(SortedData.begin(), SortedData.end());
+			return;
+		}
+
+		//the distribution sorts move every vertex even when there is nothing to do, std::sort does not
+		if (SortEngine != SORT_COMPARISON && std::is_sorted(SortedData.begin(), SortedData.end())) return;
+
+		switch (SortEngine)
+		{
+		case SORT_QUANTIZED:
+			if (QuantizedSort()) return;
+			//too many buckets
+			RadixSort();
+			return;
+		case SORT_RADIX:
+			RadixSort();
+			return;
+		default:
+			std::sort(SortedData.begin(), SortedData.end());
+		}
+	}
+
+
+	/*!
+		LSD radix sort of SortedData, RADIX_DIGIT_BITS of TKeyTraits::RadixKey per pass. 
+		Only digits in which the keys differ get a histogram and a pass, so narrow value ranges take fewer passes.
+		SortedData is in index order before the sort, and each pass is stable, so equal values stay in index order.
+	*/
+	void RadixSort()
+	{
+		const int bits = 8 * TKeyTraits::RADIX_BYTES;
+		const size_t size = SortedData.size();
+		if (bits == 0 || size < 2)
+		{
+			std::sort(SortedData.begin(), SortedData.end());
+			return;
+		}
+
+		//bits in which any key differs from the first one
+		const unsigned long long first = TKeyTraits::RadixKey(SortedData[0].Data);
+		unsigned long long differing = 0;
+		for (size_t i = 1; i != size; i++)
+		{
+			differing |= TKeyTraits::RadixKey(SortedData[i].Data) ^ first;
+		}
+
+		int shifts[RADIX_MAX_PASSES];
+		int passes = 0;
+		for (int shift = 0; shift < bits; shift += RADIX_DIGIT_BITS)
+		{
+			if (((differing >> shift) & (RADIX_DIGITS - 1)) != 0) shifts[passes++] = shift;
+		}
+		//all keys are equal, SortedData is already in index order
+		if (passes == 0) return;
+
+		//histograms of all used digits in one pass
+		SortBuckets.assign(passes * RADIX_DIGITS, 0);
+		int* counts = &SortBuckets[0];
+		for (size_t i = 0; i != size; i++)
+		{
+			const unsigned long long key = TKeyTraits::RadixKey(SortedData[i].Data);
+			for (int pass = 0; pass != passes; pass++)
+			{
+				counts[pass * RADIX_DIGITS + ((key >> shifts[pass]) & (RADIX_DIGITS - 1))]++;
+			}
+		}
+
+		SortBuffer.resize(size);
+		for (int pass = 0; pass != passes; pass++)
+		{
+			const int shift = shifts[pass];
+			int* offsets = counts + pass * RADIX_DIGITS;
+
+			int offset = 0;
+			for (int digit = 0; digit != RADIX_DIGITS; digit++)
+			{
+				const int count = offsets[digit];
+				offsets[digit] = offset;
+				offset += count;
+			}
+
+			for (size_t i = 0; i != size; i++)
+			{
+				const unsigned long long key = TKeyTraits::RadixKey(SortedData[i].Data);
+				SortBuffer[offsets[(key >> shift) & (RADIX_DIGITS - 1)]++] = SortedData[i];
+			}
+			SortedData.swap(SortBuffer);
+		}
+	}
+
+
+	/*!
+		Counting sort of SortedData into buckets of SortQuantum, followed by a comparison sort of each bucket.
+		The bucket of a value never decreases with the value, and the counting sort keeps equal values 
+		in index order, so the result is the same as std::sort.
+		Returns false, without sorting, if the data needs more buckets than it has vertices.
+	*/
+	bool QuantizedSort()
+	{
+		const size_t size = SortedData.size();
+		if (size < 2) return true;
+
+		double minValue = (double)SortedData[0].Data;
+		double maxValue = minValue;
+		for (size_t i = 1; i != size; i++)
+		{
+			const double value = (double)SortedData[i].Data;
+			if (value < minValue) minValue = value;
+			if (value > maxValue) maxValue = value;
+		}
+
+		//also false for infinite or NaN ranges and non-positive quanta
+		const double range = (maxValue - minValue) / SortQuantum;
+		if (!(SortQuantum > 0 && range < (double)size)) return false;
+		const int buckets = (int)range + 1;
+
+		SortBuckets.assign(buckets + 1, 0);
+		for (size_t i = 0; i != size; i++)
+		{
+			SortBuckets[Bucket(SortedData[i].Data, minValue, buckets) + 1]++;
+		}
+		for (int b = 0; b != buckets; b++)
+		{
+			SortBuckets[b + 1] += SortBuckets[b];
+		}
+
+		SortBuffer.resize(size);
+		for (size_t i = 0; i != size; i++)
+		{
+			SortBuffer[SortBuckets[Bucket(SortedData[i].Data, minValue, buckets)]++] = SortedData[i];
+		}
+		SortedData.swap(SortBuffer);
+
+		//SortBuckets[b] is now the end of bucket b
+		int begin = 0;
+		for (int b = 0; b != buckets; b++)
+		{
+			const int end = SortBuckets[b];
+			if (end - begin > 1)
+			{
+				std::sort(SortedData.begin() + begin, SortedData.begin() + end);
+			}
+			begin = end;
+		}
+		return true;
+	}
+
+
+	/*!
+		Returns the bucket of SORT_QUANTIZED for value, clamped to [0, buckets-1]; NaN goes to bucket 0.
+	*/
+	int Bucket(const TValue value, const double minValue, const int buckets) const
+	{
+		const double bucket = ((double)value - minValue) / SortQuantum;
+		if (!(bucket >= 0)) return 0;
+		if (bucket >= buckets) return buckets - 1;
+		return (int)bucket;
+	}
+
+
+	/*!
+		Creates SortKeys for the compact layout, from all vertices of Input or only from its local extrema,
+		see CreateExtremaIndexValueVector. Assumes Input is already set.
+
+		@param[in] compress	Use only the local extrema, and fill ExtremaIndices.
+	*/
+	void CreateSortKeys(const bool compress)
+	{
+		SortKeys.clear();
+
+		if (compress)
+		{
+			CreateExtremaIndices();
+
+			SortKeys.reserve(ExtremaIndices.size());
+			for (int i = 0; i != (int)ExtremaIndices.size(); i++)
+			{
+				SortKeys.push_back(TKeyTraits::Pack(Input[ExtremaIndices[i]], i));
+			}
+		}
+		else
+		{
+			SortKeys.reserve(Input.Size);
+			for (int i = 0; i != Input.Size; i++)
+			{
+				SortKeys.push_back(TKeyTraits::Pack(Input[i], i));
+			}
+		}
+
+		std::sort(SortKeys.begin(), SortKeys.end());
+		InitColors(SortKeys.size());
+	}
+
+
+	/*!
+		Sets Colors[] to NO_COLOR for size vertices.
+	*/
+	void InitColors(const size_t size)
+	{
+		Colors.resize(size);
+		std::fill(Colors.begin(), Colors.end(), NO_COLOR);
+	}
+
+
+	/*!
+		Translates the indices of PairedExtrema and Components from the compressed vertex indices 
+		back to Data indices. Used after Watershed when SortedData was created by CreateExtremaIndexValueVector.
+	*/
+	void RestoreExtremaIndices()
+	{
+		for (typename TPairVector::iterator p = PairedExtrema.begin(); p != PairedExtrema.end(); p++)
+		{
+			(*p).MinIndex = ExtremaIndices[(*p).MinIndex];
+			(*p).MaxIndex = ExtremaIndices[(*p).MaxIndex];
+		}
+
+		for (typename TComponentVector::iterator c = Components.begin(); c != Components.end(); c++)
+		{
+			(*c).LeftEdgeIndex = ExtremaIndices[(*c).LeftEdgeIndex];
+			(*c).RightEdgeIndex = ExtremaIndices[(*c).RightEdgeIndex];
+			(*c).MinIndex = ExtremaIndices[(*c).MinIndex];
+		}
+	}
+
+
+	/*!
+		Main algorithm - all of the work happen here.
+
+		Use only after calling CreateIndexValueVector and Init functions.
+
+		Iterates over each vertex in the graph according to their ordered values:
+		- Creates a segment for each local minima
+		- Extends a segment is data has only one neighboring component
+		- Merges segments and creates new PairedExtrema when a vertex has two neighboring components. 
+	*/
+	void Watershed()
+	{
+		if (SortedData.size()==1)
+		{
+			CreateComponent(0, SortedData.front().Data);
+			return;
+		}
+
+		for (typename TIdxAndDataVector::iterator p = SortedData.begin(); p != SortedData.end(); p++)
+		{
+			int i = (*p).Idx;
+			TValue value = (*p).Data;
+
+			//left most vertex - no left neighbor
+			//two options - either local minimum, or extend component
+			if (i==0)
+			{
+				if (Colors[i+1] == NO_COLOR) 
+				{
+					CreateComponent(i, value);
+				}
+				else
+				{
+					ExtendComponent(Colors[i+1], i);  //in this case, local max as well
+				}
+				
+				continue;
+			}
+			else if (i == Colors.size()-1) //right most vertex - look only to the left
+			{
+				if (Colors[i-1] == NO_COLOR) 
+				{
+					CreateComponent(i, value);
+				}
+				else
+				{
+					ExtendComponent(Colors[i-1], i);
+				}				
+				continue;
+			}
+
+			//look left and right
+			if (Colors[i-1] == NO_COLOR && Colors[i+1] == NO_COLOR) //local minimum - create new component
+			{
+				CreateComponent(i, value);
+			}
+			else if (Colors[i-1] != NO_COLOR && Colors[i+1] == NO_COLOR) //single neighbor on the left - extnd
+			{
+				ExtendComponent(Colors[i-1], i);
+			}
+			else if (Colors[i-1] == NO_COLOR && Colors[i+1] != NO_COLOR) //single component on the right - extend
+			{
+				ExtendComponent(Colors[i+1], i);
+			}
+			else if (Colors[i-1] != NO_COLOR && Colors[i+1] != NO_COLOR) //local maximum - merge components
 			{
 				int leftComp, rightComp; 
 
@@ -672,11 +2295,11 @@ protected:
 				//choose component with smaller hub destroyed component
 				if (Components[rightComp].MinValue < Components[leftComp].MinValue) //left component has smaller hub
 				{
-					CreatePairedExtrema(Components[leftComp].MinIndex, i);
+					CreatePairedExtrema(Components[leftComp].MinIndex, Components[leftComp].MinValue, i, value);
 				}
 				else	//either right component has smaller hub, or hubs are equal - destroy right component. 
 				{
-					CreatePairedExtrema(Components[rightComp].MinIndex, i);
+					CreatePairedExtrema(Components[rightComp].MinIndex, Components[rightComp].MinValue, i, value);
 				}
 					
 				MergeComponents(leftComp, rightComp);
@@ -686,13 +2309,197 @@ protected:
 	}
 
 
+	/*!
+		Same as Watershed, over SortKeys, with the compact layout of components.
+
+		Components are created in ascending order of their minima, so of two components the one with 
+		the higher minimum is the one with the larger color, and merging needs no minimum values.
+		The minima are only read to create a pair. The global minimum is stored in Components
+		at the end, for GetGlobalMinimumIndex and GetGlobalMinimumValue.
+	*/
+	void CompactWatershed()
+	{
+		const int size = (int)SortKeys.size();
+
+		//extrema alternate, so with compressed input about every second vertex is a minimum
+		const int reserveSize = (ExtremaIndices.empty() ? size/RESIZE_FACTOR : size/2) + 1;
+
+		ComponentEdges.clear();
+		ComponentMinIndices.clear();
+		ComponentMinValues.clear();
+		ComponentEdges.reserve(reserveSize);
+		ComponentMinIndices.reserve(reserveSize);
+		ComponentMinValues.reserve(reserveSize);
+#ifdef _DEBUG
+		ComponentAlive.clear();
+		ComponentAlive.reserve(reserveSize);
+#endif
+
+		for (typename TSortKeyVector::const_iterator k = SortKeys.begin(); k != SortKeys.end(); k++)
+		{
+			const int i = TKeyTraits::Index(*k);
+			const int leftComp = (i > 0) ? Colors[i-1] : NO_COLOR;
+			const int rightComp = (i < size-1) ? Colors[i+1] : NO_COLOR;
+
+			if (leftComp == NO_COLOR && rightComp == NO_COLOR) //local minimum - create new component
+			{
+				TComponentEdges edges;
+				edges.Left = i;
+				edges.Right = i;
+
+				Colors[i] = (int)ComponentEdges.size();
+				ComponentEdges.push_back(edges);
+				ComponentMinIndices.push_back(i);
+				ComponentMinValues.push_back(TKeyTraits::Value(*k));
+#ifdef _DEBUG
+				ComponentAlive.push_back(true);
+#endif
+			}
+			else if (rightComp == NO_COLOR) //i is right of the left component
+			{
+				ComponentEdges[leftComp].Right = i;
+				Colors[i] = leftComp;
+			}
+			else if (leftComp == NO_COLOR) //i is left of the right component
+			{
+				ComponentEdges[rightComp].Left = i;
+				Colors[i] = rightComp;
+			}
+			else //local maximum - merge components, the one with the higher minimum is destroyed
+			{
+				const int survivor = std::min(leftComp, rightComp);
+				const int destroyed = std::max(leftComp, rightComp);
+
+				TPairedExtrema pair;
+				pair.MinIndex = ComponentMinIndices[destroyed];
+				pair.MaxIndex = i;
+				pair.Persistence = TKeyTraits::Value(*k) - ComponentMinValues[destroyed];
+				if (!(pair.Persistence < PairThreshold)) PairedExtrema.push_back(pair);
+
+				const int leftEdge = ComponentEdges[leftComp].Left;
+				const int rightEdge = ComponentEdges[rightComp].Right;
+				ComponentEdges[survivor].Left = leftEdge;
+				ComponentEdges[survivor].Right = rightEdge;
+				Colors[leftEdge] = survivor;
+				Colors[rightEdge] = survivor;
+				Colors[i] = survivor;
+#ifdef _DEBUG
+				assert(ComponentAlive[leftComp] && ComponentAlive[rightComp]);
+				ComponentAlive[destroyed] = false;
+#endif
+			}
+		}
+
+		TotalComponents = (unsigned int)ComponentEdges.size();
+		if (ComponentEdges.empty()) return;
+
+		TComponent global;
+		global.Alive = true;
+		global.LeftEdgeIndex = ComponentEdges.front().Left;
+		global.RightEdgeIndex = ComponentEdges.front().Right;
+		global.MinIndex = ComponentMinIndices.front();
+		global.MinValue = ComponentMinValues.front();
+		Components.push_back(global);
+
+#ifdef _DEBUG
+		assert(std::count(ComponentAlive.begin(), ComponentAlive.end(), true) == 1 && ComponentAlive.front());
+#endif
+	}
+
+
 	/*!
 		Sorts the PairedExtrema list according to the persistence of the features. 
 		Orders features with equal persistence according the the index of their minima.
 	*/
-	void SortPairedExtrema()
+	void SortPairedExtrema() const
 	{
 		std::sort(PairedExtrema.begin(), PairedExtrema.end());
+		PairsSorted = true;
+	}
+
+	/*!
+		Sorts PairedExtrema if the run deferred it, see TRunOptions::DeferPairSort.
+	*/
+	void EnsurePairsSorted() const
+	{
+		if (!PairsSorted) SortPairedExtrema();
+	}
+
+
+	/*!
+		Fills OrderedMinima and OrderedMaxima with the indices of the pairs whose persistence is greater than 
+		or equal to threshold, in ascending order. The extrema are marked in MinimaBits and MaximaBits, 
+		which are then scanned word by word, so no comparison sort is needed.
+
+		@param[in]	threshold				Minimal persistence of the pairs.
+		@param[in]	withSegmentData			Also add the global minimum to OrderedMinima, and fill OrderedPersistence 
+											with the persistence of the pair of each ordered maximum.
+	*/
+	void CreateOrderedExtrema(const double threshold, const bool withSegmentData) const
+	{
+		const int words = (std::max(DomainSize, 0) + 63) / 64;
+		MinimaBits.assign(words, 0);
+		MaximaBits.assign(words, 0);
+
+		MarkExtrema(PairedExtrema, threshold);
+		MarkExtrema(OpenPairs, threshold);
+
+		const int globalMinIdx = GetGlobalMinimumIndex();
+		if (withSegmentData && globalMinIdx >= 0)
+		{
+			MinimaBits[globalMinIdx / 64] |= 1ULL << (globalMinIdx % 64);
+		}
+
+		OrderedMinima.clear();
+		OrderedMaxima.clear();
+		MaximaRanks.resize(words);
+		for (int w = 0; w != words; w++)
+		{
+			MaximaRanks[w] = (int)OrderedMaxima.size();
+			for (unsigned long long bits = MinimaBits[w]; bits != 0; bits &= bits - 1)
+			{
+				OrderedMinima.push_back(w * 64 + simd::LowestBit64(bits));
+			}
+			for (unsigned long long bits = MaximaBits[w]; bits != 0; bits &= bits - 1)
+			{
+				OrderedMaxima.push_back(w * 64 + simd::LowestBit64(bits));
+			}
+		}
+
+		if (!withSegmentData) return;
+
+		//the rank of a maximum is the number of maxima before it in the bitmap
+		OrderedPersistence.resize(OrderedMaxima.size());
+		StorePersistenceByRank(PairedExtrema, threshold);
+		StorePersistenceByRank(OpenPairs, threshold);
+	}
+
+	/*!
+		Sets the bits of the minimum and maximum of all pairs whose persistence is greater than or equal to threshold.
+	*/
+	void MarkExtrema(const TPairVector& pairs, const double threshold) const
+	{
+		for (typename TPairVector::const_iterator p = FirstCandidate(pairs, threshold); p != pairs.end(); p++)
+		{
+			if (PersistenceBelow(*p, threshold)) continue;
+			MinimaBits[(*p).MinIndex / 64] |= 1ULL << ((*p).MinIndex % 64);
+			MaximaBits[(*p).MaxIndex / 64] |= 1ULL << ((*p).MaxIndex % 64);
+		}
+	}
+
+	/*!
+		Stores the persistence of all pairs whose persistence is greater than or equal to threshold 
+		at the position of their maximum in OrderedMaxima.
+	*/
+	void StorePersistenceByRank(const TPairVector& pairs, const double threshold) const
+	{
+		for (typename TPairVector::const_iterator p = FirstCandidate(pairs, threshold); p != pairs.end(); p++)
+		{
+			if (PersistenceBelow(*p, threshold)) continue;
+			const int word = (*p).MaxIndex / 64;
+			const unsigned long long below = (1ULL << ((*p).MaxIndex % 64)) - 1;
+			OrderedPersistence[MaximaRanks[word] + simd::PopCount64(MaximaBits[word] & below)] = (*p).Persistence;
+		}
 	}
 
 
@@ -702,16 +2509,68 @@ protected:
 		
 		@param[in]	threshold	Minimum persistence of features to be returned.		
 	*/
-	std::vector<TPairedExtrema>::const_iterator FilterByPersistence(const double threshold = 0) const
+	typename TPairVector::const_iterator FilterByPersistence(const double threshold = 0) const
 	{		
-		if (threshold == 0 || threshold < 0) return PairedExtrema.begin();
+		return FilterByPersistence(PairedExtrema, threshold);
+	}
+
+	/*!
+		Returns an iterator to the first element in pairs whose persistence is bigger or equal to threshold. 
+
+		@param[in]	pairs		Vector of pairs sorted according to persistence.
+		@param[in]	threshold	Minimum persistence of features to be returned.		
+	*/
+	static typename TPairVector::const_iterator FilterByPersistence(const TPairVector& pairs, const double threshold)
+	{		
+		if (threshold == 0 || threshold < 0) return pairs.begin();
+
+		return(std::lower_bound(pairs.begin(), pairs.end(), threshold, PersistenceBelow));
+	}
+
+	/*!
+		Returns FilterByPersistence(pairs, threshold) if pairs is sorted, and the first pair otherwise, 
+		so callers still have to skip pairs below threshold. Lets the ordered queries run on deferred pairs.
+	*/
+	typename TPairVector::const_iterator FirstCandidate(const TPairVector& pairs, const double threshold) const
+	{
+		return (&pairs != &PairedExtrema || PairsSorted) ? FilterByPersistence(pairs, threshold) : pairs.begin();
+	}
 
-		TPairedExtrema searchPair; 
-		searchPair.Persistence = threshold;
-		searchPair.MaxIndex = 0; 
-		searchPair.MinIndex = 0;
-		return(lower_bound(PairedExtrema.begin(), PairedExtrema.end(), searchPair));
+	/*!
+		Comparison for FilterByPersistence. The threshold stays in double precision, 
+		so it is not rounded for integer value types.
+	*/
+	static bool PersistenceBelow(const TPairedExtrema& pair, const double threshold)
+	{
+		return pair.Persistence < threshold;
 	}
+	/*!
+		Marks index in MinimaBits. Returns false if it is outside of the domain or already marked.
+	*/
+	bool MarkExtremum(const int index) const
+	{
+		if (index < 0 || index >= DomainSize) return false;
+
+		unsigned long long& word = MinimaBits[index / 64];
+		const unsigned long long bit = 1ULL << (index % 64);
+		if (word & bit) return false;
+
+		word |= bit;
+		return true;
+	}
+
+	/*!
+		Marks the minimum and maximum of every pair, see VerifyResults.
+	*/
+	bool MarkPairs(const TPairVector& pairs) const
+	{
+		for (typename TPairVector::const_iterator p = pairs.begin(); p != pairs.end(); p++)
+		{
+			if (!MarkExtremum((*p).MinIndex) || !MarkExtremum((*p).MaxIndex)) return false;
+		}
+		return true;
+	}
+
 	/*!
 		Runs at the end of RunPersistence, after Watershed. 
 		Algorithm results should be as followed: 
@@ -733,7 +2592,7 @@ protected:
 #endif
 		}
 		
-		for (std::vector<TComponent>::const_iterator it = Components.begin()+1; it != Components.end(); it++)
+		for (typename TComponentVector::const_iterator it = Components.begin()+1; it != Components.end(); it++)
 		{
 			if ((*it).Alive == true) 
 			{
@@ -750,5 +2609,20 @@ protected:
 		return true;
 	}
 };
+
+/*!
+	Persistence1D for double values with the default allocator.
+*/
+typedef BasicPersistence1D<double> Persistence1D;
+
+/*!
+	Persistence1D for float values, e.g. single precision speeds.
+*/
+typedef BasicPersistence1D<float> Persistence1DFloat;
+
+/*!
+	Persistence1D for 32 bit integer values, e.g. raw device counts or fixed-point data.
+*/
+typedef BasicPersistence1D<int> Persistence1DInt;
 }
 #endif
\ No newline at end of file
@@ -0,0 +1,312 @@
+/*! \file persistence1d_batch.hpp
+    Runs persistence over many independent signals in parallel.
+
+	Uses <thread> and <mutex>, so it cannot be included in code compiled with /clr.
+*/
+
+#ifndef PERSISTENCE_BATCH_H
+#define PERSISTENCE_BATCH_H
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "persistence1d.hpp"
+
+#ifndef P1D_CACHE_LINE
+#define P1D_CACHE_LINE 64
+#endif
+
+namespace p1d
+{
+
+/** Results of a batch run, stored flat: the pairs of all signals in one vector, signal after signal.
+	Reusing a TBatchResults between runs reuses its memory.
+*/
+struct TBatchResults
+{
+	///Paired extrema of all signals. The pairs of each signal are sorted according to persistence,
+	///like GetPairedExtrema returns them. Indices are relative to the first vertex of the signal.
+	std::vector<TPairedExtrema> Pairs;
+
+	///The pairs of signal i are Pairs[PairOffsets[i]] up to, not including, Pairs[PairOffsets[i+1]].
+	///Holds one entry more than there are signals.
+	std::vector<size_t> PairOffsets;
+
+	///Index of the global minimum of each signal, relative to its first vertex. -1 for empty signals.
+	std::vector<int> GlobalMinimumIndices;
+};
+
+
+/*! Finds paired extrema of many independent signals, using a pool of worker threads.
+
+	Signals are given as one flat buffer and signal offsets: signal i consists of the vertices
+	data[signalOffsets[i]] up to, not including, data[signalOffsets[i+1]].
+
+	Threads are started once, when the object is created, and wait for work between runs.
+	Each thread owns a Persistence1D workspace, so repeated runs do not allocate once warmed up.
+	Signals are handed out to threads in small chunks, so uneven signal lengths balance out.
+	The workspaces and the shared chunk counter are padded to separate cache lines, so threads
+	do not invalidate each other's lines while they work.
+*/
+class BatchPersistence1D
+{
+public:
+	/*!
+		@param[in] threadCount	Number of threads, including the calling thread.
+								0 uses one thread per hardware thread.
+	*/
+	explicit BatchPersistence1D(const unsigned int threadCount = 0):
+		JobData(0),JobOffsets(0),JobCount(0),JobChunk(1),Generation(0),Pending(0),Stopping(false)
+	{
+		unsigned int count = threadCount;
+		if (count == 0) count = std::thread::hardware_concurrency();
+		if (count == 0) count = 1;
+
+		NextSignal = 0;
+		Workers.resize(count);
+
+		//the calling thread works as worker 0
+		for (unsigned int i = 1; i < count; i++)
+		{
+			Threads.push_back(std::thread(&BatchPersistence1D::WorkerLoop, this, i));
+		}
+	}
+
+	~BatchPersistence1D()
+	{
+		{
+			std::lock_guard<std::mutex> lock(Mutex);
+			Stopping = true;
+		}
+		WorkReady.notify_all();
+
+		for (std::vector<std::thread>::iterator t = Threads.begin(); t != Threads.end(); t++)
+		{
+			(*t).join();
+		}
+	}
+
+	/*!
+		Runs persistence on every signal and stores the results in results, overwriting its content.
+		Blocks until all signals are done. Returns false if there are no signals.
+
+		@param[in]	data			Flat buffer holding all signals.
+		@param[in]	signalOffsets	signalCount+1 offsets into data, see class description.
+		@param[in]	signalCount		Number of signals.
+		@param[out]	results			Paired extrema and global minima of all signals, see TBatchResults.
+		@param[in]	options			Processing options used for every signal, see TRunOptions.
+	*/
+	bool RunPersistence(const double* data, const size_t* signalOffsets, const size_t signalCount,
+						TBatchResults& results, const TRunOptions& options = TRunOptions())
+	{
+		results.Pairs.clear();
+		results.PairOffsets.assign(1, 0);
+		results.GlobalMinimumIndices.clear();
+
+		if (signalCount == 0) return false;
+
+		JobData = data;
+		JobOffsets = signalOffsets;
+		JobCount = signalCount;
+		JobOptions = options;
+		JobChunk = std::max<size_t>(1, signalCount / (Workers.size() * 16));
+		NextSignal = 0;
+
+		for (std::vector<TWorker>::iterator w = Workers.begin(); w != Workers.end(); w++)
+		{
+			(*w).Pairs.clear();
+			(*w).Signals.clear();
+		}
+
+		{
+			std::lock_guard<std::mutex> lock(Mutex);
+			Pending = (unsigned int)Threads.size();
+			Generation++;
+		}
+		WorkReady.notify_all();
+
+		ProcessSignals(Workers[0]);
+
+		{
+			std::unique_lock<std::mutex> lock(Mutex);
+			while (Pending != 0) WorkDone.wait(lock);
+		}
+
+		GatherResults(results);
+		return true;
+	}
+
+	/*!
+		Same as above, for signals stored in a vector.
+
+		@param[in]	data			Flat vector holding all signals.
+		@param[in]	signalOffsets	Offsets into data, one more than there are signals.
+		@param[out]	results			Paired extrema and global minima of all signals, see TBatchResults.
+		@param[in]	options			Processing options used for every signal, see TRunOptions.
+	*/
+	bool RunPersistence(const std::vector<double>& data, const std::vector<size_t>& signalOffsets,
+						TBatchResults& results, const TRunOptions& options = TRunOptions())
+	{
+		if (signalOffsets.size() < 2)
+		{
+			return RunPersistence(data.empty() ? 0 : &data[0], 0, 0, results, options);
+		}
+		return RunPersistence(data.empty() ? 0 : &data[0], &signalOffsets[0], signalOffsets.size() - 1, results, options);
+	}
+
+	/*!
+		Returns the number of threads used, including the calling thread.
+	*/
+	unsigned int GetThreadCount() const
+	{
+		return (unsigned int)Workers.size();
+	}
+
+protected:
+	/** Results of one signal, stored in a worker's Pairs vector. */
+	struct TSignalResult
+	{
+		size_t Signal;
+		size_t FirstPair;
+		size_t PairCount;
+		int GlobalMinimumIndex;
+	};
+
+	/** Per-thread workspace and results. */
+	struct TWorker
+	{
+		//keeps the members of neighbouring workers in Workers off each other's cache lines
+		char Padding[P1D_CACHE_LINE];
+
+		Persistence1D Workspace;
+		std::vector<TPairedExtrema> Scratch;
+		std::vector<TPairedExtrema> Pairs;
+		std::vector<TSignalResult> Signals;
+	};
+
+	/*!
+		Takes chunks of signals until none are left, and runs persistence on them.
+	*/
+	void ProcessSignals(TWorker& worker)
+	{
+		for (;;)
+		{
+			size_t first = NextSignal.fetch_add(JobChunk);
+			if (first >= JobCount) return;
+			size_t last = std::min(first + JobChunk, JobCount);
+
+			for (size_t signal = first; signal != last; signal++)
+			{
+				TSignalResult result;
+				result.Signal = signal;
+				result.FirstPair = worker.Pairs.size();
+				result.PairCount = 0;
+				result.GlobalMinimumIndex = -1;
+
+				const size_t begin = JobOffsets[signal];
+				const int length = (int)(JobOffsets[signal + 1] - begin);
+
+				if (worker.Workspace.RunPersistence(JobData + begin, length, 1, JobOptions))
+				{
+					worker.Workspace.GetPairedExtrema(worker.Scratch, JobOptions.Threshold);
+					worker.Pairs.insert(worker.Pairs.end(), worker.Scratch.begin(), worker.Scratch.end());
+					result.PairCount = worker.Scratch.size();
+					result.GlobalMinimumIndex = worker.Workspace.GetGlobalMinimumIndex();
+				}
+				worker.Signals.push_back(result);
+			}
+		}
+	}
+
+	/*!
+		Thread function of workers 1..n-1. Waits for a new generation of work, processes it and reports back.
+	*/
+	void WorkerLoop(const unsigned int workerIdx)
+	{
+		unsigned int doneGeneration = 0;
+		for (;;)
+		{
+			{
+				std::unique_lock<std::mutex> lock(Mutex);
+				while (!Stopping && Generation == doneGeneration) WorkReady.wait(lock);
+				if (Stopping) return;
+				doneGeneration = Generation;
+			}
+
+			ProcessSignals(Workers[workerIdx]);
+
+			{
+				std::lock_guard<std::mutex> lock(Mutex);
+				Pending--;
+			}
+			WorkDone.notify_one();
+		}
+	}
+
+	/*!
+		Computes the pair offsets of all signals and copies the workers' pairs into results.
+	*/
+	void GatherResults(TBatchResults& results) const
+	{
+		results.PairOffsets.assign(JobCount + 1, 0);
+		results.GlobalMinimumIndices.resize(JobCount);
+
+		for (std::vector<TWorker>::const_iterator w = Workers.begin(); w != Workers.end(); w++)
+		{
+			for (std::vector<TSignalResult>::const_iterator r = (*w).Signals.begin(); r != (*w).Signals.end(); r++)
+			{
+				results.PairOffsets[(*r).Signal + 1] = (*r).PairCount;
+				results.GlobalMinimumIndices[(*r).Signal] = (*r).GlobalMinimumIndex;
+			}
+		}
+
+		for (size_t i = 0; i != JobCount; i++)
+		{
+			results.PairOffsets[i + 1] += results.PairOffsets[i];
+		}
+
+		results.Pairs.resize(results.PairOffsets.back());
+
+		for (std::vector<TWorker>::const_iterator w = Workers.begin(); w != Workers.end(); w++)
+		{
+			for (std::vector<TSignalResult>::const_iterator r = (*w).Signals.begin(); r != (*w).Signals.end(); r++)
+			{
+				std::copy((*w).Pairs.begin() + (*r).FirstPair,
+						  (*w).Pairs.begin() + (*r).FirstPair + (*r).PairCount,
+						  results.Pairs.begin() + results.PairOffsets[(*r).Signal]);
+			}
+		}
+	}
+
+	std::vector<TWorker> Workers;
+	std::vector<std::thread> Threads;
+
+	//the current job, set by RunPersistence before the workers are woken up
+	const double* JobData;
+	const size_t* JobOffsets;
+	size_t JobCount;
+	size_t JobChunk;
+	TRunOptions JobOptions;
+
+	//taken by every thread for every chunk, on its own cache line so the job fields above stay shared
+	char NextSignalPadding[P1D_CACHE_LINE];
+	std::atomic<size_t> NextSignal;
+	char EndPadding[P1D_CACHE_LINE];
+
+	std::mutex Mutex;
+	std::condition_variable WorkReady;	//signaled when Generation changes or Stopping is set
+	std::condition_variable WorkDone;	//signaled when a worker finished its part of a generation
+	unsigned int Generation;			//incremented for every run
+	unsigned int Pending;				//number of threads still working on the current generation
+	bool Stopping;
+
+private:
+	//threads refer to this object, so it cannot be copied
+	BatchPersistence1D(const BatchPersistence1D&);
+	BatchPersistence1D& operator=(const BatchPersistence1D&);
+};
+}
+#endif
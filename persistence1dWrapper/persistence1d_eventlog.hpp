@@ -0,0 +1,410 @@
+/*! \file persistence1d_eventlog.hpp
+    Binary columnar log of raw mouse events, and its writer.
+
+	A log file holds the events of one device: a file header, followed by blocks of 1 to
+	TEventLogWriter::BLOCK_EVENTS events. Blocks are not all full: the writer also ends a block after
+	a time span of events, and at the end of each session. Within a block the events are stored 
+	column by column, so the column of one block can be read as one array, see persistence1d_eventlog_reader.hpp.
+	All values are stored in the byte order of the machine that wrote them, which is little endian on Windows.
+
+	File layout:
+		TEventLogHeader
+		block: TEventBlockHeader, then the columns in the order of TEventColumn, each padded to 8 bytes
+		block: ...
+
+	A crash while writing can leave a block cut off at the end of the file. Readers stop at such a block,
+	and TEventLogWriter::Open cuts it off before appending, so later sessions stay readable.
+
+	Only uses stdio and the C runtime's file truncation, so it can be included in code compiled with /clr.
+*/
+
+#ifndef PERSISTENCE_EVENTLOG_H
+#define PERSISTENCE_EVENTLOG_H
+
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <sys/types.h>
+#include <unistd.h>
+#endif
+
+#define P1D_EVENTLOG_MAGIC "P1DEVLG"
+#define P1D_EVENTLOG_VERSION 1
+#define P1D_EVENTBLOCK_MAGIC 0x4B425645u	//"EVBK"
+#define P1D_EVENTLOG_SOURCE_LENGTH 48
+
+namespace p1d
+{
+
+/** A raw mouse event, as fed to AutoGain. */
+struct TMouseEvent
+{
+	///Time of the event in microseconds.
+	long long Timestamp;
+
+	///Movement after the transfer function, in pixels.
+	double SystemDX;
+	double SystemDY;
+
+	///Time since the previous event in milliseconds.
+	double Timespan;
+
+	///Movement reported by the device, in counts.
+	int DeviceDX;
+	int DeviceDY;
+
+	///usButtonFlags of the RAWMOUSE structure.
+	unsigned short ButtonFlags;
+};
+
+
+/** Columns of an event block, in the order they are stored. */
+enum TEventColumn
+{
+	EVENT_TIMESTAMP = 0,	///< long long
+	EVENT_SYSTEM_DX,		///< double
+	EVENT_SYSTEM_DY,		///< double
+	EVENT_TIMESPAN,			///< double
+	EVENT_DEVICE_DX,		///< int
+	EVENT_DEVICE_DY,		///< int
+	EVENT_BUTTON_FLAGS,		///< unsigned short
+	EVENT_COLUMN_COUNT
+};
+
+
+/** Header at the start of a log file. 64 bytes. */
+struct TEventLogHeader
+{
+	///P1D_EVENTLOG_MAGIC, zero terminated.
+	char Magic[8];
+
+	///P1D_EVENTLOG_VERSION.
+	unsigned int Version;
+
+	///sizeof(TEventLogHeader); the first block starts at this offset.
+	unsigned int HeaderSize;
+
+	///Device the events came from, zero terminated. Format: VID_PID.
+	char Source[P1D_EVENTLOG_SOURCE_LENGTH];
+};
+
+
+/** Header at the start of each block. 16 bytes. */
+struct TEventBlockHeader
+{
+	///P1D_EVENTBLOCK_MAGIC.
+	unsigned int Magic;
+
+	///Number of events in the block.
+	unsigned int Count;
+
+	///Size of the block including this header; the next block starts this many bytes after it.
+	unsigned long long BlockBytes;
+};
+
+
+/*!
+	Computes the offsets of the columns of a block of count events, relative to the start of the block.
+	Returns the size of the block in bytes.
+
+	@param[in]	count	Number of events in the block.
+	@param[out]	offsets	Offset of each column, indexed by TEventColumn.
+*/
+inline unsigned long long GetEventBlockLayout(const unsigned int count, unsigned long long offsets[EVENT_COLUMN_COUNT])
+{
+	static const unsigned int columnSizes[EVENT_COLUMN_COUNT] =
+	{
+		sizeof(long long), sizeof(double), sizeof(double), sizeof(double),
+		sizeof(int), sizeof(int), sizeof(unsigned short)
+	};
+
+	unsigned long long offset = sizeof(TEventBlockHeader);
+	for (int column = 0; column != EVENT_COLUMN_COUNT; column++)
+	{
+		offsets[column] = offset;
+		offset += ((unsigned long long)count * columnSizes[column] + 7) & ~7ull;
+	}
+	return offset;
+}
+
+
+/*!
+	Returns true if a block header describes a complete block.
+
+	@param[in] header		Header of the block.
+	@param[in] available	Bytes from the start of the block to the end of the file.
+*/
+inline bool IsEventBlockValid(const TEventBlockHeader& header, const unsigned long long available)
+{
+	unsigned long long offsets[EVENT_COLUMN_COUNT];
+	return header.Magic == P1D_EVENTBLOCK_MAGIC && header.Count <= 0x7fffffffu &&
+		   header.BlockBytes == GetEventBlockLayout(header.Count, offsets) && header.BlockBytes <= available;
+}
+
+
+/*! Writes mouse events to a log file.
+
+	Events are collected column by column and written as a block once the block holds MaxBlockEvents events,
+	once its events span FlushInterval microseconds of Timestamp, or when Flush or Close is called. 
+	A crash therefore loses at most the events of the block being collected; by default a second of events.
+	The span is measured on the events' timestamps, so events collected before the mouse stops are only written 
+	by the next event or by Flush; call Flush when the input goes idle to bound the loss in wall time as well.
+*/
+class TEventLogWriter
+{
+public:
+	///Events per full block.
+	enum { BLOCK_EVENTS = 4096 };
+
+	///Default of FlushInterval: one second.
+	enum { FLUSH_INTERVAL = 1000000 };
+
+	TEventLogWriter():File(0),MaxBlockEvents(BLOCK_EVENTS),FlushInterval(FLUSH_INTERVAL),Count(0),Failed(false)
+	{
+	}
+
+	~TEventLogWriter()
+	{
+		Close();
+	}
+
+	/*!
+		Opens a log file for appending, and writes the file header if the file is new.
+		An incomplete block at the end of an existing file is cut off, see IsEventBlockValid.
+		Returns false if the file cannot be opened, or is not empty and not a log file.
+
+		@param[in] fileName	Name of the log file.
+		@param[in] source	Device the events come from. Truncated to P1D_EVENTLOG_SOURCE_LENGTH-1 characters.
+	*/
+	bool Open(const char* fileName, const char* source)
+	{
+		Close();
+		Count = 0;
+		Failed = false;
+
+		//create the file without truncating it, then reopen it to find the end of its last complete block
+		FILE* created = fopen(fileName, "ab");
+		if (created == 0) return false;
+		fclose(created);
+
+		File = fopen(fileName, "r+b");
+		if (File == 0) return false;
+
+		const unsigned long long size = (Seek(0, SEEK_END) == 0) ? Tell() : 0;
+		if (size != 0)
+		{
+			//a file that is not empty must start with a log header
+			TEventLogHeader header;
+			const unsigned long long end = (Seek(0, SEEK_SET) == 0 && fread(&header, sizeof(header), 1, File) == 1 &&
+											memcmp(header.Magic, P1D_EVENTLOG_MAGIC, sizeof(header.Magic)) == 0 &&
+											header.Version == P1D_EVENTLOG_VERSION &&
+											header.HeaderSize >= sizeof(header) && header.HeaderSize <= size)
+											? FindBlocksEnd(header.HeaderSize, size) : 0;
+			if (end == 0)
+			{
+				fclose(File);
+				File = 0;
+				return false;
+			}
+
+			if ((end < size && !Truncate(end)) || Seek(end, SEEK_SET) != 0) Failed = true;
+		}
+		else
+		{
+			TEventLogHeader header;
+			memset(&header, 0, sizeof(header));
+			memcpy(header.Magic, P1D_EVENTLOG_MAGIC, sizeof(header.Magic));
+			header.Version = P1D_EVENTLOG_VERSION;
+			header.HeaderSize = sizeof(header);
+			if (source != 0) strncpy(header.Source, source, P1D_EVENTLOG_SOURCE_LENGTH - 1);
+
+			if (fwrite(&header, sizeof(header), 1, File) != 1) Failed = true;
+		}
+
+		Timestamps.reserve(BLOCK_EVENTS);
+		SystemDX.reserve(BLOCK_EVENTS);
+		SystemDY.reserve(BLOCK_EVENTS);
+		Timespans.reserve(BLOCK_EVENTS);
+		DeviceDX.reserve(BLOCK_EVENTS);
+		DeviceDY.reserve(BLOCK_EVENTS);
+		ButtonFlags.reserve(BLOCK_EVENTS);
+		return !Failed;
+	}
+
+	/*!
+		Writes the collected events and closes the file. Returns false if any write failed.
+	*/
+	bool Close()
+	{
+		if (File == 0) return !Failed;
+
+		Flush();
+		if (fclose(File) != 0) Failed = true;
+		File = 0;
+		return !Failed;
+	}
+
+	/*!
+		Adds an event to the log. Ignored if no file is open.
+	*/
+	void Write(const TMouseEvent& event)
+	{
+		if (File == 0) return;
+
+		Timestamps.push_back(event.Timestamp);
+		SystemDX.push_back(event.SystemDX);
+		SystemDY.push_back(event.SystemDY);
+		Timespans.push_back(event.Timespan);
+		DeviceDX.push_back(event.DeviceDX);
+		DeviceDY.push_back(event.DeviceDY);
+		ButtonFlags.push_back(event.ButtonFlags);
+		Count++;
+
+		if (Timestamps.size() >= MaxBlockEvents || event.Timestamp - Timestamps.front() >= FlushInterval) Flush();
+	}
+
+	/*!
+		Sets when a block is written without waiting for Flush. Applies from the next event on.
+
+		@param[in] maxEvents		Events per block, at most BLOCK_EVENTS; 1 writes every event.
+		@param[in] maxMicroseconds	Timestamp span after which a block is written; 0 writes every event.
+	*/
+	void SetFlushBounds(const unsigned int maxEvents, const long long maxMicroseconds)
+	{
+		MaxBlockEvents = (maxEvents == 0) ? 1 : (maxEvents > BLOCK_EVENTS) ? BLOCK_EVENTS : maxEvents;
+		FlushInterval = (maxMicroseconds < 0) ? 0 : maxMicroseconds;
+	}
+
+	/*!
+		Writes the collected events as a block, and flushes the file. Returns false if any write failed.
+	*/
+	bool Flush()
+	{
+		if (File == 0) return !Failed;
+		if (Timestamps.empty()) return !Failed;
+
+		unsigned long long offsets[EVENT_COLUMN_COUNT];
+		const unsigned int count = (unsigned int)Timestamps.size();
+
+		TEventBlockHeader header;
+		header.Magic = P1D_EVENTBLOCK_MAGIC;
+		header.Count = count;
+		header.BlockBytes = GetEventBlockLayout(count, offsets);
+
+		WriteBytes(&header, sizeof(header));
+		WriteColumn(Timestamps);
+		WriteColumn(SystemDX);
+		WriteColumn(SystemDY);
+		WriteColumn(Timespans);
+		WriteColumn(DeviceDX);
+		WriteColumn(DeviceDY);
+		WriteColumn(ButtonFlags);
+		if (fflush(File) != 0) Failed = true;
+
+		Timestamps.clear();
+		SystemDX.clear();
+		SystemDY.clear();
+		Timespans.clear();
+		DeviceDX.clear();
+		DeviceDY.clear();
+		ButtonFlags.clear();
+		return !Failed;
+	}
+
+	/*!
+		Returns the number of events written since Open, including the ones not flushed yet.
+	*/
+	unsigned long long GetCount() const
+	{
+		return Count;
+	}
+
+protected:
+	/*!
+		Writes a column, padded to a multiple of 8 bytes.
+	*/
+	template <typename T>
+	void WriteColumn(const std::vector<T>& column)
+	{
+		static const char padding[8] = {0};
+		const size_t bytes = column.size() * sizeof(T);
+
+		WriteBytes(&column[0], bytes);
+		if (bytes % 8 != 0) WriteBytes(padding, 8 - bytes % 8);
+	}
+
+	void WriteBytes(const void* bytes, const size_t length)
+	{
+		if (fwrite(bytes, 1, length, File) != length) Failed = true;
+	}
+
+	/*!
+		Returns the offset just after the last complete block, walking the block headers from the first block.
+
+		@param[in] offset	Offset of the first block.
+		@param[in] size		Size of the file.
+	*/
+	unsigned long long FindBlocksEnd(unsigned long long offset, const unsigned long long size)
+	{
+		TEventBlockHeader header;
+		while (size - offset >= sizeof(header) && Seek(offset, SEEK_SET) == 0 && fread(&header, sizeof(header), 1, File) == 1 &&
+			   IsEventBlockValid(header, size - offset))
+		{
+			offset += header.BlockBytes;
+		}
+		return offset;
+	}
+
+	//64-bit file positions, logs can grow past 2 GB
+	int Seek(const unsigned long long offset, const int origin)
+	{
+#ifdef _WIN32
+		return _fseeki64(File, (__int64)offset, origin);
+#else
+		return fseeko(File, (off_t)offset, origin);
+#endif
+	}
+
+	unsigned long long Tell()
+	{
+#ifdef _WIN32
+		return (unsigned long long)_ftelli64(File);
+#else
+		return (unsigned long long)ftello(File);
+#endif
+	}
+
+	bool Truncate(const unsigned long long size)
+	{
+		if (fflush(File) != 0) return false;
+#ifdef _WIN32
+		return _chsize_s(_fileno(File), (__int64)size) == 0;
+#else
+		return ftruncate(fileno(File), (off_t)size) == 0;
+#endif
+	}
+
+	FILE* File;
+	size_t MaxBlockEvents;			//events after which a block is written, see SetFlushBounds
+	long long FlushInterval;		//timestamp span in microseconds after which a block is written
+	std::vector<long long> Timestamps;
+	std::vector<double> SystemDX;
+	std::vector<double> SystemDY;
+	std::vector<double> Timespans;
+	std::vector<int> DeviceDX;
+	std::vector<int> DeviceDY;
+	std::vector<unsigned short> ButtonFlags;
+	unsigned long long Count;
+	bool Failed;
+
+private:
+	//owns the file, so it cannot be copied
+	TEventLogWriter(const TEventLogWriter&);
+	TEventLogWriter& operator=(const TEventLogWriter&);
+};
+}
+#endif
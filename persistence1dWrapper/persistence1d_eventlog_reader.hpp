@@ -0,0 +1,198 @@
+/*! \file persistence1d_eventlog_reader.hpp
+    Zero-copy reader of the mouse event logs written by TEventLogWriter, see persistence1d_eventlog.hpp.
+
+	The log file is memory-mapped, and the columns of each block are returned as views into the mapping,
+	which can be passed to Persistence1D::RunPersistence or LargePersistence1D::AppendSamples directly.
+	A view covers one block only: blocks hold anything from 1 to TEventLogWriter::BLOCK_EVENTS events,
+	so analyses over a whole log either feed the blocks in order, for example to AppendSamples, 
+	or copy a column of all blocks into one array with TEventLogReader::GetColumn.
+	Uses persistence1d_mapped.hpp, so it cannot be included in code compiled with /clr.
+*/
+
+#ifndef PERSISTENCE_EVENTLOG_READER_H
+#define PERSISTENCE_EVENTLOG_READER_H
+
+#include <string.h>
+#include <vector>
+
+#include "persistence1d.hpp"
+#include "persistence1d_eventlog.hpp"
+#include "persistence1d_mapped.hpp"
+
+namespace p1d
+{
+
+/** The columns of one block of a log, as views into the mapped file. 
+	The views end at the end of the block; the next events are in the next block.
+*/
+struct TEventBlock
+{
+	///Number of events in the block.
+	int Count;
+
+	TBasicDataView<long long> Timestamps;
+	TBasicDataView<double> SystemDX;
+	TBasicDataView<double> SystemDY;
+	TBasicDataView<double> Timespans;
+	TBasicDataView<int> DeviceDX;
+	TBasicDataView<int> DeviceDY;
+	TBasicDataView<unsigned short> ButtonFlags;
+};
+
+
+/*! Reads a mouse event log through a memory mapping of the whole file.
+
+	Views returned by GetBlock point into the mapping and are valid until Close or the next Open.
+	A block cut off at the end of the file, as left by a crash while writing, ends the log.
+*/
+class TEventLogReader
+{
+public:
+	TEventLogReader():Bytes(0),EventCount(0)
+	{
+		memset(&Header, 0, sizeof(Header));
+	}
+
+	/*!
+		Maps a log file and locates its blocks. Returns false if the file cannot be mapped or is not a log file.
+
+		@param[in] fileName	Name of the log file.
+	*/
+	bool Open(const char* fileName)
+	{
+		Close();
+		if (!File.Open(fileName)) return false;
+
+		const unsigned long long size = File.GetSize();
+		if (size < sizeof(TEventLogHeader) || size != (size_t)size)
+		{
+			Close();
+			return false;
+		}
+
+		Bytes = File.Map(0, (size_t)size);
+		if (Bytes == 0)
+		{
+			Close();
+			return false;
+		}
+
+		memcpy(&Header, Bytes, sizeof(Header));
+		if (memcmp(Header.Magic, P1D_EVENTLOG_MAGIC, sizeof(Header.Magic)) != 0 ||
+			Header.Version != P1D_EVENTLOG_VERSION || Header.HeaderSize < sizeof(Header) || Header.HeaderSize > size)
+		{
+			Close();
+			return false;
+		}
+		Header.Source[P1D_EVENTLOG_SOURCE_LENGTH - 1] = 0;
+
+		unsigned long long offset = Header.HeaderSize;
+		while (size - offset >= sizeof(TEventBlockHeader))
+		{
+			TEventBlockHeader blockHeader;
+			memcpy(&blockHeader, Bytes + offset, sizeof(blockHeader));
+
+			if (!IsEventBlockValid(blockHeader, size - offset)) break;
+
+			unsigned long long columnOffsets[EVENT_COLUMN_COUNT];
+			GetEventBlockLayout(blockHeader.Count, columnOffsets);
+
+			const char* block = Bytes + offset;
+			const int count = (int)blockHeader.Count;
+
+			TEventBlock columns;
+			columns.Count = count;
+			columns.Timestamps = TBasicDataView<long long>((const long long*)(block + columnOffsets[EVENT_TIMESTAMP]), count);
+			columns.SystemDX = TBasicDataView<double>((const double*)(block + columnOffsets[EVENT_SYSTEM_DX]), count);
+			columns.SystemDY = TBasicDataView<double>((const double*)(block + columnOffsets[EVENT_SYSTEM_DY]), count);
+			columns.Timespans = TBasicDataView<double>((const double*)(block + columnOffsets[EVENT_TIMESPAN]), count);
+			columns.DeviceDX = TBasicDataView<int>((const int*)(block + columnOffsets[EVENT_DEVICE_DX]), count);
+			columns.DeviceDY = TBasicDataView<int>((const int*)(block + columnOffsets[EVENT_DEVICE_DY]), count);
+			columns.ButtonFlags = TBasicDataView<unsigned short>((const unsigned short*)(block + columnOffsets[EVENT_BUTTON_FLAGS]), count);
+			Blocks.push_back(columns);
+
+			EventCount += blockHeader.Count;
+			offset += blockHeader.BlockBytes;
+		}
+		return true;
+	}
+
+	/*!
+		Releases the mapping. Views returned by GetBlock become invalid.
+	*/
+	void Close()
+	{
+		File.Close();
+		Bytes = 0;
+		EventCount = 0;
+		Blocks.clear();
+		memset(&Header, 0, sizeof(Header));
+	}
+
+	/*!
+		Returns the device the events came from, as given to TEventLogWriter::Open.
+	*/
+	const char* GetSource() const
+	{
+		return Header.Source;
+	}
+
+	/*!
+		Returns the number of complete blocks.
+	*/
+	size_t GetBlockCount() const
+	{
+		return Blocks.size();
+	}
+
+	/*!
+		Returns the columns of a block.
+
+		@param[in] block	Index of the block, less than GetBlockCount().
+	*/
+	const TEventBlock& GetBlock(const size_t block) const
+	{
+		return Blocks[block];
+	}
+
+	/*!
+		Copies a column of all complete blocks into one array, in the order of the log.
+		For example GetColumn(&TEventBlock::SystemDX, dx).
+
+		@param[in]	column	Column to copy.
+		@param[out]	values	Receives GetEventCount() values.
+	*/
+	template <typename T>
+	void GetColumn(TBasicDataView<T> TEventBlock::*column, std::vector<T>& values) const
+	{
+		values.clear();
+		values.reserve((size_t)EventCount);
+		for (size_t b = 0; b != Blocks.size(); b++)
+		{
+			const TBasicDataView<T>& view = Blocks[b].*column;
+			values.insert(values.end(), view.Ptr, view.Ptr + view.Size);
+		}
+	}
+
+	/*!
+		Returns the number of events in all complete blocks.
+	*/
+	unsigned long long GetEventCount() const
+	{
+		return EventCount;
+	}
+
+protected:
+	TMappedFile File;
+	const char* Bytes;				//start of the mapped file
+	TEventLogHeader Header;
+	std::vector<TEventBlock> Blocks;
+	unsigned long long EventCount;
+
+private:
+	//views refer to the mapping, so it cannot be copied
+	TEventLogReader(const TEventLogReader&);
+	TEventLogReader& operator=(const TEventLogReader&);
+};
+}
+#endif
@@ -0,0 +1,54 @@
+// Native part of the event queue. Compiled without /clr and without the precompiled header,
+// since <atomic> is not supported in managed code.
+
+#include "persistence1d_eventqueue.h"
+#include "persistence1d_ring.hpp"
+
+namespace p1d
+{
+	struct TEventQueue::TImpl
+	{
+		explicit TImpl(const size_t capacity):Ring(capacity),Dropped(0){}
+
+		TSpscRing<TMouseEvent> Ring;
+		std::atomic<unsigned long long> Dropped;
+	};
+
+	TEventQueue::TEventQueue(const size_t capacity)
+	{
+		Impl = new TImpl(capacity);
+	}
+
+	TEventQueue::~TEventQueue()
+	{
+		delete Impl;
+	}
+
+	bool TEventQueue::Push(const TMouseEvent& event)
+	{
+		if (Impl->Ring.Push(event)) return true;
+
+		Impl->Dropped.fetch_add(1, std::memory_order_relaxed);
+		return false;
+	}
+
+	bool TEventQueue::Pop(TMouseEvent& event)
+	{
+		return Impl->Ring.Pop(event);
+	}
+
+	size_t TEventQueue::Pop(TMouseEvent* events, const size_t maxCount)
+	{
+		return Impl->Ring.Pop(events, maxCount);
+	}
+
+	unsigned long long TEventQueue::GetDropped() const
+	{
+		return Impl->Dropped.load(std::memory_order_relaxed);
+	}
+
+	size_t TEventQueue::GetCapacity() const
+	{
+		return Impl->Ring.GetCapacity();
+	}
+}
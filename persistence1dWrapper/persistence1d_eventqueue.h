@@ -0,0 +1,65 @@
+/*! \file persistence1d_eventqueue.h
+    Queue of mouse events from the raw input thread to the analysis thread.
+
+	Wraps TSpscRing, see persistence1d_ring.hpp. The ring is only used in persistence1d_eventqueue.cpp,
+	which is compiled as native code, so this header can be included in code compiled with /clr.
+*/
+
+#ifndef PERSISTENCE_EVENTQUEUE_H
+#define PERSISTENCE_EVENTQUEUE_H
+
+#include <stddef.h>
+
+#include "persistence1d_eventlog.hpp"
+
+namespace p1d
+{
+
+/*! A lock-free queue of TMouseEvent for one producer thread and one consumer thread.
+
+	Push never waits; if the consumer falls behind and the queue is full, the event is dropped and counted.
+	Click markers are events whose ButtonFlags contain a button down flag.
+*/
+class TEventQueue
+{
+public:
+	/*!
+		@param[in] capacity	Minimum number of events the queue holds. Rounded up to a power of two.
+	*/
+	explicit TEventQueue(const size_t capacity);
+	~TEventQueue();
+
+	/*!
+		Adds an event. Returns false if the queue is full and the event was dropped. Producer thread only.
+	*/
+	bool Push(const TMouseEvent& event);
+
+	/*!
+		Removes the oldest event. Returns false if the queue is empty. Consumer thread only.
+	*/
+	bool Pop(TMouseEvent& event);
+
+	/*!
+		Removes up to maxCount of the oldest events. Returns the number of events removed. Consumer thread only.
+	*/
+	size_t Pop(TMouseEvent* events, const size_t maxCount);
+
+	/*!
+		Returns the number of events dropped because the queue was full.
+	*/
+	unsigned long long GetDropped() const;
+
+	/*!
+		Returns the number of events the queue holds.
+	*/
+	size_t GetCapacity() const;
+
+private:
+	struct TImpl;
+	TImpl* Impl;
+
+	TEventQueue(const TEventQueue&);
+	TEventQueue& operator=(const TEventQueue&);
+};
+}
+#endif
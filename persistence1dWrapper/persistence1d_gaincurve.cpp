@@ -0,0 +1,205 @@
+// Native part of the gain curve. Compiled without /clr and without the precompiled header,
+// since <atomic> and <mutex> are not supported in managed code.
+
+#include <math.h>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "persistence1d_gaincurve.h"
+
+#ifndef P1D_CACHE_LINE
+#define P1D_CACHE_LINE 64
+#endif
+
+namespace p1d
+{
+	/** An immutable snapshot of the curve. */
+	struct TCurveSnapshot
+	{
+		std::vector<double> Values;
+		TTransferParams Params;
+		TTransferTableType TableType;
+		TTransferTable Table;
+		unsigned long long Version;
+	};
+
+	/** Readers counted in on one slot, on its own cache line. */
+	struct TReaderSlot
+	{
+		TReaderSlot():Readers(0){}
+
+		std::atomic<unsigned int> Readers;
+		char Padding[P1D_CACHE_LINE];
+	};
+
+	struct TGainCurve::TImpl
+	{
+		TImpl():Current(0),Epoch(0){}
+
+		/*!
+			Counts a reader in on the slot of the current epoch, and returns the slot for Leave.
+			Retries if a publish switched the slot in between, so the slot it counted in on
+			is the one a later publish waits for.
+		*/
+		unsigned int Enter()
+		{
+			for (;;)
+			{
+				const unsigned int epoch = Epoch.load();
+				Slots[epoch & 1].Readers.fetch_add(1);
+				if (Epoch.load() == epoch) return epoch & 1;
+				Slots[epoch & 1].Readers.fetch_sub(1);
+			}
+		}
+
+		void Leave(const unsigned int slot)
+		{
+			Slots[slot].Readers.fetch_sub(1);
+		}
+
+		std::atomic<const TCurveSnapshot*> Current;
+		std::atomic<unsigned int> Epoch;		//the low bit selects the slot new readers count in on
+		char EpochPadding[P1D_CACHE_LINE];
+		TReaderSlot Slots[2];
+		std::mutex WriteMutex;
+	};
+
+	/*!
+		Same as AutoGain.getInterpolatedValue.
+	*/
+	static double Interpolate(const std::vector<double>& values, const double index)
+	{
+		if (values.empty()) return 0;
+
+		//minimum value (for out of index), also for NaN
+		if (!(index >= 0)) return values.front();
+		//maximum value (for out of index)
+		if (index > (double)(values.size() - 1)) return values.back();
+
+		const double lower = floor(index);
+		const double upper = ceil(index);
+		const double y0 = values[(size_t)lower];
+		const double y1 = values[(size_t)upper];
+
+		if (upper - lower == 0) return (y0 + y1) / 2;
+
+		const double ratio = (index - lower) / (upper - lower);
+		return (y1 - y0) * ratio + y0;
+	}
+
+	/*!
+		Builds and publishes a new snapshot, then frees the replaced one. The caller holds WriteMutex.
+	*/
+	void TGainCurve::PublishLocked(const double* values, const size_t count, const TTransferParams& params,
+								   const TTransferTableType type)
+	{
+		TCurveSnapshot* curve = new TCurveSnapshot();
+		curve->Values.assign(values, values + count);
+		curve->Params = params;
+		curve->TableType = type;
+		curve->Table.Compile(values, count, params, type);
+
+		const TCurveSnapshot* previous = Impl->Current.load();
+		curve->Version = previous ? previous->Version + 1 : 1;
+		Impl->Current.exchange(curve);
+
+		//a reader that still uses the previous curve counted itself in on the old slot before the swap.
+		//Readers that count in after the switch use the other slot and see the new curve, so the wait
+		//only covers the reads in flight at the switch, however many readers keep coming.
+		const unsigned int old = Impl->Epoch.fetch_add(1) & 1;
+		while (Impl->Slots[old].Readers.load() != 0)
+		{
+			std::this_thread::yield();
+		}
+		delete previous;
+	}
+
+	TGainCurve::TGainCurve()
+	{
+		Impl = new TImpl();
+	}
+
+	TGainCurve::~TGainCurve()
+	{
+		delete Impl->Current.load();
+		delete Impl;
+	}
+
+	void TGainCurve::Publish(const double* values, const size_t count)
+	{
+		std::lock_guard<std::mutex> lock(Impl->WriteMutex);
+
+		const TCurveSnapshot* previous = Impl->Current.load();
+		PublishLocked(values, count, previous ? previous->Params : TTransferParams(),
+					  previous ? previous->TableType : TRANSFER_DOUBLE);
+	}
+
+	void TGainCurve::Publish(const double* values, const size_t count, const TTransferParams& params, const TTransferTableType type)
+	{
+		std::lock_guard<std::mutex> lock(Impl->WriteMutex);
+		PublishLocked(values, count, params, type);
+	}
+
+	double TGainCurve::Evaluate(const double index) const
+	{
+		const unsigned int slot = Impl->Enter();
+		const TCurveSnapshot* curve = Impl->Current.load();
+		const double gain = curve ? Interpolate(curve->Values, index) : 0;
+		Impl->Leave(slot);
+		return gain;
+	}
+
+	double TGainCurve::Translate(const double dx, const double dy, const double timespan, double& tx, double& ty) const
+	{
+		const unsigned int slot = Impl->Enter();
+		const TCurveSnapshot* curve = Impl->Current.load();
+		double speed = 0;
+		if (curve)
+		{
+			speed = curve->Table.Translate(dx, dy, timespan, tx, ty);
+		}
+		else
+		{
+			tx = 0;
+			ty = 0;
+		}
+		Impl->Leave(slot);
+		return speed;
+	}
+
+	void TGainCurve::TranslateBatch(const double* dx, const double* dy, const double* timespan, const size_t count,
+									double* tx, double* ty) const
+	{
+		const unsigned int slot = Impl->Enter();
+		const TCurveSnapshot* curve = Impl->Current.load();
+		if (curve)
+		{
+			curve->Table.TranslateBatch(dx, dy, timespan, count, tx, ty);
+		}
+		else
+		{
+			for (size_t i = 0; i != count; i++) tx[i] = ty[i] = 0;
+		}
+		Impl->Leave(slot);
+	}
+
+	size_t TGainCurve::Size() const
+	{
+		const unsigned int slot = Impl->Enter();
+		const TCurveSnapshot* curve = Impl->Current.load();
+		const size_t size = curve ? curve->Values.size() : 0;
+		Impl->Leave(slot);
+		return size;
+	}
+
+	unsigned long long TGainCurve::GetVersion() const
+	{
+		const unsigned int slot = Impl->Enter();
+		const TCurveSnapshot* curve = Impl->Current.load();
+		const unsigned long long version = curve ? curve->Version : 0;
+		Impl->Leave(slot);
+		return version;
+	}
+}
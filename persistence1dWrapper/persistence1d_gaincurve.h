@@ -0,0 +1,95 @@
+/*! \file persistence1d_gaincurve.h
+    Gain curve shared between the thread that learns it and the threads that translate mouse events with it.
+
+	The curve is published as an immutable snapshot, together with its transfer table (see persistence1d_transfer.hpp).
+	The implementation uses <atomic> and <mutex> and lives in persistence1d_gaincurve.cpp, which is compiled as native code,
+	so this header can be included in code compiled with /clr.
+*/
+
+#ifndef PERSISTENCE_GAINCURVE_H
+#define PERSISTENCE_GAINCURVE_H
+
+#include <stddef.h>
+
+#include "persistence1d_transfer.hpp"
+
+namespace p1d
+{
+
+/*! A gain curve with RCU-style publication: one gain value per speed bin.
+
+	Writers build a new curve and publish it with one atomic pointer swap. Readers never lock or wait:
+	a reader counts itself in on one of two slots, reads the current snapshot and counts itself out.
+	After the swap, a writer switches new readers to the other slot and waits only until the old slot
+	is empty before it frees the replaced snapshot, so a reader never sees a curve that is freed or half written,
+	and a steady stream of readers cannot hold a publish back. A reader only counts in again if a publish
+	switched slots while it counted in. Writers are serialized by a mutex.
+*/
+class TGainCurve
+{
+public:
+	TGainCurve();
+	~TGainCurve();
+
+	/*!
+		Replaces the curve with a copy of values. Waits for the reads in flight when it switches slots; never call it from a reader.
+
+		@param[in] values	Gain of each speed bin.
+		@param[in] count	Number of bins.
+	*/
+	void Publish(const double* values, const size_t count);
+
+	/*!
+		Replaces the curve with a copy of values, and compiles its transfer table with params.
+		The other overload keeps the parameters of the replaced curve.
+
+		@param[in] values	Gain of each speed bin.
+		@param[in] count	Number of bins.
+		@param[in] params	Bin size, counts per meter, CD gain and minimum timespan used by Translate.
+		@param[in] type		Storage of the transfer table.
+	*/
+	void Publish(const double* values, const size_t count, const TTransferParams& params,
+				 const TTransferTableType type = TRANSFER_DOUBLE);
+
+	/*!
+		Returns the gain at a fractional bin index, interpolated linearly between the neighboring bins.
+		Indices outside the curve return the first or last bin. Returns 0 while no curve is published.
+		Lock-free.
+
+		@param[in] index	Speed divided by the bin size.
+	*/
+	double Evaluate(const double index) const;
+
+	/*!
+		Translates one mouse event with the transfer table of the current curve, see TTransferTable::Translate.
+		Returns the speed of the event divided by the bin size. Lock-free.
+	*/
+	double Translate(const double dx, const double dy, const double timespan, double& tx, double& ty) const;
+
+	/*!
+		Translates count mouse events with the same curve, see TTransferTable::TranslateBatch. Lock-free.
+	*/
+	void TranslateBatch(const double* dx, const double* dy, const double* timespan, const size_t count,
+						double* tx, double* ty) const;
+
+	/*!
+		Returns the number of bins of the current curve.
+	*/
+	size_t Size() const;
+
+	/*!
+		Returns the number of curves published so far.
+	*/
+	unsigned long long GetVersion() const;
+
+private:
+	struct TImpl;
+	TImpl* Impl;
+
+	void PublishLocked(const double* values, const size_t count, const TTransferParams& params, const TTransferTableType type);
+
+	TGainCurve(const TGainCurve&);
+	TGainCurve& operator=(const TGainCurve&);
+};
+}
+#endif
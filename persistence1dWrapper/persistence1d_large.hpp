@@ -0,0 +1,417 @@
+/*! \file persistence1d_large.hpp
+    Out-of-core persistence for data that does not fit in memory, such as multi-day recordings.
+
+	Samples are streamed, for example from a memory-mapped file, and indexed with 64 bit integers.
+	Only the extrema that are not paired yet are kept in memory; resolved pairs are written to a file
+	as they are found. Uses persistence1d_mapped.hpp, so it cannot be included in code compiled with /clr.
+*/
+
+#ifndef PERSISTENCE_LARGE_H
+#define PERSISTENCE_LARGE_H
+
+#include <stdio.h>
+#include <algorithm>
+#include <vector>
+
+#include "persistence1d_mapped.hpp"
+
+namespace p1d
+{
+
+/** Same as TBasicIdxAndData, with a 64 bit index. */
+template <typename TValue>
+struct TBasicLargeIdxAndData
+{
+	TBasicLargeIdxAndData():Idx(-1),Data(0){}
+
+	bool operator<(const TBasicLargeIdxAndData& other) const
+	{
+		if (Data < other.Data) return true;
+		if (Data > other.Data) return false;
+		return (Idx < other.Idx);
+	}
+
+	///The index of the vertex within the stream of samples.
+	long long Idx;
+
+	///Vertex data value.
+	TValue Data;
+};
+
+
+/** Same as TBasicPairedExtrema, with 64 bit indices.
+	Pair files written by BasicLargePersistence1D are arrays of this struct, as stored in memory.
+*/
+template <typename TValue>
+struct TBasicLargePairedExtrema
+{
+	///Index of local minimum within the stream of samples.
+	long long MinIndex;
+
+	///Index of local maximum within the stream of samples.
+	long long MaxIndex;
+
+	///The persistence of the two extrema.
+	///Guaranteed to be >= 0.
+	TValue Persistence;
+
+	bool operator<(const TBasicLargePairedExtrema& other) const
+	{
+		if (Persistence < other.Persistence) return true;
+		if (Persistence > other.Persistence) return false;
+		return (MinIndex < other.MinIndex);
+	}
+};
+typedef TBasicLargePairedExtrema<double> TLargePairedExtrema;
+
+
+/*! Writes pairs to a binary file through a fixed size buffer.
+*/
+template <typename TValue>
+class TBasicPairFileWriter
+{
+public:
+	typedef TBasicLargePairedExtrema<TValue> TLargePairedExtrema;
+
+	///Number of pairs buffered before they are written.
+	enum { BUFFER_PAIRS = 4096 };
+
+	TBasicPairFileWriter():File(0),Count(0),Failed(false)
+	{
+	}
+
+	~TBasicPairFileWriter()
+	{
+		Close();
+	}
+
+	/*!
+		Creates or truncates the file. Returns false if it cannot be opened.
+
+		@param[in] fileName	Name of the pair file.
+	*/
+	bool Open(const char* fileName)
+	{
+		Close();
+		File = fopen(fileName, "wb");
+		Count = 0;
+		Failed = (File == 0);
+		Buffer.clear();
+		Buffer.reserve(BUFFER_PAIRS);
+		return !Failed;
+	}
+
+	/*!
+		Writes the buffered pairs and closes the file. Returns false if any write failed.
+	*/
+	bool Close()
+	{
+		if (File == 0) return !Failed;
+
+		Flush();
+		if (fclose(File) != 0) Failed = true;
+		File = 0;
+		return !Failed;
+	}
+
+	/*!
+		Adds a pair to the file.
+	*/
+	void Write(const TLargePairedExtrema& pair)
+	{
+		Buffer.push_back(pair);
+		Count++;
+		if (Buffer.size() == BUFFER_PAIRS) Flush();
+	}
+
+	/*!
+		Returns the number of pairs written since Open.
+	*/
+	unsigned long long GetCount() const
+	{
+		return Count;
+	}
+
+protected:
+	/*!
+		Writes the buffered pairs to the file.
+	*/
+	void Flush()
+	{
+		if (Buffer.empty()) return;
+		if (fwrite(&Buffer[0], sizeof(TLargePairedExtrema), Buffer.size(), File) != Buffer.size()) Failed = true;
+		Buffer.clear();
+	}
+
+	FILE* File;
+	std::vector<TLargePairedExtrema> Buffer;
+	unsigned long long Count;
+	bool Failed;
+
+private:
+	//owns the file, so it cannot be copied
+	TBasicPairFileWriter(const TBasicPairFileWriter&);
+	TBasicPairFileWriter& operator=(const TBasicPairFileWriter&);
+};
+
+
+/*! Finds paired extrema of a stream of samples too large for memory, see Persistence1D for the results.
+
+	Uses the stack of open minima of Persistence1D::AppendSamples: a minimum is kept until a lower vertex
+	appears to its right, then it is paired with the lower of its two barriers and written to the pair file.
+	Working memory is proportional to the number of open extrema, at most the number of extrema,
+	and independent of the number of samples.
+
+	Pairs are written in the order they are resolved, not sorted by persistence. The global minimum is not
+	paired and not written; use GetGlobalMinimumIndex and GetGlobalMinimumValue.
+
+	Either call RunPersistence on a file of samples, or stream the samples with
+	BeginSamples, AppendSamples and EndSamples.
+*/
+template <typename TValue>
+class BasicLargePersistence1D
+{
+public:
+	typedef TBasicLargeIdxAndData<TValue> TLargeIdxAndData;
+	typedef TBasicLargePairedExtrema<TValue> TLargePairedExtrema;
+	typedef TBasicPairFileWriter<TValue> TPairFileWriter;
+
+	///Default size of the file views mapped by RunPersistence.
+	enum { DEFAULT_WINDOW_BYTES = 1 << 26 };
+
+	BasicLargePersistence1D():Threshold(0),Count(0),Descending(false),MaxOpenMinima(0)
+	{
+	}
+
+	/*!
+		Finds the paired extrema of a binary file of samples and writes them to a pair file.
+		The samples file holds the samples as an array of TValue, as stored in memory.
+		It is memory-mapped through views of windowBytes bytes, so it can be larger than the address space.
+
+		Returns false if a file cannot be opened, read or written, or if the samples file is empty.
+
+		@param[in] samplesFileName	Name of the samples file.
+		@param[in] pairsFileName	Name of the pair file, created or truncated.
+		@param[in] threshold		Pairs whose persistence is below threshold are not written.
+		@param[in] windowBytes		Size of the views of the samples file.
+	*/
+	bool RunPersistence(const char* samplesFileName, const char* pairsFileName,
+						const double threshold = 0, const size_t windowBytes = DEFAULT_WINDOW_BYTES)
+	{
+		TMappedFile samples;
+		if (!samples.Open(samplesFileName)) return false;
+		if (!BeginSamples(pairsFileName, threshold)) return false;
+
+		const unsigned long long sampleCount = samples.GetSize() / sizeof(TValue);
+		const size_t windowSamples = std::max<size_t>(1, windowBytes / sizeof(TValue));
+
+		for (unsigned long long first = 0; first < sampleCount; first += windowSamples)
+		{
+			const size_t length = (size_t)std::min<unsigned long long>(windowSamples, sampleCount - first);
+			const char* view = samples.Map(first * sizeof(TValue), length * sizeof(TValue));
+			if (view == 0)
+			{
+				Writer.Close();
+				return false;
+			}
+			AppendSamples((const TValue*)view, length);
+		}
+
+		return EndSamples();
+	}
+
+	/*!
+		Starts a new stream of samples. Returns false if the pair file cannot be opened.
+
+		@param[in] pairsFileName	Name of the pair file, created or truncated.
+		@param[in] threshold		Pairs whose persistence is below threshold are not written.
+	*/
+	bool BeginSamples(const char* pairsFileName, const double threshold = 0)
+	{
+		Threshold = threshold;
+		Count = 0;
+		Descending = false;
+		MaxOpenMinima = 0;
+		OpenMinima.clear();
+		OpenMaxima.clear();
+		GlobalMinimum = TLargeIdxAndData();
+
+		return Writer.Open(pairsFileName);
+	}
+
+	/*!
+		Appends samples to the stream. Pairs resolved by them are written to the pair file.
+
+		@param[in] samples	First sample to append.
+		@param[in] length	Number of samples.
+	*/
+	void AppendSamples(const TValue* samples, const size_t length)
+	{
+		for (size_t i = 0; i != length; i++)
+		{
+			TLargeIdxAndData vertex;
+			vertex.Idx = Count++;
+			vertex.Data = samples[i];
+
+			//left most vertex - a local minimum if its right neighbor is higher
+			if (vertex.Idx == 0)
+			{
+				Descending = true;
+			}
+			else if (Previous < vertex)
+			{
+				if (Descending)
+				{
+					CommitOpenMinimum(Previous);
+				}
+				RunMaximum = vertex;
+				Descending = false;
+			}
+			else
+			{
+				Descending = true;
+			}
+			Previous = vertex;
+		}
+	}
+
+	/*!
+		Ends the stream: writes the pairs of the minima that are still open and closes the pair file.
+		Returns false if the stream is empty or writing the pair file failed.
+	*/
+	bool EndSamples()
+	{
+		if (Count == 0)
+		{
+			Writer.Close();
+			return false;
+		}
+
+		//if the data ends in a descent, the last vertex is a local minimum as well
+		if (Descending)
+		{
+			CommitOpenMinimum(Previous);
+		}
+
+		//open minima have no lower vertex to their right, so each is paired with its left barrier
+		for (size_t j = OpenMinima.size() - 1; j > 0; j--)
+		{
+			WritePair(OpenMinima[j], OpenMaxima[j-1]);
+		}
+		GlobalMinimum = OpenMinima.front();
+
+		OpenMinima.clear();
+		OpenMaxima.clear();
+		return Writer.Close();
+	}
+
+	/*!
+		Returns the index of the global minimum of the last stream, -1 if there is none.
+	*/
+	long long GetGlobalMinimumIndex() const
+	{
+		return GlobalMinimum.Idx;
+	}
+
+	/*!
+		Returns the value of the global minimum of the last stream.
+	*/
+	TValue GetGlobalMinimumValue() const
+	{
+		return GlobalMinimum.Data;
+	}
+
+	/*!
+		Returns the number of samples streamed since BeginSamples.
+	*/
+	long long GetSampleCount() const
+	{
+		return Count;
+	}
+
+	/*!
+		Returns the number of pairs written since BeginSamples.
+	*/
+	unsigned long long GetPairCount() const
+	{
+		return Writer.GetCount();
+	}
+
+	/*!
+		Returns the largest number of open minima held at once since BeginSamples, a measure of the working memory.
+	*/
+	size_t GetMaxOpenMinima() const
+	{
+		return MaxOpenMinima;
+	}
+
+protected:
+	/*!
+		Pushes a local minimum to the open minima stack, same as Persistence1D::CommitOpenMinimum.
+		Pairs resolved by the new minimum are written to the pair file.
+	*/
+	void CommitOpenMinimum(const TLargeIdxAndData& minimum)
+	{
+		TLargeIdxAndData barrier = RunMaximum;
+
+		while (!OpenMinima.empty() && minimum < OpenMinima.back())
+		{
+			if (!OpenMaxima.empty() && OpenMaxima.back() < barrier) //left barrier is lower - merge to the left
+			{
+				WritePair(OpenMinima.back(), OpenMaxima.back());
+				OpenMinima.pop_back();
+				OpenMaxima.pop_back();
+			}
+			else //right barrier is lower, or there is nothing lower to the left
+			{
+				WritePair(OpenMinima.back(), barrier);
+				OpenMinima.pop_back();
+				if (!OpenMaxima.empty())
+				{
+					barrier = OpenMaxima.back();
+					OpenMaxima.pop_back();
+				}
+			}
+		}
+
+		if (!OpenMinima.empty())
+		{
+			OpenMaxima.push_back(barrier);
+		}
+		OpenMinima.push_back(minimum);
+		MaxOpenMinima = std::max(MaxOpenMinima, OpenMinima.size());
+	}
+
+	/*!
+		Writes a pair of a minimum and a maximum to the pair file, unless its persistence is below Threshold.
+	*/
+	void WritePair(const TLargeIdxAndData& minimum, const TLargeIdxAndData& maximum)
+	{
+		TLargePairedExtrema pair;
+		pair.MinIndex = minimum.Idx;
+		pair.MaxIndex = maximum.Idx;
+		pair.Persistence = maximum.Data - minimum.Data;
+
+		if (pair.Persistence < Threshold) return;
+		Writer.Write(pair);
+	}
+
+	double Threshold;							//pairs whose persistence is below this value are not written
+	long long Count;							//number of samples streamed
+	bool Descending;							//true if the last sample is not higher than the one before it
+	TLargeIdxAndData Previous;					//the last sample
+	TLargeIdxAndData RunMaximum;				//highest vertex since the last open minimum
+	TLargeIdxAndData GlobalMinimum;
+
+	///Minima that were not paired yet, ordered by their index. Their values increase from left to right.
+	std::vector<TLargeIdxAndData> OpenMinima;
+
+	///OpenMaxima[i] is the highest vertex between OpenMinima[i] and OpenMinima[i+1].
+	std::vector<TLargeIdxAndData> OpenMaxima;
+
+	size_t MaxOpenMinima;
+	TPairFileWriter Writer;
+};
+typedef BasicLargePersistence1D<double> LargePersistence1D;
+}
+#endif
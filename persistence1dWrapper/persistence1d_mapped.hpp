@@ -0,0 +1,213 @@
+/*! \file persistence1d_mapped.hpp
+    Read-only memory mapping of files, for data that does not fit in memory.
+
+	Files are mapped through views of limited size, so files larger than the address space can be read
+	window by window. Uses the Windows API or POSIX mmap; not meant to be included in code compiled with /clr.
+*/
+
+#ifndef PERSISTENCE_MAPPED_H
+#define PERSISTENCE_MAPPED_H
+
+#include <stddef.h>
+
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace p1d
+{
+
+/*! A file mapped read-only into memory, one view at a time.
+
+	Map() returns a pointer to any byte range of the file and releases the previous view,
+	so a pointer returned by Map() is valid until the next Map() or Close() call.
+*/
+class TMappedFile
+{
+public:
+	TMappedFile():
+#ifdef _WIN32
+		File(INVALID_HANDLE_VALUE),Mapping(0),
+#else
+		File(-1),
+#endif
+		Size(0),ViewBase(0),ViewLength(0)
+	{
+	}
+
+	~TMappedFile()
+	{
+		Close();
+	}
+
+	/*!
+		Opens a file for mapping. Closes a previously opened file. Returns false if the file cannot be opened.
+		An empty file opens successfully, but cannot be mapped.
+
+		@param[in] fileName	Name of the file.
+	*/
+	bool Open(const char* fileName)
+	{
+		Close();
+
+#ifdef _WIN32
+		File = CreateFileA(fileName, GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, 0);
+		if (File == INVALID_HANDLE_VALUE) return false;
+
+		LARGE_INTEGER size;
+		if (!GetFileSizeEx(File, &size))
+		{
+			Close();
+			return false;
+		}
+		Size = (unsigned long long)size.QuadPart;
+
+		if (Size != 0)
+		{
+			Mapping = CreateFileMappingA(File, 0, PAGE_READONLY, 0, 0, 0);
+			if (Mapping == 0)
+			{
+				Close();
+				return false;
+			}
+		}
+#else
+		File = open(fileName, O_RDONLY);
+		if (File < 0) return false;
+
+		struct stat status;
+		if (fstat(File, &status) != 0)
+		{
+			Close();
+			return false;
+		}
+		Size = (unsigned long long)status.st_size;
+#endif
+		return true;
+	}
+
+	/*!
+		Releases the current view and closes the file.
+	*/
+	void Close()
+	{
+		Unmap();
+#ifdef _WIN32
+		if (Mapping != 0) CloseHandle(Mapping);
+		if (File != INVALID_HANDLE_VALUE) CloseHandle(File);
+		Mapping = 0;
+		File = INVALID_HANDLE_VALUE;
+#else
+		if (File >= 0) close(File);
+		File = -1;
+#endif
+		Size = 0;
+	}
+
+	/*!
+		Returns true if a file is open.
+	*/
+	bool IsOpen() const
+	{
+#ifdef _WIN32
+		return File != INVALID_HANDLE_VALUE;
+#else
+		return File >= 0;
+#endif
+	}
+
+	/*!
+		Returns the size of the open file in bytes, 0 if no file is open.
+	*/
+	unsigned long long GetSize() const
+	{
+		return Size;
+	}
+
+	/*!
+		Maps length bytes of the file, starting at offset, and releases the previous view.
+		Returns a pointer to the byte at offset, or 0 if the range is empty, exceeds the file or cannot be mapped.
+
+		@param[in] offset	First byte to map. Need not be aligned.
+		@param[in] length	Number of bytes to map.
+	*/
+	const char* Map(const unsigned long long offset, const size_t length)
+	{
+		Unmap();
+		if (!IsOpen() || length == 0 || offset > Size || length > Size - offset) return 0;
+
+		//views must start at a multiple of the allocation granularity
+		const unsigned long long viewOffset = offset - offset % GetGranularity();
+		const size_t delta = (size_t)(offset - viewOffset);
+
+#ifdef _WIN32
+		void* view = MapViewOfFile(Mapping, FILE_MAP_READ, (DWORD)(viewOffset >> 32), (DWORD)viewOffset, length + delta);
+		if (view == 0) return 0;
+#else
+		void* view = mmap(0, length + delta, PROT_READ, MAP_SHARED, File, (off_t)viewOffset);
+		if (view == MAP_FAILED) return 0;
+		madvise(view, length + delta, MADV_SEQUENTIAL);
+#endif
+		ViewBase = view;
+		ViewLength = length + delta;
+		return (const char*)view + delta;
+	}
+
+	/*!
+		Returns the alignment required for view offsets.
+	*/
+	static size_t GetGranularity()
+	{
+#ifdef _WIN32
+		SYSTEM_INFO info;
+		GetSystemInfo(&info);
+		return info.dwAllocationGranularity;
+#else
+		return (size_t)sysconf(_SC_PAGESIZE);
+#endif
+	}
+
+protected:
+	/*!
+		Releases the current view, if any.
+	*/
+	void Unmap()
+	{
+		if (ViewBase == 0) return;
+#ifdef _WIN32
+		UnmapViewOfFile(ViewBase);
+#else
+		munmap(ViewBase, ViewLength);
+#endif
+		ViewBase = 0;
+		ViewLength = 0;
+	}
+
+#ifdef _WIN32
+	HANDLE File;
+	HANDLE Mapping;
+#else
+	int File;
+#endif
+	unsigned long long Size;	//file size in bytes
+	void* ViewBase;				//start of the current view, as returned by the system
+	size_t ViewLength;			//length of the current view in bytes
+
+private:
+	//owns handles and views, so it cannot be copied
+	TMappedFile(const TMappedFile&);
+	TMappedFile& operator=(const TMappedFile&);
+};
+}
+#endif
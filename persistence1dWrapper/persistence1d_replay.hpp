@@ -0,0 +1,1235 @@
+/*! \file persistence1d_replay.hpp
+    Offline replay of recorded mouse event logs through the submovement analysis of AutoGain.
+
+	A log written by TEventLogWriter is split into click windows exactly like AutoGain.processMouseEvent
+	splits the live stream: a window ends with a left button down event and starts after the previous one,
+	without the events that fell out of the time window. Every window is analysed like AutoGain.updateCurve,
+	once for each parameter set of a grid, and one TReplayWindow is written per window and parameter set.
+
+	The speeds, the positions and the persistence run of a window do not depend on the parameters, so they
+	are computed once per window and shared by the whole grid. Windows are analysed in parallel; then the aim
+	point and the gain curve, which carry over from window to window, are updated one thread per parameter set.
+	Results do not depend on the number of threads.
+
+	Output file layout:
+		TReplayFileHeader
+		TReplayParams of every parameter set of the grid
+		TReplayWindow of every window, parameter set after parameter set within a window
+
+	Uses <thread> and <mutex>, and persistence1d_eventlog_reader.hpp, so it cannot be included in code compiled with /clr.
+*/
+
+#ifndef PERSISTENCE_REPLAY_H
+#define PERSISTENCE_REPLAY_H
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "persistence1d.hpp"
+#include "persistence1d_eventlog_reader.hpp"
+
+#ifndef P1D_CACHE_LINE
+#define P1D_CACHE_LINE 64
+#endif
+
+#define P1D_REPLAY_MAGIC "P1DRPLY"
+#define P1D_REPLAY_VERSION 1
+
+namespace p1d
+{
+
+/** Parameters of AutoGain.updateCurve that can be swept. Defaults are the values used by AutoGain. */
+struct TReplayParams
+{
+	TReplayParams():PersistenceThreshold(0.03),ClutchTimespan(130),UnaimedAngle(0.78539816339744830962),
+		OvershootThreshold(1.5),InterruptedThreshold(0.5),GainChangeRate(0.1),BallisticSubmovements(3){}
+
+	///Minimal persistence of the speed peaks that split a window into submovements, in m/s.
+	double PersistenceThreshold;
+
+	///Time between two speed samples, in ms, above which a submovement is clutching.
+	double ClutchTimespan;
+
+	///Largest angle between a submovement and the direction to the click, in radians, of an aimed submovement.
+	double UnaimedAngle;
+
+	///Largest ratio of the length of a submovement to the distance to the click of an aimed submovement.
+	double OvershootThreshold;
+
+	///Ratio of the length of a submovement to the distance to the click below which it is interrupted.
+	double InterruptedThreshold;
+
+	///Gain change per meter of longitudinal error, read from param.txt by AutoGain.
+	double GainChangeRate;
+
+	///Number of submovements from the first non-clutching one that are ballistic.
+	int BallisticSubmovements;
+};
+
+
+/** Settings of a replay that are shared by all parameter sets. Defaults are those of AutoGain for a new device. */
+struct TReplaySettings
+{
+	TReplaySettings():Cpi(800),Ppi(96),BinSize(0.005),TimeBuffer(1 / 125.0 * 3.0 * 1000.0),TimeWindow(5){}
+
+	///Counts per inch of the device.
+	double Cpi;
+
+	///Pixels per inch of the screen.
+	double Ppi;
+
+	///Width of a bin of the gain curve, in m/s.
+	double BinSize;
+
+	///Events are summed into speed samples of at least this many milliseconds.
+	double TimeBuffer;
+
+	///Events older than this many seconds are dropped from a window.
+	double TimeWindow;
+
+	///Gain curve at the start of every log. Empty for the curve AutoGain.loadWindowCurve creates
+	///at the default pointer speed without enhanced pointer precision.
+	std::vector<double> InitialCurve;
+};
+
+
+/** How far the analysis of a window got, see TReplayWindow::Status. */
+enum TReplayStatus
+{
+	///The window is shorter than TReplaySettings::TimeBuffer. No other field is set.
+	REPLAY_NO_SPEEDS = 0,
+
+	///The speed has fewer than two peaks or valleys. Only the click location is set.
+	REPLAY_FEW_SUBMOVEMENTS = 1,
+
+	///At most one submovement is aimed, so the gain curve is not updated. AutoGain does not log these windows.
+	REPLAY_FEW_AIMED = 2,
+
+	///The gain curve was updated. AutoGain logs a logBundle line for these windows.
+	REPLAY_UPDATED = 3,
+
+	///The submovements are inconsistent, and AutoGain.updateCurve would throw. Fields computed before are set.
+	REPLAY_FAILED = 4
+};
+
+
+/** Result of a click window for one parameter set. 112 bytes.
+	The fields from BallisticSubmovements on are those of the logBundle line of AutoGain, in the same order.
+*/
+struct TReplayWindow
+{
+	///Index of the log, as given to TReplayEngine::Replay.
+	unsigned int Session;
+
+	///Index of the parameter set in the grid.
+	unsigned int Params;
+
+	///Time of the click in microseconds.
+	long long Timestamp;
+
+	///Events in the window, including the click.
+	int Events;
+
+	///See TReplayStatus.
+	int Status;
+
+	int BallisticSubmovements;
+	int TotalSubmovements;
+	int NetSubmovements;
+	int NonBallisticSubmovements;
+	int UnaimedSubmovements;
+	int ClutchingSubmovements;
+	int InterruptedSubmovements;
+	float TrajectoryLength;
+	float WholeTrajectoryLength;
+	float NetGainChange;
+	float NetGainChangeSigned;
+	int ForceInefficiencyX;
+	int ForceInefficiencyY;
+	float AccDurationRatio;
+	float ClickX;
+	float ClickY;
+	float AverageMotorSpeed;
+	float AverageDisplaySpeed;
+	float MaximumMotorSpeed;
+	float MaximumDisplaySpeed;
+	float TotalDuration;
+	float SubAimPoint;
+};
+
+
+/** Header at the start of a binary replay file. 24 bytes. */
+struct TReplayFileHeader
+{
+	///P1D_REPLAY_MAGIC, zero terminated.
+	char Magic[8];
+
+	///P1D_REPLAY_VERSION.
+	unsigned int Version;
+
+	///Bytes before the first TReplayWindow, including the parameter sets.
+	unsigned int HeaderSize;
+
+	///sizeof(TReplayWindow).
+	unsigned int RecordSize;
+
+	///Number of TReplayParams after the header.
+	unsigned int ParamCount;
+};
+
+
+/*! Writes replay results to a binary file, see the file layout above, or to a CSV file with one line per window.
+*/
+class TReplayFileWriter
+{
+public:
+	///Windows buffered before they are written.
+	enum { BUFFER_WINDOWS = 4096 };
+
+	TReplayFileWriter():File(0),Csv(false),Count(0),Failed(false)
+	{
+	}
+
+	~TReplayFileWriter()
+	{
+		Close();
+	}
+
+	/*!
+		Creates or truncates the file and writes its header. Returns false if it cannot be opened or written.
+
+		@param[in] fileName	Name of the result file.
+		@param[in] grid		Parameter sets of the replay.
+		@param[in] csv		Write text with one line per window instead of binary records.
+							The parameter sets are not written; lines refer to them by index.
+	*/
+	bool Open(const char* fileName, const std::vector<TReplayParams>& grid, const bool csv = false)
+	{
+		Close();
+		File = fopen(fileName, csv ? "w" : "wb");
+		Csv = csv;
+		Count = 0;
+		Failed = (File == 0);
+		Buffer.clear();
+		Buffer.reserve(BUFFER_WINDOWS);
+		if (Failed) return false;
+
+		if (Csv)
+		{
+			Failed = fputs("session,params,timestamp,events,status,"
+						   "ballistic,total,net,non_ballistic,unaimed,clutching,interrupted,"
+						   "trajectory_length,whole_trajectory_length,net_gain_change,net_gain_change_signed,"
+						   "force_inefficiency_x,force_inefficiency_y,acc_duration_ratio,click_x,click_y,"
+						   "average_motor_speed,average_display_speed,maximum_motor_speed,maximum_display_speed,"
+						   "total_duration,sub_aim_point\n", File) < 0;
+			return !Failed;
+		}
+
+		TReplayFileHeader header;
+		memset(&header, 0, sizeof(header));
+		memcpy(header.Magic, P1D_REPLAY_MAGIC, sizeof(header.Magic));
+		header.Version = P1D_REPLAY_VERSION;
+		header.HeaderSize = (unsigned int)(sizeof(header) + grid.size() * sizeof(TReplayParams));
+		header.RecordSize = sizeof(TReplayWindow);
+		header.ParamCount = (unsigned int)grid.size();
+
+		if (fwrite(&header, sizeof(header), 1, File) != 1) Failed = true;
+		if (!grid.empty() && fwrite(&grid[0], sizeof(TReplayParams), grid.size(), File) != grid.size()) Failed = true;
+		return !Failed;
+	}
+
+	/*!
+		Writes the buffered windows and closes the file. Returns false if any write failed.
+	*/
+	bool Close()
+	{
+		if (File == 0) return !Failed;
+
+		Flush();
+		if (fclose(File) != 0) Failed = true;
+		File = 0;
+		return !Failed;
+	}
+
+	/*!
+		Adds a window to the file.
+	*/
+	void Write(const TReplayWindow& window)
+	{
+		Buffer.push_back(window);
+		Count++;
+		if (Buffer.size() == BUFFER_WINDOWS) Flush();
+	}
+
+	/*!
+		Returns the number of windows written since Open.
+	*/
+	unsigned long long GetCount() const
+	{
+		return Count;
+	}
+
+protected:
+	/*!
+		Writes the buffered windows to the file.
+	*/
+	void Flush()
+	{
+		if (Buffer.empty()) return;
+
+		if (!Csv)
+		{
+			if (fwrite(&Buffer[0], sizeof(TReplayWindow), Buffer.size(), File) != Buffer.size()) Failed = true;
+			Buffer.clear();
+			return;
+		}
+
+		for (std::vector<TReplayWindow>::const_iterator w = Buffer.begin(); w != Buffer.end(); w++)
+		{
+			const TReplayWindow& r = *w;
+			if (fprintf(File, "%u,%u,%lld,%d,%d,%d,%d,%d,%d,%d,%d,%d,%.9g,%.9g,%.9g,%.9g,%d,%d,%.9g,%.9g,%.9g,%.9g,%.9g,%.9g,%.9g,%.9g,%.9g\n",
+						r.Session, r.Params, r.Timestamp, r.Events, r.Status,
+						r.BallisticSubmovements, r.TotalSubmovements, r.NetSubmovements, r.NonBallisticSubmovements,
+						r.UnaimedSubmovements, r.ClutchingSubmovements, r.InterruptedSubmovements,
+						r.TrajectoryLength, r.WholeTrajectoryLength, r.NetGainChange, r.NetGainChangeSigned,
+						r.ForceInefficiencyX, r.ForceInefficiencyY, r.AccDurationRatio, r.ClickX, r.ClickY,
+						r.AverageMotorSpeed, r.AverageDisplaySpeed, r.MaximumMotorSpeed, r.MaximumDisplaySpeed,
+						r.TotalDuration, r.SubAimPoint) < 0)
+			{
+				Failed = true;
+			}
+		}
+		Buffer.clear();
+	}
+
+	FILE* File;
+	bool Csv;
+	std::vector<TReplayWindow> Buffer;
+	unsigned long long Count;
+	bool Failed;
+
+private:
+	//owns the file, so it cannot be copied
+	TReplayFileWriter(const TReplayFileWriter&);
+	TReplayFileWriter& operator=(const TReplayFileWriter&);
+};
+
+
+/*! Replays event logs through the analysis of AutoGain.updateCurve for a grid of parameter sets, using a pool of worker threads.
+
+	Every log starts with TReplaySettings::InitialCurve and the initial aim point of AutoGain, for every parameter set.
+	The recorded movements are replayed as they were; they do not change with the learned curve.
+
+	Threads are started once, when the object is created, and wait for work between batches of windows.
+	Each thread owns a Persistence1D workspace and the speed vectors of a window, so replays do not allocate once warmed up.
+*/
+class TReplayEngine
+{
+public:
+	///Windows analysed per batch. Bounds the memory held between the two phases.
+	enum { BATCH_WINDOWS = 1024 };
+
+	///Bins of the gain curve, binCount of AutoGain.
+	enum { BIN_COUNT = 128, BIN_WORDS = BIN_COUNT / 64 };
+
+	///RI_MOUSE_LEFT_BUTTON_DOWN of the RAWMOUSE structure. Ends a window.
+	enum { LEFT_BUTTON_DOWN = 0x0001 };
+
+	/*!
+		@param[in] threadCount	Number of threads, including the calling thread.
+								0 uses one thread per hardware thread.
+	*/
+	explicit TReplayEngine(const unsigned int threadCount = 0):
+		Log(0),Session(0),Grid(0),MinThreshold(0),JobPhase(PHASE_ANALYZE),JobCount(0),JobChunk(1),
+		Generation(0),Pending(0),Stopping(false)
+	{
+		unsigned int count = threadCount;
+		if (count == 0) count = std::thread::hardware_concurrency();
+		if (count == 0) count = 1;
+
+		NextItem = 0;
+		Workers.resize(count);
+
+		//the calling thread works as worker 0
+		for (unsigned int i = 1; i < count; i++)
+		{
+			Threads.push_back(std::thread(&TReplayEngine::WorkerLoop, this, i));
+		}
+	}
+
+	~TReplayEngine()
+	{
+		{
+			std::lock_guard<std::mutex> lock(Mutex);
+			Stopping = true;
+		}
+		WorkReady.notify_all();
+
+		for (std::vector<std::thread>::iterator t = Threads.begin(); t != Threads.end(); t++)
+		{
+			(*t).join();
+		}
+	}
+
+	/*!
+		Splits a log into click windows, analyses every window for every parameter set and writes the results.
+		Blocks until the whole log is done. Returns false if the grid is empty.
+		Write errors are reported by TReplayFileWriter::Close.
+
+		@param[in]	log			Opened event log.
+		@param[in]	session		Index of the log, stored in TReplayWindow::Session.
+		@param[in]	grid		Parameter sets to analyse every window with.
+		@param[in]	settings	Device and analysis settings, see TReplaySettings.
+		@param[out]	writer		Opened result file. Windows are written in the order of the log.
+	*/
+	bool Replay(const TEventLogReader& log, const unsigned int session, const std::vector<TReplayParams>& grid,
+				const TReplaySettings& settings, TReplayFileWriter& writer)
+	{
+		if (grid.empty()) return false;
+
+		Log = &log;
+		Session = session;
+		Grid = &grid;
+		Settings = settings;
+		if (Settings.InitialCurve.empty())
+		{
+			//AutoGain.loadWindowCurve: winMultipliers at the default speed, 1, divided by CDGain = ppi / cpi
+			Settings.InitialCurve.assign(BIN_COUNT, 1 / (Settings.Ppi / Settings.Cpi));
+			Settings.InitialCurve[0] = 0;
+		}
+
+		//one persistence run per window serves all thresholds of the grid
+		MinThreshold = grid[0].PersistenceThreshold;
+		for (size_t p = 0; p != grid.size(); p++)
+		{
+			MinThreshold = std::min(MinThreshold, grid[p].PersistenceThreshold);
+		}
+
+		States.resize(grid.size());
+		for (std::vector<TLearningState>::iterator s = States.begin(); s != States.end(); s++)
+		{
+			(*s).AimPoint = InitialAimPoint();
+			(*s).Curve = Settings.InitialCurve;
+			(*s).GainChanges.assign(BIN_COUNT, 0);
+		}
+
+		//AutoGain.processMouseEvent: events are queued until a click, and the queue is then cleared.
+		//The queue holds consecutive events, so a window is a range of the log.
+		Spans.clear();
+		TWindowSpan span;
+		span.Block = 0;
+		span.Offset = 0;
+		span.Count = 0;
+
+		for (size_t block = 0; block != log.GetBlockCount(); block++)
+		{
+			const TEventBlock& events = log.GetBlock(block);
+			for (int e = 0; e != events.Count; e++)
+			{
+				const long long timestamp = events.Timestamps[e];
+				if (span.Count == 0)
+				{
+					span.Block = block;
+					span.Offset = e;
+				}
+				span.Count++;
+
+				if (events.ButtonFlags[e] & LEFT_BUTTON_DOWN)
+				{
+					span.Timestamp = timestamp;
+					Spans.push_back(span);
+					span.Count = 0;
+
+					if (Spans.size() == BATCH_WINDOWS)
+					{
+						ReplayBatch(writer);
+						Spans.clear();
+					}
+				}
+
+				//drop events that fell out of the time window, or that are later than this one after a clock change
+				while (span.Count > 0)
+				{
+					const long long first = log.GetBlock(span.Block).Timestamps[span.Offset];
+					if (!(first < timestamp - Settings.TimeWindow * 1e6 || first / 1000.0 > timestamp / 1000.0)) break;
+
+					span.Count--;
+					NextEvent(span.Block, span.Offset);
+				}
+			}
+		}
+
+		if (!Spans.empty())
+		{
+			ReplayBatch(writer);
+			Spans.clear();
+		}
+		return true;
+	}
+
+	/*!
+		Returns the gain curve learned by a parameter set in the last Replay.
+
+		@param[in] params	Index of the parameter set in the grid.
+	*/
+	const std::vector<double>& GetCurve(const size_t params) const
+	{
+		return States[params].Curve;
+	}
+
+	/*!
+		Returns the number of threads used, including the calling thread.
+	*/
+	unsigned int GetThreadCount() const
+	{
+		return (unsigned int)Workers.size();
+	}
+
+protected:
+	///Initial aim point of AutoGain, sub_aim_point and filtered_aim_point.
+	static double InitialAimPoint() { return 0.95; }
+
+	enum TPhase
+	{
+		///Items are the windows of a batch: speeds, persistence and classification for every parameter set.
+		PHASE_ANALYZE,
+
+		///Items are the parameter sets: aim point and gain curve updates over the windows of a batch.
+		PHASE_LEARN
+	};
+
+	/** Range of the log that forms a click window. */
+	struct TWindowSpan
+	{
+		size_t Block;
+		int Offset;
+		int Count;
+		long long Timestamp;
+	};
+
+	/** A submovement that updates the aim point or the gain curve. Stored from the click backwards,
+		in the order AutoGain.updateCurve processes them.
+	*/
+	struct TSubmovement
+	{
+		double Length;				//d1, from the start to the end of the submovement
+		double Projection;			//d2 * cos(angle), distance from the start to the click along the submovement
+		bool UpdatesAimPoint;		//not clutching, not interrupted, aimed and ballistic
+		bool Ballistic;
+		bool Aimed;
+		unsigned long long NewBins[BIN_WORDS];	//speed bins of the submovement not in a submovement closer to the click
+	};
+
+	/** Analysis of a window for one parameter set, before the aim point and the gain curve are updated. */
+	struct TAnalysis
+	{
+		TReplayWindow Window;
+		unsigned int Worker;		//worker holding the submovements
+		size_t FirstSubmovement;
+		size_t SubmovementCount;
+	};
+
+	/** Aim point and gain curve of a parameter set, carried from window to window. */
+	struct TLearningState
+	{
+		//parameter sets are learned by different threads, keep their aim points off each other's cache lines
+		char Padding[P1D_CACHE_LINE];
+
+		double AimPoint;
+		std::vector<double> Curve;
+		std::vector<double> GainChanges;
+	};
+
+	/** Per-thread workspace: the speeds of the current window, shared by the parameter sets, and the submovements of a batch. */
+	struct TWorker
+	{
+		//keeps the members of neighbouring workers in Workers off each other's cache lines
+		char Padding[P1D_CACHE_LINE];
+
+		Persistence1D Workspace;
+
+		std::vector<double> OutputSpeeds;
+		std::vector<double> InputSpeeds;
+		std::vector<double> FilteredSpeeds;
+		std::vector<double> Timespans;
+		std::vector<double> TimeSum;
+		std::vector<double> PositionX;
+		std::vector<double> PositionY;
+		std::vector<double> VelocityX;
+		std::vector<double> VelocityY;
+		std::vector<double> FilteredVelocityX;
+		std::vector<double> FilteredVelocityY;
+		std::vector<double> AccelerationX;
+		std::vector<double> AccelerationY;
+		std::vector<double> FilteredAccelerationX;
+		std::vector<double> FilteredAccelerationY;
+
+		std::vector<int> Mins;
+		std::vector<int> Maxs;
+		std::vector<int> ClutchingMaxAligned;
+		std::vector<int> ClutchingMinAligned;
+		std::vector<int> MaxChecked;
+		std::vector<int> Unaimed;
+		std::vector<int> Interrupted;
+
+		std::vector<TSubmovement> Submovements;
+	};
+
+	/*!
+		Moves to the event after (block, offset) in Log.
+	*/
+	void NextEvent(size_t& block, int& offset) const
+	{
+		offset++;
+		while (block < Log->GetBlockCount() && offset >= Log->GetBlock(block).Count)
+		{
+			block++;
+			offset = 0;
+		}
+	}
+
+
+	/*!
+		Analyses the windows in Spans for every parameter set, updates the aim points and gain curves, and writes the results.
+	*/
+	void ReplayBatch(TReplayFileWriter& writer)
+	{
+		Analyses.resize(Spans.size() * Grid->size());
+		for (std::vector<TWorker>::iterator w = Workers.begin(); w != Workers.end(); w++)
+		{
+			(*w).Submovements.clear();
+		}
+
+		RunPhase(PHASE_ANALYZE, Spans.size());
+		RunPhase(PHASE_LEARN, Grid->size());
+
+		for (std::vector<TAnalysis>::const_iterator a = Analyses.begin(); a != Analyses.end(); a++)
+		{
+			writer.Write((*a).Window);
+		}
+	}
+
+	/*!
+		Hands count items of a phase out to all threads, and blocks until they are done.
+	*/
+	void RunPhase(const TPhase phase, const size_t count)
+	{
+		JobPhase = phase;
+		JobCount = count;
+		JobChunk = std::max<size_t>(1, count / (Workers.size() * 16));
+		NextItem = 0;
+
+		{
+			std::lock_guard<std::mutex> lock(Mutex);
+			Pending = (unsigned int)Threads.size();
+			Generation++;
+		}
+		WorkReady.notify_all();
+
+		ProcessItems(0);
+
+		std::unique_lock<std::mutex> lock(Mutex);
+		while (Pending != 0) WorkDone.wait(lock);
+	}
+
+	/*!
+		Takes chunks of items of the current phase until none are left.
+	*/
+	void ProcessItems(const unsigned int workerIdx)
+	{
+		for (;;)
+		{
+			size_t first = NextItem.fetch_add(JobChunk);
+			if (first >= JobCount) return;
+			size_t last = std::min(first + JobChunk, JobCount);
+
+			for (size_t item = first; item != last; item++)
+			{
+				if (JobPhase == PHASE_ANALYZE)
+				{
+					AnalyzeWindow(workerIdx, item);
+				}
+				else
+				{
+					Learn(item);
+				}
+			}
+		}
+	}
+
+	/*!
+		Thread function of workers 1..n-1. Waits for a new generation of work, processes it and reports back.
+	*/
+	void WorkerLoop(const unsigned int workerIdx)
+	{
+		unsigned int doneGeneration = 0;
+		for (;;)
+		{
+			{
+				std::unique_lock<std::mutex> lock(Mutex);
+				while (!Stopping && Generation == doneGeneration) WorkReady.wait(lock);
+				if (Stopping) return;
+				doneGeneration = Generation;
+			}
+
+			ProcessItems(workerIdx);
+
+			{
+				std::lock_guard<std::mutex> lock(Mutex);
+				Pending--;
+			}
+			WorkDone.notify_one();
+		}
+	}
+
+	/*!
+		Computes the speeds of a window like the kinematic measures of AutoGain.updateCurve, runs persistence on them
+		once, and classifies the submovements for every parameter set.
+
+		@param[in]	workerIdx	Worker whose workspace is used.
+		@param[in]	windowIdx	Index of the window in Spans.
+	*/
+	void AnalyzeWindow(const unsigned int workerIdx, const size_t windowIdx)
+	{
+		TWorker& worker = Workers[workerIdx];
+		const TWindowSpan& span = Spans[windowIdx];
+
+		const double ppm = Settings.Ppi / 0.0254;
+		const double cpm = Settings.Cpi / 0.0254;
+
+		worker.OutputSpeeds.clear();
+		worker.InputSpeeds.clear();
+		worker.Timespans.clear();
+		worker.TimeSum.clear();
+		worker.PositionX.clear();
+		worker.PositionY.clear();
+
+		double sx = 0, sy = 0;
+		double inputDX = 0, inputDY = 0, outputDX = 0, outputDY = 0;
+		double time = -Log->GetBlock(span.Block).Timespans[span.Offset];
+		double timeBuffer = time;
+
+		size_t block = span.Block;
+		int offset = span.Offset;
+		for (int e = 0; e != span.Count; e++, NextEvent(block, offset))
+		{
+			const TEventBlock& events = Log->GetBlock(block);
+			const double timespan = events.Timespans[offset];
+			const double systemDX = events.SystemDX[offset];
+			const double systemDY = events.SystemDY[offset];
+
+			time += timespan;
+			sx += systemDX / ppm;
+			sy += systemDY / ppm;
+			timeBuffer += timespan;
+			inputDX += events.DeviceDX[offset];
+			inputDY += events.DeviceDY[offset];
+			outputDX += systemDX;
+			outputDY += systemDY;
+
+			if (timeBuffer >= Settings.TimeBuffer)
+			{
+				worker.OutputSpeeds.push_back(sqrt(outputDX * outputDX + outputDY * outputDY) / ppm / (timeBuffer / 1000));
+				worker.InputSpeeds.push_back(sqrt(inputDX * inputDX + inputDY * inputDY) / cpm / (timeBuffer / 1000));
+				inputDX = inputDY = outputDX = outputDY = 0;
+
+				worker.Timespans.push_back(timeBuffer);
+				timeBuffer = 0;
+
+				worker.TimeSum.push_back(time / 1000.0);
+				worker.PositionX.push_back(sx);
+				worker.PositionY.push_back(sy);
+			}
+		}
+
+		const int n = (int)worker.OutputSpeeds.size();
+		if (n != 0)
+		{
+			ComputeAccelerations(worker);
+
+			TRunOptions options;
+			options.CompressExtrema = true;
+			options.Threshold = MinThreshold;
+			options.DeferPairSort = true;
+			worker.Workspace.RunFilteredPersistence(&worker.OutputSpeeds[0], n, SmoothingKernel(), 7, 3, options);
+			worker.Workspace.GetFilteredData(worker.FilteredSpeeds);
+		}
+
+		for (size_t p = 0; p != Grid->size(); p++)
+		{
+			TAnalysis& analysis = Analyses[windowIdx * Grid->size() + p];
+			memset(&analysis.Window, 0, sizeof(analysis.Window));
+			analysis.Window.Session = Session;
+			analysis.Window.Params = (unsigned int)p;
+			analysis.Window.Timestamp = span.Timestamp;
+			analysis.Window.Events = span.Count;
+			analysis.Worker = workerIdx;
+			analysis.FirstSubmovement = worker.Submovements.size();
+			analysis.SubmovementCount = 0;
+
+			if (n == 0)
+			{
+				analysis.Window.Status = REPLAY_NO_SPEEDS;
+				continue;
+			}
+			analysis.Window.Status = Classify(worker, (*Grid)[p], analysis.Window);
+			analysis.SubmovementCount = worker.Submovements.size() - analysis.FirstSubmovement;
+		}
+	}
+
+	/*!
+		Smoothing kernel of AutoGain.updateCurve, applied to the velocities, the accelerations and the speeds.
+	*/
+	static const double* SmoothingKernel()
+	{
+		static const double kernel[7] = { 0.0, 0, 0.27901, 0.44198, 0.27901, 0, 0.0 };
+		return kernel;
+	}
+
+	/*!
+		Smooths the first count values of a series like AutoGain.updateCurve: taps -3 to 2 of the kernel,
+		normalized by the taps inside the first count values.
+	*/
+	static void Smooth(const std::vector<double>& values, const size_t count, std::vector<double>& smoothed)
+	{
+		const double* kernel = SmoothingKernel();
+		smoothed.resize(count);
+		for (int j = 0; j < (int)count; j++)
+		{
+			double value = 0;
+			double kernelSum = 0;
+			for (int k = -3; k < 3; k++)
+			{
+				if (j + k >= 0 && j + k < (int)count)
+				{
+					value += values[j + k] * kernel[k + 3];
+					kernelSum += kernel[k + 3];
+				}
+			}
+			smoothed[j] = value / kernelSum;
+		}
+	}
+
+	/*!
+		Computes the velocities from the positions, and the smoothed accelerations from the smoothed velocities.
+	*/
+	static void ComputeAccelerations(TWorker& worker)
+	{
+		const std::vector<double>& x = worker.PositionX;
+		const std::vector<double>& y = worker.PositionY;
+		const std::vector<double>& t = worker.TimeSum;
+
+		worker.VelocityX.assign(1, 0);
+		worker.VelocityY.assign(1, 0);
+		for (size_t i = 1; i + 1 < x.size(); i++)
+		{
+			worker.VelocityX.push_back((x[i + 1] - x[i - 1]) / (t[i + 1] - t[i - 1]));
+			worker.VelocityY.push_back((y[i + 1] - y[i - 1]) / (t[i + 1] - t[i - 1]));
+		}
+		worker.VelocityX.push_back(0);
+		worker.VelocityY.push_back(0);
+
+		Smooth(worker.VelocityX, worker.VelocityX.size(), worker.FilteredVelocityX);
+		Smooth(worker.VelocityY, worker.VelocityY.size(), worker.FilteredVelocityY);
+
+		worker.AccelerationX.assign(1, 0);
+		worker.AccelerationY.assign(1, 0);
+		for (size_t i = 1; i + 1 < worker.VelocityX.size(); i++)
+		{
+			worker.AccelerationX.push_back((worker.FilteredVelocityX[i + 1] - worker.FilteredVelocityX[i - 1]) / (t[i + 1] - t[i - 1]));
+			worker.AccelerationY.push_back((worker.FilteredVelocityY[i + 1] - worker.FilteredVelocityY[i - 1]) / (t[i + 1] - t[i - 1]));
+		}
+		worker.AccelerationX.push_back(0);
+		worker.AccelerationY.push_back(0);
+
+		Smooth(worker.AccelerationX, x.size(), worker.FilteredAccelerationX);
+		Smooth(worker.AccelerationY, x.size(), worker.FilteredAccelerationY);
+	}
+
+	/*!
+		Counts the sign changes of an acceleration from first on, like AutoGain.updateCurve.
+		Returns -1 if there is a NaN, for which Math.Sign throws.
+	*/
+	static int CountSignChanges(const std::vector<double>& acceleration, const size_t first)
+	{
+		for (size_t i = first; i != acceleration.size(); i++)
+		{
+			if (acceleration[i] != acceleration[i]) return -1;
+		}
+
+		int sign = 0;
+		for (size_t i = first; i != acceleration.size(); i++)
+		{
+			if (acceleration[i] != 0)
+			{
+				sign = (acceleration[i] > 0) ? 1 : -1;
+				break;
+			}
+		}
+
+		int changes = 0;
+		for (size_t i = first; i != acceleration.size(); i++)
+		{
+			const int s = (acceleration[i] > 0) ? 1 : (acceleration[i] < 0) ? -1 : 0;
+			if (s != sign && s != 0)
+			{
+				sign = s;
+				changes++;
+			}
+		}
+		return changes;
+	}
+
+	/*!
+		Splits the speeds of the window in worker into submovements and classifies them like AutoGain.updateCurve,
+		up to the update of the aim point and the gain curve. Fills the fields of window that do not depend on
+		the learning state, and appends the submovements that update it to worker.Submovements.
+		Returns the TReplayStatus of the window.
+	*/
+	int Classify(TWorker& worker, const TReplayParams& params, TReplayWindow& window) const
+	{
+		const std::vector<double>& positionX = worker.PositionX;
+		const std::vector<double>& positionY = worker.PositionY;
+		const int n = (int)worker.OutputSpeeds.size();
+
+		const double tx = positionX.back();
+		const double ty = positionY.back();
+		window.ClickX = (float)tx;
+		window.ClickY = (float)ty;
+
+		std::vector<int>& mins = worker.Mins;
+		std::vector<int>& maxs = worker.Maxs;
+		worker.Workspace.GetOrderedExtremaIndices(mins, maxs, params.PersistenceThreshold);
+
+		if (mins.size() <= 1 || maxs.size() <= 1) return REPLAY_FEW_SUBMOVEMENTS;
+
+		//if the first peak comes before the first valley, it is dropped
+		if (mins[0] > maxs[0]) maxs.erase(maxs.begin());
+		mins.push_back(n - 1);
+
+		//the submovement with the fastest peak, and the last valley before it
+		size_t firstMax = 0;
+		double fastest = 0;
+		for (size_t i = 0; i != maxs.size(); i++)
+		{
+			if (worker.OutputSpeeds[maxs[i]] > fastest)
+			{
+				firstMax = i;
+				fastest = worker.OutputSpeeds[maxs[i]];
+			}
+		}
+		int firstMin = 0;
+		for (size_t i = 0; i != mins.size(); i++)
+		{
+			if (mins[i] < maxs[firstMax]) firstMin = (int)i;
+		}
+
+		//clutching: a long gap between two speed samples from a peak to the next
+		std::vector<int>& clutchingMax = worker.ClutchingMaxAligned;
+		clutchingMax.clear();
+		for (size_t i = 0; i + 1 < maxs.size(); i++)
+		{
+			int mark = 0;
+			for (int j = maxs[i]; j < maxs[i + 1]; j++)
+			{
+				if (j < (int)worker.Timespans.size() && worker.Timespans[j] > params.ClutchTimespan) mark = 1;
+			}
+			clutchingMax.push_back(mark);
+		}
+		clutchingMax.push_back(0);
+
+		std::vector<int>& clutchingMin = worker.ClutchingMinAligned;
+		clutchingMin.clear();
+		worker.MaxChecked.assign(maxs.size(), 0);
+		for (size_t i = 0; i + 1 < mins.size(); i++)
+		{
+			bool neverAssigned = true;
+			for (size_t j = 0; j != maxs.size(); j++)
+			{
+				if (mins[i] < maxs[j] && mins[i + 1] > maxs[j] && worker.MaxChecked[j] == 0)
+				{
+					clutchingMin.push_back(clutchingMax[j]);
+					worker.MaxChecked[j] = 1;
+					neverAssigned = false;
+				}
+			}
+			if (neverAssigned) clutchingMin.push_back(0);
+		}
+
+		//unaimed and interrupted, from the geometry at the end of each submovement
+		worker.Unaimed.clear();
+		worker.Interrupted.clear();
+		for (size_t i = 0; i + 1 < mins.size(); i++)
+		{
+			const double sxStart = positionX[mins[i]];
+			const double syStart = positionY[mins[i]];
+			double maxAngle = 0, angle = 0, d1 = 0, d2 = 0, d3 = 0, a = 0, b = 0;
+
+			for (int j = mins[i]; j <= mins[i + 1]; j++)
+			{
+				const double sxEnd = positionX[j];
+				const double syEnd = positionY[j];
+				a = syEnd - syStart;
+				b = sxStart - sxEnd;
+				d1 = sqrt((sxStart - sxEnd) * (sxStart - sxEnd) + (syStart - syEnd) * (syStart - syEnd));
+				d2 = sqrt((sxStart - tx) * (sxStart - tx) + (syStart - ty) * (syStart - ty));
+				d3 = sqrt((sxEnd - tx) * (sxEnd - tx) + (syEnd - ty) * (syEnd - ty));
+				angle = 0;
+				if (d1 != 0 && d2 != 0)
+				{
+					angle = acos((d1 * d1 + d2 * d2 - d3 * d3) / 2 / d1 / d2);
+					if (angle > maxAngle) maxAngle = angle;
+				}
+			}
+
+			const bool defined = (a != 0 && b != 0 && (d2 * cos(angle)) != 0);
+			worker.Unaimed.push_back((defined && maxAngle <= params.UnaimedAngle && d1 / (d2 * cos(angle)) <= params.OvershootThreshold) ? 0 : 1);
+			worker.Interrupted.push_back((defined && d1 / (d2 * cos(angle)) < params.InterruptedThreshold) ? 1 : 0);
+		}
+
+		int firstNonClutching = (int)clutchingMin.size() - 1;
+		for (int i = firstMin; i < (int)clutchingMin.size() - 1; i++)
+		{
+			if (clutchingMin[i] != 1)
+			{
+				firstNonClutching = i;
+				break;
+			}
+		}
+
+		const int indexRight = (int)mins.size() - 1;
+		const int lastBallistic = firstNonClutching + params.BallisticSubmovements - 1;
+
+		for (int i = firstMin; i < (int)clutchingMin.size() - 1; i++)
+		{
+			//more clutching marks than submovements: AutoGain reads past is_unaimed
+			if (i >= (int)worker.Unaimed.size()) return REPLAY_FAILED;
+
+			if (clutchingMin[i] == 1) window.ClutchingSubmovements++;
+			if (worker.Unaimed[i] == 1) window.UnaimedSubmovements++;
+			if (worker.Interrupted[i] == 1) window.InterruptedSubmovements++;
+		}
+		window.TotalSubmovements = (int)mins.size() - 1;
+		window.NetSubmovements = (int)mins.size() - 1 - firstMin;
+
+		if (lastBallistic < (int)mins.size() - 2)
+		{
+			window.NonBallisticSubmovements = (int)mins.size() - 1 - lastBallistic - 1;
+			window.BallisticSubmovements = lastBallistic - firstNonClutching + 1;
+		}
+		else
+		{
+			window.NonBallisticSubmovements = 0;
+			window.BallisticSubmovements = (int)mins.size() - 1 - firstNonClutching;
+		}
+
+		//measures of the submovements from the valley before the fastest one to the click
+		const size_t first = mins[firstMin];
+		double motorSum = 0, displaySum = 0;
+		double motorMax = worker.InputSpeeds[first], displayMax = worker.FilteredSpeeds[first];
+		size_t speedPeak = 0;
+		double peakSpeed = 0;
+		for (size_t i = first; i != (size_t)n; i++)
+		{
+			motorSum += worker.InputSpeeds[i];
+			displaySum += worker.FilteredSpeeds[i];
+			motorMax = std::max(motorMax, worker.InputSpeeds[i]);
+			displayMax = std::max(displayMax, worker.FilteredSpeeds[i]);
+			if (worker.FilteredSpeeds[i] > peakSpeed)
+			{
+				speedPeak = i - first;
+				peakSpeed = worker.FilteredSpeeds[i];
+			}
+		}
+		window.MaximumMotorSpeed = (float)motorMax;
+		window.MaximumDisplaySpeed = (float)displayMax;
+		window.AverageMotorSpeed = (float)(motorSum / (n - first));
+		window.AverageDisplaySpeed = (float)(displaySum / (n - first));
+
+		double trajectory = 0, wholeTrajectory = 0;
+		for (size_t i = 0; i + 1 < (size_t)n; i++)
+		{
+			const double dx = positionX[i + 1] - positionX[i];
+			const double dy = positionY[i + 1] - positionY[i];
+			const double step = sqrt(dx * dx + dy * dy);
+			if (i >= first) trajectory += step;
+			wholeTrajectory += step;
+		}
+		window.TrajectoryLength = (float)trajectory;
+		window.WholeTrajectoryLength = (float)wholeTrajectory;
+
+		const std::vector<double>& t = worker.TimeSum;
+		window.AccDurationRatio = (float)((t[first + speedPeak] - t[first]) / (t.back() - t[first]));
+		window.TotalDuration = (float)(t.back() - t[first]);
+
+		window.ForceInefficiencyX = CountSignChanges(worker.FilteredAccelerationX, first);
+		window.ForceInefficiencyY = CountSignChanges(worker.FilteredAccelerationY, first);
+		if (window.ForceInefficiencyX < 0 || window.ForceInefficiencyY < 0) return REPLAY_FAILED;
+
+		int aimed = 0;
+		for (int i = indexRight - 1; i >= firstMin; i--)
+		{
+			if (worker.Unaimed[i] != 1) aimed++;
+		}
+		if (aimed <= 1) return REPLAY_FEW_AIMED;
+
+		//submovements from the click backwards; a speed bin counts for the closest submovement to the click it appears in
+		unsigned long long seenBins[BIN_WORDS] = { 0 };
+		for (int i = indexRight - 1; i >= firstMin; i--)
+		{
+			const double sxEnd = positionX[mins[i + 1]];
+			const double syEnd = positionY[mins[i + 1]];
+			const double sxStart = positionX[mins[i]];
+			const double syStart = positionY[mins[i]];
+			const double d1 = sqrt((sxStart - sxEnd) * (sxStart - sxEnd) + (syStart - syEnd) * (syStart - syEnd));
+			const double d2 = sqrt((sxStart - tx) * (sxStart - tx) + (syStart - ty) * (syStart - ty));
+			const double d3 = sqrt((sxEnd - tx) * (sxEnd - tx) + (syEnd - ty) * (syEnd - ty));
+			double angle = 0;
+			if (d1 != 0 && d2 != 0) angle = acos((d1 * d1 + d2 * d2 - d3 * d3) / 2 / d1 / d2);
+
+			TSubmovement submovement;
+			submovement.Length = d1;
+			submovement.Projection = d2 * cos(angle);
+			submovement.Ballistic = (i <= lastBallistic);
+			submovement.Aimed = (worker.Unaimed[i] != 1);
+			submovement.UpdatesAimPoint = clutchingMin[i] != 1 && worker.Interrupted[i] != 1 && submovement.Aimed && submovement.Ballistic;
+			memset(submovement.NewBins, 0, sizeof(submovement.NewBins));
+
+			if (submovement.Aimed)
+			{
+				for (int j = mins[i]; j < mins[i + 1]; j++)
+				{
+					const double bin = ceil(worker.InputSpeeds[j] / Settings.BinSize);
+					if (worker.InputSpeeds[j] == 0 || !(bin < BIN_COUNT)) continue;
+
+					const int middle = (int)bin;
+					if (!(seenBins[middle / 64] & (1ULL << (middle % 64))))
+					{
+						submovement.NewBins[middle / 64] |= 1ULL << (middle % 64);
+					}
+				}
+				for (int w = 0; w != BIN_WORDS; w++)
+				{
+					seenBins[w] |= submovement.NewBins[w];
+				}
+			}
+			worker.Submovements.push_back(submovement);
+		}
+		return REPLAY_UPDATED;
+	}
+
+	/*!
+		Updates the aim point and the gain curve of a parameter set with the windows of the batch, in order,
+		like the end of AutoGain.updateCurve and AutoGain.updateAimPoint.
+
+		@param[in]	params	Index of the parameter set in the grid.
+	*/
+	void Learn(const size_t params)
+	{
+		//Kalman gain of AutoGain.updateAimPoint: process_noise / (process_noise + sensor_noise)
+		const double kalmanGain = 0.2 / (0.2 + 40.0);
+		const double* kernel = SmoothingKernel();
+		const double rate = (*Grid)[params].GainChangeRate;
+		TLearningState& state = States[params];
+
+		for (size_t windowIdx = 0; windowIdx != Spans.size(); windowIdx++)
+		{
+			TAnalysis& analysis = Analyses[windowIdx * Grid->size() + params];
+			if (analysis.Window.Status == REPLAY_UPDATED)
+			{
+				const TSubmovement* submovements = &Workers[analysis.Worker].Submovements[0] + analysis.FirstSubmovement;
+				for (size_t s = 0; s != analysis.SubmovementCount; s++)
+				{
+					const TSubmovement& submovement = submovements[s];
+					if (submovement.UpdatesAimPoint)
+					{
+						state.AimPoint = state.AimPoint + kalmanGain * (submovement.Length / submovement.Projection - state.AimPoint);
+					}
+
+					const double error = submovement.Ballistic ? state.AimPoint * submovement.Projection - submovement.Length
+															   : submovement.Projection - submovement.Length;
+					if (!submovement.Aimed) continue;
+
+					for (int j = 0; j != BIN_COUNT; j++)
+					{
+						if (submovement.NewBins[j / 64] & (1ULL << (j % 64))) state.GainChanges[j] = state.GainChanges[j] + rate * error;
+					}
+
+					for (int j = 1; j < (int)state.Curve.size(); j++)
+					{
+						double value = 0;
+						double kernelSum = 0;
+						for (int k = -3; k < 3; k++)
+						{
+							if (j + k >= 0 && j + k < BIN_COUNT)
+							{
+								value += state.GainChanges[j + k] * kernel[k + 3];
+								kernelSum += kernel[k + 3];
+							}
+						}
+						state.Curve[j] = state.Curve[j] + value / kernelSum;
+						if (state.Curve[j] < 0.0) state.Curve[j] = 0.0;
+					}
+				}
+
+				double gainChangeSum = 0;
+				double gainChangeSumSigned = 0;
+				for (int j = 0; j != BIN_COUNT; j++)
+				{
+					gainChangeSum += fabs(state.GainChanges[j]);
+					gainChangeSumSigned += state.GainChanges[j];
+					state.GainChanges[j] = 0.0;
+				}
+				analysis.Window.NetGainChange = (float)gainChangeSum;
+				analysis.Window.NetGainChangeSigned = (float)gainChangeSumSigned;
+			}
+			analysis.Window.SubAimPoint = (float)state.AimPoint;
+		}
+	}
+
+	std::vector<TWorker> Workers;
+	std::vector<std::thread> Threads;
+
+	//the current log, set by Replay
+	const TEventLogReader* Log;
+	unsigned int Session;
+	const std::vector<TReplayParams>* Grid;
+	TReplaySettings Settings;
+	double MinThreshold;							//persistence threshold of the runs, the lowest of the grid
+	std::vector<TLearningState> States;				//one per parameter set
+
+	//the current batch
+	std::vector<TWindowSpan> Spans;
+	std::vector<TAnalysis> Analyses;				//window after window, parameter set after parameter set
+
+	//the current phase, set by RunPhase before the workers are woken up
+	TPhase JobPhase;
+	size_t JobCount;
+	size_t JobChunk;
+
+	//taken by every thread for every chunk, on its own cache line so the job fields above stay shared
+	char NextItemPadding[P1D_CACHE_LINE];
+	std::atomic<size_t> NextItem;
+	char EndPadding[P1D_CACHE_LINE];
+
+	std::mutex Mutex;
+	std::condition_variable WorkReady;	//signaled when Generation changes or Stopping is set
+	std::condition_variable WorkDone;	//signaled when a worker finished its part of a generation
+	unsigned int Generation;			//incremented for every phase
+	unsigned int Pending;				//number of threads still working on the current phase
+	bool Stopping;
+
+private:
+	//threads refer to this object, so it cannot be copied
+	TReplayEngine(const TReplayEngine&);
+	TReplayEngine& operator=(const TReplayEngine&);
+};
+}
+#endif
@@ -0,0 +1,139 @@
+/*! \file persistence1d_ring.hpp
+    Lock-free ring buffer for one producer thread and one consumer thread.
+
+	Uses <atomic>, so it cannot be included in code compiled with /clr;
+	see persistence1d_eventqueue.h for a wrapper that can.
+*/
+
+#ifndef PERSISTENCE_RING_H
+#define PERSISTENCE_RING_H
+
+#include <stddef.h>
+#include <atomic>
+#include <vector>
+
+#ifndef P1D_CACHE_LINE
+#define P1D_CACHE_LINE 64
+#endif
+
+namespace p1d
+{
+
+/*! A bounded queue of fixed-size items, for exactly one producer thread and one consumer thread.
+
+	Neither side locks or waits: Push fails if the ring is full, Pop fails if it is empty.
+	Each side keeps its own index on its own cache line, and a cached copy of the other side's index,
+	so the other side's line is only read when the ring looks full or empty.
+*/
+template <typename T>
+class TSpscRing
+{
+public:
+	/*!
+		@param[in] capacity	Minimum number of items the ring holds. Rounded up to a power of two.
+	*/
+	explicit TSpscRing(const size_t capacity):Tail(0),CachedHead(0),Head(0),CachedTail(0)
+	{
+		size_t size = 2;
+		while (size < capacity) size *= 2;
+
+		Items.resize(size);
+		Mask = size - 1;
+	}
+
+	/*!
+		Adds an item. Returns false, without waiting, if the ring is full. Producer thread only.
+	*/
+	bool Push(const T& item)
+	{
+		const size_t tail = Tail.load(std::memory_order_relaxed);
+		if (tail - CachedHead > Mask)
+		{
+			CachedHead = Head.load(std::memory_order_acquire);
+			if (tail - CachedHead > Mask) return false;
+		}
+
+		Items[tail & Mask] = item;
+		Tail.store(tail + 1, std::memory_order_release);
+		return true;
+	}
+
+	/*!
+		Removes the oldest item. Returns false, without waiting, if the ring is empty. Consumer thread only.
+	*/
+	bool Pop(T& item)
+	{
+		const size_t head = Head.load(std::memory_order_relaxed);
+		if (head == CachedTail)
+		{
+			CachedTail = Tail.load(std::memory_order_acquire);
+			if (head == CachedTail) return false;
+		}
+
+		item = Items[head & Mask];
+		Head.store(head + 1, std::memory_order_release);
+		return true;
+	}
+
+	/*!
+		Removes up to maxCount of the oldest items at once. Returns the number of items removed. Consumer thread only.
+
+		@param[out]	items		Receives the items, oldest first.
+		@param[in]	maxCount	Maximum number of items to remove.
+	*/
+	size_t Pop(T* items, const size_t maxCount)
+	{
+		const size_t head = Head.load(std::memory_order_relaxed);
+		if (CachedTail - head < maxCount)
+		{
+			CachedTail = Tail.load(std::memory_order_acquire);
+		}
+
+		const size_t count = (CachedTail - head < maxCount) ? CachedTail - head : maxCount;
+		for (size_t i = 0; i != count; i++)
+		{
+			items[i] = Items[(head + i) & Mask];
+		}
+
+		Head.store(head + count, std::memory_order_release);
+		return count;
+	}
+
+	/*!
+		Returns the number of items in the ring. Exact only when called while the other side is idle.
+	*/
+	size_t Size() const
+	{
+		return Tail.load(std::memory_order_acquire) - Head.load(std::memory_order_acquire);
+	}
+
+	/*!
+		Returns the number of items the ring holds.
+	*/
+	size_t GetCapacity() const
+	{
+		return Mask + 1;
+	}
+
+protected:
+	std::vector<T> Items;
+	size_t Mask;
+
+	//producer side, on its own cache line
+	char ProducerPadding[P1D_CACHE_LINE];
+	std::atomic<size_t> Tail;		//index of the next item to push, counts up without wrapping to the ring size
+	size_t CachedHead;				//last Head seen by the producer
+
+	//consumer side, on its own cache line
+	char ConsumerPadding[P1D_CACHE_LINE];
+	std::atomic<size_t> Head;		//index of the next item to pop
+	size_t CachedTail;				//last Tail seen by the consumer
+
+	char EndPadding[P1D_CACHE_LINE];
+
+private:
+	TSpscRing(const TSpscRing&);
+	TSpscRing& operator=(const TSpscRing&);
+};
+}
+#endif
@@ -0,0 +1,575 @@
+/*! \file persistence1d_simd.hpp
+    Vectorized classification of vertices into local minima, local maxima and regular vertices,
+	and vectorized FIR smoothing of the data.
+
+	The instruction set is chosen at runtime: AVX2, SSE2 or a scalar fallback.
+	Vectorized classification exists for double, float and int data, vectorized smoothing for double data;
+	other types use the scalar code.
+	When compiled with /clr, the kernels are compiled as native code.
+*/
+
+#ifndef PERSISTENCE_SIMD_H
+#define PERSISTENCE_SIMD_H
+
+#include <algorithm>
+
+#if (defined(_M_IX86) || defined(_M_X64) || defined(__i386__) || defined(__x86_64__)) && !defined(P1D_NO_SIMD)
+#define P1D_SIMD
+#endif
+
+#ifdef P1D_SIMD
+#include <immintrin.h>
+#endif
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+//Intrinsics are not supported in managed code
+#ifdef _M_CEE
+#pragma managed(push, off)
+#endif
+
+#if defined(P1D_SIMD) && defined(__GNUC__)
+#define P1D_TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define P1D_TARGET_AVX2
+#endif
+
+namespace p1d
+{
+
+/** Classes of vertices, as written by ClassifyVertices.
+	Equal values are ordered from left to right, as in the sorted data of Persistence1D,
+	so every vertex of a plateau is regular except possibly its left most one.
+*/
+enum TVertexClass
+{
+	VERTEX_REGULAR = 0,
+	VERTEX_MINIMUM = 1,
+	VERTEX_MAXIMUM = 2
+};
+
+/** Instruction sets used by the classification kernels. */
+enum TSimdLevel
+{
+	SIMD_NONE = 0,
+	SIMD_SSE2 = 1,
+	SIMD_AVX2 = 2
+};
+
+namespace simd
+{
+
+/*!
+	Returns the best instruction set supported by the CPU and the operating system.
+*/
+inline TSimdLevel DetectSimdLevel()
+{
+#ifndef P1D_SIMD
+	return SIMD_NONE;
+#elif defined(_MSC_VER)
+	int info[4];
+	__cpuid(info, 0);
+	const int maxLeaf = info[0];
+
+	__cpuid(info, 1);
+	const bool sse2 = (info[3] & (1 << 26)) != 0;
+	const bool osxsave = (info[2] & (1 << 27)) != 0;
+	const bool avx = (info[2] & (1 << 28)) != 0;
+
+	bool avx2 = false;
+	if (osxsave && avx && maxLeaf >= 7 && (_xgetbv(0) & 6) == 6) //the OS saves the YMM registers
+	{
+		__cpuidex(info, 7, 0);
+		avx2 = (info[1] & (1 << 5)) != 0;
+	}
+
+	if (avx2) return SIMD_AVX2;
+	if (sse2) return SIMD_SSE2;
+	return SIMD_NONE;
+#else
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) return SIMD_AVX2;
+	if (__builtin_cpu_supports("sse2")) return SIMD_SSE2;
+	return SIMD_NONE;
+#endif
+}
+
+/*!
+	Highest instruction set the kernels may use. Defaults to the detected one.
+*/
+inline TSimdLevel& SimdLevelLimit()
+{
+	static TSimdLevel limit = DetectSimdLevel();
+	return limit;
+}
+
+/*!
+	Returns the index of the lowest set bit. mask must not be 0.
+*/
+inline int LowestBit(const unsigned int mask)
+{
+#ifdef _MSC_VER
+	unsigned long idx;
+	_BitScanForward(&idx, mask);
+	return (int)idx;
+#else
+	return __builtin_ctz(mask);
+#endif
+}
+
+/*!
+	Returns the index of the lowest set bit. mask must not be 0.
+*/
+inline int LowestBit64(const unsigned long long mask)
+{
+#if defined(_MSC_VER) && defined(_M_X64)
+	unsigned long idx;
+	_BitScanForward64(&idx, mask);
+	return (int)idx;
+#elif defined(_MSC_VER)
+	const unsigned int low = (unsigned int)mask;
+	return low != 0 ? LowestBit(low) : 32 + LowestBit((unsigned int)(mask >> 32));
+#else
+	return __builtin_ctzll(mask);
+#endif
+}
+
+/*!
+	Returns the number of set bits. Does not rely on the POPCNT instruction.
+*/
+inline int PopCount64(unsigned long long mask)
+{
+#ifdef __GNUC__
+	return __builtin_popcountll(mask);
+#else
+	mask = mask - ((mask >> 1) & 0x5555555555555555ULL);
+	mask = (mask & 0x3333333333333333ULL) + ((mask >> 2) & 0x3333333333333333ULL);
+	mask = (mask + (mask >> 4)) & 0x0F0F0F0F0F0F0F0FULL;
+	return (int)((mask * 0x0101010101010101ULL) >> 56);
+#endif
+}
+
+
+/** Receives classified vertices and stores the indices of the extrema. */
+struct TExtremaSink
+{
+	explicit TExtremaSink(int* indices):Indices(indices),Count(0){}
+
+	void Vertex(const int idx, const TVertexClass cls)
+	{
+		if (cls != VERTEX_REGULAR) Indices[Count++] = idx;
+	}
+
+	void Block(const int firstIdx, const int /*width*/, const unsigned int minMask, const unsigned int maxMask)
+	{
+		for (unsigned int mask = minMask | maxMask; mask != 0; mask &= mask - 1)
+		{
+			Indices[Count++] = firstIdx + LowestBit(mask);
+		}
+	}
+
+	int* Indices;
+	int Count;
+};
+
+
+/** Receives classified vertices and stores their classes. */
+struct TClassSink
+{
+	explicit TClassSink(unsigned char* classes):Classes(classes){}
+
+	void Vertex(const int idx, const TVertexClass cls)
+	{
+		Classes[idx] = (unsigned char)cls;
+	}
+
+	void Block(const int firstIdx, const int width, const unsigned int minMask, const unsigned int maxMask)
+	{
+		for (int lane = 0; lane < width; lane++)
+		{
+			Classes[firstIdx + lane] = (unsigned char)(((minMask >> lane) & 1) * VERTEX_MINIMUM + ((maxMask >> lane) & 1) * VERTEX_MAXIMUM);
+		}
+	}
+
+	unsigned char* Classes;
+};
+
+
+/*!
+	Classifies the inner vertices begin..end-1. Both neighbors of each vertex must exist.
+	A vertex is lower than its left neighbor if it is strictly lower, and lower than its right neighbor
+	if it is lower or equal.
+*/
+template <typename TValue, class TSink>
+inline void ClassifyScalar(const TValue* data, const int begin, const int end, TSink& sink)
+{
+	for (int i = begin; i < end; i++)
+	{
+		const bool lowerThanLeft = data[i-1] > data[i];
+		const bool lowerThanRight = data[i+1] >= data[i];
+
+		if (lowerThanLeft && lowerThanRight) sink.Vertex(i, VERTEX_MINIMUM);
+		else if (!lowerThanLeft && !lowerThanRight) sink.Vertex(i, VERTEX_MAXIMUM);
+	}
+}
+
+#ifdef P1D_SIMD
+
+template <class TSink>
+inline void ClassifySse2(const double* data, const int begin, const int end, TSink& sink)
+{
+	int i = begin;
+	for (; i + 2 <= end; i += 2)
+	{
+		const __m128d left = _mm_loadu_pd(data + i - 1);
+		const __m128d center = _mm_loadu_pd(data + i);
+		const __m128d right = _mm_loadu_pd(data + i + 1);
+		const unsigned int lowerThanLeft = (unsigned int)_mm_movemask_pd(_mm_cmpgt_pd(left, center));
+		const unsigned int lowerThanRight = (unsigned int)_mm_movemask_pd(_mm_cmpge_pd(right, center));
+		sink.Block(i, 2, lowerThanLeft & lowerThanRight, ~(lowerThanLeft | lowerThanRight) & 0x3);
+	}
+	ClassifyScalar(data, i, end, sink);
+}
+
+template <class TSink>
+P1D_TARGET_AVX2 inline void ClassifyAvx2(const double* data, const int begin, const int end, TSink& sink)
+{
+	int i = begin;
+	for (; i + 4 <= end; i += 4)
+	{
+		const __m256d left = _mm256_loadu_pd(data + i - 1);
+		const __m256d center = _mm256_loadu_pd(data + i);
+		const __m256d right = _mm256_loadu_pd(data + i + 1);
+		const unsigned int lowerThanLeft = (unsigned int)_mm256_movemask_pd(_mm256_cmp_pd(left, center, _CMP_GT_OQ));
+		const unsigned int lowerThanRight = (unsigned int)_mm256_movemask_pd(_mm256_cmp_pd(right, center, _CMP_GE_OQ));
+		sink.Block(i, 4, lowerThanLeft & lowerThanRight, ~(lowerThanLeft | lowerThanRight) & 0xF);
+	}
+	ClassifyScalar(data, i, end, sink);
+}
+
+template <class TSink>
+inline void ClassifySse2(const float* data, const int begin, const int end, TSink& sink)
+{
+	int i = begin;
+	for (; i + 4 <= end; i += 4)
+	{
+		const __m128 left = _mm_loadu_ps(data + i - 1);
+		const __m128 center = _mm_loadu_ps(data + i);
+		const __m128 right = _mm_loadu_ps(data + i + 1);
+		const unsigned int lowerThanLeft = (unsigned int)_mm_movemask_ps(_mm_cmpgt_ps(left, center));
+		const unsigned int lowerThanRight = (unsigned int)_mm_movemask_ps(_mm_cmpge_ps(right, center));
+		sink.Block(i, 4, lowerThanLeft & lowerThanRight, ~(lowerThanLeft | lowerThanRight) & 0xF);
+	}
+	ClassifyScalar(data, i, end, sink);
+}
+
+template <class TSink>
+P1D_TARGET_AVX2 inline void ClassifyAvx2(const float* data, const int begin, const int end, TSink& sink)
+{
+	int i = begin;
+	for (; i + 8 <= end; i += 8)
+	{
+		const __m256 left = _mm256_loadu_ps(data + i - 1);
+		const __m256 center = _mm256_loadu_ps(data + i);
+		const __m256 right = _mm256_loadu_ps(data + i + 1);
+		const unsigned int lowerThanLeft = (unsigned int)_mm256_movemask_ps(_mm256_cmp_ps(left, center, _CMP_GT_OQ));
+		const unsigned int lowerThanRight = (unsigned int)_mm256_movemask_ps(_mm256_cmp_ps(right, center, _CMP_GE_OQ));
+		sink.Block(i, 8, lowerThanLeft & lowerThanRight, ~(lowerThanLeft | lowerThanRight) & 0xFF);
+	}
+	ClassifyScalar(data, i, end, sink);
+}
+
+//integers have no "greater or equal" comparison: right >= center is !(center > right)
+template <class TSink>
+inline void ClassifySse2(const int* data, const int begin, const int end, TSink& sink)
+{
+	int i = begin;
+	for (; i + 4 <= end; i += 4)
+	{
+		const __m128i left = _mm_loadu_si128((const __m128i*)(data + i - 1));
+		const __m128i center = _mm_loadu_si128((const __m128i*)(data + i));
+		const __m128i right = _mm_loadu_si128((const __m128i*)(data + i + 1));
+		const unsigned int lowerThanLeft = (unsigned int)_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(left, center)));
+		const unsigned int higherThanRight = (unsigned int)_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(center, right)));
+		sink.Block(i, 4, lowerThanLeft & ~higherThanRight & 0xF, ~lowerThanLeft & higherThanRight & 0xF);
+	}
+	ClassifyScalar(data, i, end, sink);
+}
+
+template <class TSink>
+P1D_TARGET_AVX2 inline void ClassifyAvx2(const int* data, const int begin, const int end, TSink& sink)
+{
+	int i = begin;
+	for (; i + 8 <= end; i += 8)
+	{
+		const __m256i left = _mm256_loadu_si256((const __m256i*)(data + i - 1));
+		const __m256i center = _mm256_loadu_si256((const __m256i*)(data + i));
+		const __m256i right = _mm256_loadu_si256((const __m256i*)(data + i + 1));
+		const unsigned int lowerThanLeft = (unsigned int)_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(left, center)));
+		const unsigned int higherThanRight = (unsigned int)_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(center, right)));
+		sink.Block(i, 8, lowerThanLeft & ~higherThanRight & 0xFF, ~lowerThanLeft & higherThanRight & 0xFF);
+	}
+	ClassifyScalar(data, i, end, sink);
+}
+
+#endif //P1D_SIMD
+
+/*!
+	Filters the outputs begin..end-1, whose kernel window lies entirely inside the data.
+	Taps are accumulated in kernel order, so all kernels produce the same results.
+*/
+template <typename TValue>
+inline void ConvolveScalar(const TValue* data, const double* kernel, const int kernelSize, const int center,
+						   const double kernelSum, const int begin, const int end, TValue* filtered)
+{
+	for (int j = begin; j < end; j++)
+	{
+		double value = 0;
+		for (int t = 0; t < kernelSize; t++)
+		{
+			value += data[j + t - center] * kernel[t];
+		}
+		filtered[j] = (TValue)(value / kernelSum);
+	}
+}
+
+#ifdef P1D_SIMD
+
+inline void ConvolveSse2(const double* data, const double* kernel, const int kernelSize, const int center,
+						 const double kernelSum, const int begin, const int end, double* filtered)
+{
+	const __m128d sum = _mm_set1_pd(kernelSum);
+	int j = begin;
+	for (; j + 2 <= end; j += 2)
+	{
+		__m128d value = _mm_setzero_pd();
+		for (int t = 0; t < kernelSize; t++)
+		{
+			value = _mm_add_pd(value, _mm_mul_pd(_mm_loadu_pd(data + j + t - center), _mm_set1_pd(kernel[t])));
+		}
+		_mm_storeu_pd(filtered + j, _mm_div_pd(value, sum));
+	}
+	ConvolveScalar(data, kernel, kernelSize, center, kernelSum, j, end, filtered);
+}
+
+//multiplications and additions are kept separate, fused multiply-add would round differently
+P1D_TARGET_AVX2 inline void ConvolveAvx2(const double* data, const double* kernel, const int kernelSize, const int center,
+										 const double kernelSum, const int begin, const int end, double* filtered)
+{
+	const __m256d sum = _mm256_set1_pd(kernelSum);
+	int j = begin;
+	for (; j + 4 <= end; j += 4)
+	{
+		__m256d value = _mm256_setzero_pd();
+		for (int t = 0; t < kernelSize; t++)
+		{
+			value = _mm256_add_pd(value, _mm256_mul_pd(_mm256_loadu_pd(data + j + t - center), _mm256_set1_pd(kernel[t])));
+		}
+		_mm256_storeu_pd(filtered + j, _mm256_div_pd(value, sum));
+	}
+	ConvolveScalar(data, kernel, kernelSize, center, kernelSum, j, end, filtered);
+}
+
+#endif //P1D_SIMD
+
+template <typename TValue>
+inline void ConvolveInner(const TValue* data, const double* kernel, const int kernelSize, const int center,
+						  const double kernelSum, const int begin, const int end, TValue* filtered)
+{
+	ConvolveScalar(data, kernel, kernelSize, center, kernelSum, begin, end, filtered);
+}
+
+#ifdef P1D_SIMD
+inline void ConvolveInner(const double* data, const double* kernel, const int kernelSize, const int center,
+						  const double kernelSum, const int begin, const int end, double* filtered)
+{
+	switch (SimdLevelLimit())
+	{
+	case SIMD_AVX2:
+		ConvolveAvx2(data, kernel, kernelSize, center, kernelSum, begin, end, filtered);
+		break;
+	case SIMD_SSE2:
+		ConvolveSse2(data, kernel, kernelSize, center, kernelSum, begin, end, filtered);
+		break;
+	default:
+		ConvolveScalar(data, kernel, kernelSize, center, kernelSum, begin, end, filtered);
+	}
+}
+#endif //P1D_SIMD
+
+/*!
+	Classifies the inner vertices begin..end-1 with the best available kernel for the value type.
+*/
+template <typename TValue, class TSink>
+inline void ClassifyInner(const TValue* data, const int begin, const int end, TSink& sink)
+{
+	ClassifyScalar(data, begin, end, sink);
+}
+
+#ifdef P1D_SIMD
+template <typename TValue, class TSink>
+inline void ClassifyInnerSimd(const TValue* data, const int begin, const int end, TSink& sink)
+{
+	switch (SimdLevelLimit())
+	{
+	case SIMD_AVX2:
+		ClassifyAvx2(data, begin, end, sink);
+		break;
+	case SIMD_SSE2:
+		ClassifySse2(data, begin, end, sink);
+		break;
+	default:
+		ClassifyScalar(data, begin, end, sink);
+	}
+}
+
+template <class TSink>
+inline void ClassifyInner(const double* data, const int begin, const int end, TSink& sink)
+{
+	ClassifyInnerSimd(data, begin, end, sink);
+}
+
+template <class TSink>
+inline void ClassifyInner(const float* data, const int begin, const int end, TSink& sink)
+{
+	ClassifyInnerSimd(data, begin, end, sink);
+}
+
+template <class TSink>
+inline void ClassifyInner(const int* data, const int begin, const int end, TSink& sink)
+{
+	ClassifyInnerSimd(data, begin, end, sink);
+}
+#endif //P1D_SIMD
+
+} //namespace simd
+
+
+/*!
+	Returns the instruction set currently used by the kernels.
+*/
+inline TSimdLevel GetSimdLevel()
+{
+	return simd::SimdLevelLimit();
+}
+
+/*!
+	Limits the instruction set used by the kernels, e.g. to compare them in benchmarks.
+	Levels above the detected one are ignored.
+
+	@param[in] level	Highest instruction set to use.
+*/
+inline void SetSimdLevel(const TSimdLevel level)
+{
+	simd::SimdLevelLimit() = std::min(level, simd::DetectSimdLevel());
+}
+
+/*!
+	Writes the class of every vertex of data to classes, see TVertexClass.
+	The first vertex is a minimum if its right neighbor is not lower, and a maximum otherwise.
+	The last vertex is a minimum if its left neighbor is higher, and a maximum otherwise.
+
+	@param[in]	data	Contiguous data.
+	@param[in]	size	Number of vertices.
+	@param[out]	classes	size entries, one per vertex.
+*/
+template <typename TValue>
+inline void ClassifyVertices(const TValue* data, const int size, unsigned char* classes)
+{
+	if (size <= 0) return;
+	if (size == 1)
+	{
+		classes[0] = VERTEX_MINIMUM;
+		return;
+	}
+
+	std::fill(classes + 1, classes + size - 1, (unsigned char)VERTEX_REGULAR);
+
+	simd::TClassSink sink(classes);
+	simd::ClassifyInner(data, 1, size - 1, sink);
+
+	classes[0] = (unsigned char)(data[1] >= data[0] ? VERTEX_MINIMUM : VERTEX_MAXIMUM);
+	classes[size - 1] = (unsigned char)(data[size - 2] > data[size - 1] ? VERTEX_MINIMUM : VERTEX_MAXIMUM);
+}
+
+/*!
+	Smooths data with a FIR kernel. Near the ends, taps that fall outside the data are left out 
+	and the result is divided by the sum of the remaining taps instead of the sum of all taps:
+	
+	filtered[j] = sum(data[j+t-center] * kernel[t]) / sum(kernel[t]), over all t with 0 <= j+t-center < size
+
+	Taps are accumulated in kernel order, so results do not depend on the instruction set.
+
+	@param[in]	data		Contiguous data.
+	@param[in]	size		Number of vertices.
+	@param[in]	kernel		Filter taps.
+	@param[in]	kernelSize	Number of taps.
+	@param[in]	center		Tap applied to data[j] when computing filtered[j].
+	@param[out]	filtered	size entries. Must not overlap data.
+*/
+template <typename TValue>
+inline void FilterSamples(const TValue* data, const int size, const double* kernel, const int kernelSize, const int center, TValue* filtered)
+{
+	if (size <= 0 || kernelSize <= 0) return;
+
+	double kernelSum = 0;
+	for (int t = 0; t < kernelSize; t++)
+	{
+		kernelSum += kernel[t];
+	}
+
+	//outputs whose window lies entirely inside the data
+	const int innerBegin = std::min(center, size);
+	const int innerEnd = std::max(innerBegin, size - (kernelSize - 1 - center));
+	simd::ConvolveInner(data, kernel, kernelSize, center, kernelSum, innerBegin, innerEnd, filtered);
+
+	for (int j = 0; j < size; j++)
+	{
+		if (j == innerBegin) j = innerEnd;
+		if (j == size) break;
+
+		double value = 0;
+		double partialSum = 0;
+		for (int t = 0; t < kernelSize; t++)
+		{
+			const int idx = j + t - center;
+			if (idx >= 0 && idx < size)
+			{
+				value += data[idx] * kernel[t];
+				partialSum += kernel[t];
+			}
+		}
+		filtered[j] = (TValue)(value / partialSum);
+	}
+}
+
+/*!
+	Writes the indices of all local extrema of data to indices, in ascending order, and returns their number.
+	The first and last vertices are always included.
+
+	@param[in]	data	Contiguous data.
+	@param[in]	size	Number of vertices.
+	@param[out]	indices	Room for up to size indices.
+*/
+template <typename TValue>
+inline int FindExtremaIndices(const TValue* data, const int size, int* indices)
+{
+	if (size <= 0) return 0;
+
+	simd::TExtremaSink sink(indices);
+	sink.Indices[sink.Count++] = 0;
+	if (size == 1) return sink.Count;
+
+	simd::ClassifyInner(data, 1, size - 1, sink);
+	sink.Indices[sink.Count++] = size - 1;
+	return sink.Count;
+}
+
+}
+
+#ifdef _M_CEE
+#pragma managed(pop)
+#endif
+
+#endif
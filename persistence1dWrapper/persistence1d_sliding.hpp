@@ -0,0 +1,414 @@
+/*! \file persistence1d_sliding.hpp
+    Persistence over a sliding window of samples.
+*/
+
+#ifndef PERSISTENCE_SLIDING_H
+#define PERSISTENCE_SLIDING_H
+
+#include <deque>
+#include <functional>
+#include <set>
+
+#include "persistence1d.hpp"
+
+namespace p1d
+{
+
+/*! Keeps the paired extrema of a window of samples up to date while samples are added to its end
+	and removed from its front. Results are identical to running Persistence1D on the samples
+	currently in the window, and are ready at any time without processing the window again.
+
+	Every minimum, except the global one, is paired with the lower of its two barriers: the highest vertex
+	between it and the nearest lower vertex to its left, and the highest vertex between it and the nearest
+	lower vertex to its right. Vertices are compared by value, equal values from left to right, as in Persistence1D.
+
+	PushBack finds the vertices the new sample is the nearest lower vertex of, with a stack of vertices
+	that have none yet, like AppendSamples. These vertices get their right barrier.
+	PopFront finds the vertices the removed sample was the nearest lower vertex of, by following the chain
+	of nearest lower vertices from its right neighbor. These vertices lose their left barrier.
+	Each vertex gets its right barrier once and loses its left barrier at most once, so both calls take
+	amortized constant time plus O(log p) for each of the p pairs that change.
+
+	Results are reported with indices relative to the front of the window.
+*/
+template <typename TValue = double, class TAllocator = std::allocator<TValue> >
+class BasicSlidingPersistence1D
+{
+public:
+	typedef TBasicPairedExtrema<TValue> TPairedExtrema;
+
+protected:
+	typedef std::allocator_traits<TAllocator> TAllocatorTraits;
+	typedef std::multiset<TPairedExtrema, std::less<TPairedExtrema>,
+						  typename TAllocatorTraits::template rebind_alloc<TPairedExtrema> > TPairSet;
+
+	/** A sample in the window. Positions count all samples pushed since the last Clear.
+		-1 stands for a vertex that does not exist, e.g. a barrier on a side without a lower vertex.
+	*/
+	struct TVertex
+	{
+		TValue Value;
+
+		///Position of the nearest lower vertex to the right, -1 if there is none yet.
+		int NextLower;
+
+		///Position of the highest vertex between this vertex and the nearest lower vertex to the left,
+		///-1 if there is no lower vertex to the left in the window.
+		int LeftBarrier;
+
+		///Position of the highest vertex between this vertex and the nearest lower vertex to the right,
+		///-1 if there is none.
+		int RightBarrier;
+
+		///Lower than both of its neighbors in the window.
+		bool IsMinimum;
+
+		///Pair of this minimum in Pairs, valid if HasPair is set.
+		bool HasPair;
+		typename TPairSet::iterator Pair;
+	};
+
+	/** A vertex without a lower vertex to its right. */
+	struct TOpenVertex
+	{
+		int Position;
+
+		///Position of the highest vertex between this vertex and the next open vertex,
+		///or the end of the window. -1 if there are no vertices in between.
+		int MaxBetween;
+	};
+
+	typedef std::deque<TVertex, typename TAllocatorTraits::template rebind_alloc<TVertex> > TVertexQueue;
+	typedef std::deque<TOpenVertex, typename TAllocatorTraits::template rebind_alloc<TOpenVertex> > TOpenVertexQueue;
+
+public:
+	/*!
+		@param[in] allocator	Allocator for the window and the pairs.
+	*/
+	explicit BasicSlidingPersistence1D(const TAllocator& allocator = TAllocator()):
+		Vertices(allocator),OpenVertices(allocator),Pairs(std::less<TPairedExtrema>(), allocator),Front(0)
+	{
+	}
+
+	/*!
+		Removes all samples.
+	*/
+	void Clear()
+	{
+		Vertices.clear();
+		OpenVertices.clear();
+		Pairs.clear();
+		Front = 0;
+	}
+
+	/*!
+		Returns the number of samples in the window.
+	*/
+	int Size() const
+	{
+		return (int)Vertices.size();
+	}
+
+	/*!
+		Adds a sample to the end of the window.
+
+		@param[in] sample	Value of the new vertex.
+	*/
+	void PushBack(const TValue sample)
+	{
+		if (Front + (int)Vertices.size() == POSITION_LIMIT) Rebase();
+
+		const int position = Front + (int)Vertices.size();
+
+		TVertex vertex;
+		vertex.Value = sample;
+		vertex.NextLower = -1;
+		vertex.LeftBarrier = -1;
+		vertex.RightBarrier = -1;
+		vertex.IsMinimum = true;
+		vertex.HasPair = false;
+
+		//the last vertex stops being a minimum if the new one is lower
+		if (!Vertices.empty())
+		{
+			TVertex& last = Vertices.back();
+			vertex.IsMinimum = last.Value > sample;
+			if (last.IsMinimum && sample < last.Value)
+			{
+				last.IsMinimum = false;
+				UpdatePair(position - 1);
+			}
+		}
+
+		//the new vertex is the nearest lower vertex of all open vertices above it
+		int maxAbove = -1;
+		while (!OpenVertices.empty() && At(OpenVertices.back().Position).Value > sample)
+		{
+			const TOpenVertex open = OpenVertices.back();
+			OpenVertices.pop_back();
+
+			const int barrier = Higher(open.MaxBetween, maxAbove);
+			TVertex& resolved = At(open.Position);
+			resolved.NextLower = position;
+			resolved.RightBarrier = barrier;
+			if (resolved.IsMinimum) UpdatePair(open.Position);
+
+			maxAbove = Higher(barrier, open.Position);
+		}
+
+		if (!OpenVertices.empty())
+		{
+			TOpenVertex& lower = OpenVertices.back();
+			lower.MaxBetween = Higher(lower.MaxBetween, maxAbove);
+			vertex.LeftBarrier = lower.MaxBetween;
+		}
+
+		Vertices.push_back(vertex);
+
+		TOpenVertex open;
+		open.Position = position;
+		open.MaxBetween = -1;
+		OpenVertices.push_back(open);
+
+		if (vertex.IsMinimum) UpdatePair(position);
+	}
+
+	/*!
+		Removes the sample at the front of the window. Does nothing if the window is empty.
+	*/
+	void PopFront()
+	{
+		if (Vertices.empty()) return;
+
+		TVertex& front = Vertices.front();
+		if (front.HasPair) Pairs.erase(front.Pair);
+
+		//the front has no lower vertex to its left, so it is open unless it has a lower vertex to its right
+		if (OpenVertices.front().Position == Front) OpenVertices.pop_front();
+
+		const int stop = front.NextLower;
+		Vertices.pop_front();
+		Front++;
+
+		if (Vertices.empty()) return;
+
+		//the new front is a minimum if its right neighbor is higher. If it just became one, 
+		//the removed vertex was lower than it, so it is the first vertex of the chain below.
+		TVertex& next = Vertices.front();
+		next.IsMinimum = Vertices.size() == 1 || At(Front + 1).Value >= next.Value;
+
+		//vertices whose nearest lower vertex to the left was removed
+		for (int position = Front; position != -1 && position != stop; position = At(position).NextLower)
+		{
+			At(position).LeftBarrier = -1;
+			UpdatePair(position);
+		}
+	}
+
+	/*!
+		Same as Persistence1D::GetPairedExtrema, for the samples in the window.
+		Returned pairs are sorted according to persistence, from least to most persistent.
+
+		@param[out]	pairs			Destination vector for the pairs.
+		@param[in]	threshold		Minimal persistence of returned pairs.
+		@param[in]	matlabIndexing	Set this to true to change all indices of features to Matlab's 1-indexing.
+	*/
+	bool GetPairedExtrema(std::vector<TPairedExtrema> & pairs, const double threshold = 0, const bool matlabIndexing = false) const
+	{
+		pairs.clear();
+		if (Pairs.empty() || threshold < 0.0) return false;
+
+		const int indexOffset = matlabIndexing ? MATLAB_INDEX_FACTOR - Front : -Front;
+		for (typename TPairSet::const_iterator p = FirstAbove(threshold); p != Pairs.end(); p++)
+		{
+			TPairedExtrema pair = *p;
+			pair.MinIndex += indexOffset;
+			pair.MaxIndex += indexOffset;
+			pairs.push_back(pair);
+		}
+		return !pairs.empty();
+	}
+
+	/*!
+		Same as Persistence1D::GetExtremaIndices, for the samples in the window.
+
+		@param[out] min				Vector of indices of paired local minima.
+		@param[out]	max				Vector of indices of paired local maxima.
+		@param[in]	threshold		Return only indices for pairs whose persistence is greater than or equal to threshold.
+		@param[in]	matlabIndexing	Set this to true to change all indices to match Matlab's 1-indexing.
+	*/
+	bool GetExtremaIndices(std::vector<int> & min, std::vector<int> & max, const double threshold = 0, const bool matlabIndexing = false) const
+	{
+		min.clear();
+		max.clear();
+		if (Pairs.empty() || threshold < 0.0) return false;
+
+		const int indexOffset = matlabIndexing ? MATLAB_INDEX_FACTOR - Front : -Front;
+		for (typename TPairSet::const_iterator p = FirstAbove(threshold); p != Pairs.end(); p++)
+		{
+			min.push_back((*p).MinIndex + indexOffset);
+			max.push_back((*p).MaxIndex + indexOffset);
+		}
+		return true;
+	}
+
+	/*!
+		Returns the number of pairs whose persistence is greater than or equal to threshold. 
+		Takes O(log p + k) for k counted pairs.
+	*/
+	size_t CountFeatures(const double threshold = 0) const
+	{
+		return (size_t)std::distance(FirstAbove(threshold), Pairs.end());
+	}
+
+	/*!
+		Returns the index of the global minimum of the window, -1 if the window is empty.
+		The global minimum is the lowest open vertex.
+	*/
+	int GetGlobalMinimumIndex(const bool matlabIndexing = false) const
+	{
+		if (OpenVertices.empty()) return -1;
+		return OpenVertices.front().Position - Front + (matlabIndexing ? MATLAB_INDEX_FACTOR : 0);
+	}
+
+	/*!
+		Returns the value of the global minimum of the window, 0 if the window is empty.
+	*/
+	TValue GetGlobalMinimumValue() const
+	{
+		if (OpenVertices.empty()) return 0;
+		return At(OpenVertices.front().Position).Value;
+	}
+
+protected:
+	//positions are rebased before they reach the int limit
+	enum { POSITION_LIMIT = 0x40000000 };
+
+	TVertex& At(const int position)
+	{
+		return Vertices[position - Front];
+	}
+
+	const TVertex& At(const int position) const
+	{
+		return Vertices[position - Front];
+	}
+
+	/*!
+		Returns the higher of two vertices, where -1 is lower than any vertex. Equal values are ordered from left to right.
+	*/
+	int Higher(const int first, const int second) const
+	{
+		if (first == -1) return second;
+		if (second == -1) return first;
+
+		const TValue firstValue = At(first).Value;
+		const TValue secondValue = At(second).Value;
+		if (firstValue != secondValue) return firstValue > secondValue ? first : second;
+		return first > second ? first : second;
+	}
+
+	/*!
+		Returns the lower of two barriers, where -1 is higher than any vertex.
+	*/
+	int LowerBarrier(const int first, const int second) const
+	{
+		if (first == -1) return second;
+		if (second == -1) return first;
+		return Higher(first, second) == first ? second : first;
+	}
+
+	/*!
+		Recomputes the pair of the vertex at position after its barriers or its minimum flag changed.
+	*/
+	void UpdatePair(const int position)
+	{
+		TVertex& vertex = At(position);
+		if (vertex.HasPair)
+		{
+			Pairs.erase(vertex.Pair);
+			vertex.HasPair = false;
+		}
+
+		if (!vertex.IsMinimum) return;
+
+		//the global minimum has no barrier and stays unpaired
+		const int barrier = LowerBarrier(vertex.LeftBarrier, vertex.RightBarrier);
+		if (barrier == -1) return;
+
+		TPairedExtrema pair;
+		pair.MinIndex = position;
+		pair.MaxIndex = barrier;
+		pair.Persistence = At(barrier).Value - vertex.Value;
+
+		vertex.Pair = Pairs.insert(pair);
+		vertex.HasPair = true;
+	}
+
+	/*!
+		Returns the first pair whose persistence is greater than or equal to threshold.
+	*/
+	typename TPairSet::const_iterator FirstAbove(const double threshold) const
+	{
+		if (threshold <= 0) return Pairs.begin();
+
+		//the threshold may be rounded down in TValue, so a few pairs below it may have to be skipped
+		TPairedExtrema key;
+		key.MinIndex = -1;
+		key.MaxIndex = -1;
+		key.Persistence = (TValue)threshold;
+
+		typename TPairSet::const_iterator p = Pairs.lower_bound(key);
+		while (p != Pairs.end() && (*p).Persistence < threshold) p++;
+		return p;
+	}
+
+	/*!
+		Moves all positions so that the front is at position 0. Runs once every 2^30 samples.
+	*/
+	void Rebase()
+	{
+		const int offset = Front;
+		const int size = (int)Vertices.size();
+
+		Pairs.clear();
+		Front = 0;
+		for (int i = 0; i != size; i++)
+		{
+			TVertex& vertex = Vertices[i];
+			if (vertex.NextLower != -1) vertex.NextLower -= offset;
+			if (vertex.LeftBarrier != -1) vertex.LeftBarrier -= offset;
+			if (vertex.RightBarrier != -1) vertex.RightBarrier -= offset;
+			vertex.HasPair = false;
+		}
+		for (typename TOpenVertexQueue::iterator o = OpenVertices.begin(); o != OpenVertices.end(); o++)
+		{
+			(*o).Position -= offset;
+			if ((*o).MaxBetween != -1) (*o).MaxBetween -= offset;
+		}
+		for (int i = 0; i != size; i++)
+		{
+			UpdatePair(i);
+		}
+	}
+
+	///Samples in the window, the front first.
+	TVertexQueue Vertices;
+
+	///Vertices without a lower vertex to their right, from left to right. Their values increase.
+	TOpenVertexQueue OpenVertices;
+
+	///Pairs of all paired minima in the window, sorted like Persistence1D::GetPairedExtrema.
+	TPairSet Pairs;
+
+	///Position of the front of the window.
+	int Front;
+};
+
+/*!
+	Sliding-window persistence of double values.
+*/
+typedef BasicSlidingPersistence1D<double> SlidingPersistence1D;
+
+}
+#endif
@@ -0,0 +1,245 @@
+/*! \file persistence1d_stats.hpp
+    Optional instrumentation of Persistence1D runs: time per phase, counters and a rolling latency histogram.
+
+	Compiled in only when P1D_STATS is defined. Without it, this header only declares the phases,
+	and Persistence1D has no statistics members and does no extra work. The wrapper project defines it
+	in the Debug configuration only, so the Release build carries no instrumentation.
+*/
+
+#ifndef PERSISTENCE_STATS_H
+#define PERSISTENCE_STATS_H
+
+#include <stddef.h>
+#include <string.h>
+
+#ifdef P1D_STATS
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+#endif
+
+namespace p1d
+{
+
+/** Phases of a run, see TRunStats. */
+enum TStatsPhase
+{
+	///Copying or smoothing the input into Data.
+	PHASE_COPY = 0,
+
+	///Compressing to the local extrema and sorting the vertices: CreateIndexValueVector and friends.
+	PHASE_SORT = 1,
+
+	///Watershed or CompactWatershed.
+	PHASE_WATERSHED = 2,
+
+	///Restoring compressed indices and SortPairedExtrema.
+	PHASE_SORT_PAIRS = 3,
+
+	///Converting data and results between managed and native code. Recorded by the wrapper only.
+	PHASE_MARSHAL = 4,
+
+	PHASE_COUNT = 5
+};
+
+#ifdef P1D_STATS
+
+/*!
+	Returns a monotonic time in nanoseconds.
+*/
+inline long long StatsNow()
+{
+#ifdef _WIN32
+	static LARGE_INTEGER frequency = { 0 };
+	if (frequency.QuadPart == 0) QueryPerformanceFrequency(&frequency);
+
+	LARGE_INTEGER now;
+	QueryPerformanceCounter(&now);
+	//split to avoid overflowing the multiplication
+	return (now.QuadPart / frequency.QuadPart) * 1000000000LL +
+		   (now.QuadPart % frequency.QuadPart) * 1000000000LL / frequency.QuadPart;
+#else
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (long long)now.tv_sec * 1000000000LL + now.tv_nsec;
+#endif
+}
+
+
+/** Statistics of one run. Counters are derived from the results, so the inner loops are not instrumented. */
+struct TRunStats
+{
+	TRunStats() { Clear(); }
+
+	void Clear()
+	{
+		memset(PhaseNs, 0, sizeof(PhaseNs));
+		TotalNs = 0;
+		Vertices = 0;
+		ComponentsCreated = 0;
+		ComponentsMerged = 0;
+		PairsEmitted = 0;
+		GrownVectors = 0;
+		GrownBytes = 0;
+	}
+
+	///Time spent in each phase, see TStatsPhase.
+	long long PhaseNs[PHASE_COUNT];
+
+	///Time of the whole run, without PHASE_MARSHAL.
+	long long TotalNs;
+
+	///Vertices given to the run.
+	int Vertices;
+
+	///Components created at local minima by the watershed.
+	int ComponentsCreated;
+
+	///Components destroyed by merging; each merge creates a pair. All but the global minimum's component are merged.
+	int ComponentsMerged;
+
+	///Pairs kept, at or above TRunOptions::Threshold.
+	int PairsEmitted;
+
+	///Working vectors whose capacity grew during the run. Derived from the capacities before and after the run,
+	///not from the allocator: a vector that reallocated several times is counted once.
+	int GrownVectors;
+
+	///Bytes the capacities of the working vectors grew by during the run.
+	long long GrownBytes;
+};
+
+
+/*! Histogram of the durations of the last WINDOW runs.
+
+	Durations are kept in logarithmic buckets with 8 linear steps per power of two,
+	so a percentile is accurate to 12.5%. The maximum is exact.
+*/
+class TLatencyHistogram
+{
+public:
+	enum { WINDOW = 1024, STEPS = 8, BUCKETS = 64 * STEPS };
+
+	TLatencyHistogram() { Clear(); }
+
+	void Clear()
+	{
+		memset(Counts, 0, sizeof(Counts));
+		memset(Window, 0, sizeof(Window));
+		Next = 0;
+		Count = 0;
+	}
+
+	/*!
+		Adds the duration of a run, dropping the oldest one if the window is full.
+	*/
+	void Add(long long ns)
+	{
+		if (ns < 0) ns = 0;
+		if (Count == WINDOW)
+		{
+			Counts[Bucket(Window[Next])]--;
+		}
+		else
+		{
+			Count++;
+		}
+
+		Window[Next] = ns;
+		Counts[Bucket(ns)]++;
+		Next = (Next + 1) % WINDOW;
+	}
+
+	/*!
+		Returns the duration that fraction of the runs in the window did not exceed, rounded up to
+		the end of its bucket. Returns 0 for an empty window.
+
+		@param[in] fraction		0.5 for the median, 0.99 for the 99th percentile.
+	*/
+	long long Percentile(const double fraction) const
+	{
+		if (Count == 0) return 0;
+
+		const long long max = Max();
+		int rank = (int)(fraction * Count + 0.999999);
+		if (rank < 1) rank = 1;
+		if (rank > Count) rank = Count;
+
+		int seen = 0;
+		for (int b = 0; b != BUCKETS; b++)
+		{
+			seen += Counts[b];
+			if (seen >= rank)
+			{
+				const long long end = BucketEnd(b);
+				return (end < max) ? end : max;
+			}
+		}
+		return max;
+	}
+
+	/*!
+		Returns the longest duration in the window.
+	*/
+	long long Max() const
+	{
+		long long max = 0;
+		for (int i = 0; i != Count; i++)
+		{
+			if (Window[i] > max) max = Window[i];
+		}
+		return max;
+	}
+
+	/*!
+		Returns the number of runs in the window.
+	*/
+	int Size() const
+	{
+		return Count;
+	}
+
+protected:
+	static int Bucket(const long long ns)
+	{
+		if (ns < STEPS) return (int)ns;
+
+		int exponent = 0;
+		while ((ns >> exponent) >= 2 * STEPS) exponent++;
+		//ns >> exponent is in [STEPS, 2*STEPS)
+		return (exponent + 1) * STEPS + (int)((ns >> exponent) - STEPS);
+	}
+
+	static long long BucketEnd(const int bucket)
+	{
+		if (bucket < STEPS) return bucket;
+
+		const int exponent = bucket / STEPS - 1;
+		const long long first = (long long)(STEPS + bucket % STEPS) << exponent;
+		return first + (1LL << exponent) - 1;
+	}
+
+	int Counts[BUCKETS];
+	long long Window[WINDOW];	//durations of the runs in the window, oldest at Next once full
+	int Next;
+	int Count;
+};
+
+#endif //P1D_STATS
+}
+
+#ifdef P1D_STATS
+#define P1D_STATS_ONLY(statement) statement
+#else
+#define P1D_STATS_ONLY(statement)
+#endif
+
+#endif
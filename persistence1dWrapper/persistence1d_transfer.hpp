@@ -0,0 +1,360 @@
+/*! \file persistence1d_transfer.hpp
+    Transfer function evaluator: translates device movement into pointer movement with a gain curve.
+
+	The gain curve, its bin size and the CD gain are compiled into one small table of gains and slopes per bin,
+	so translating an event needs one sqrt, one division and one table lookup. Batches are translated with
+	AVX2 or SSE2, chosen like the kernels of persistence1d_simd.hpp.
+	When compiled with /clr, the kernels are compiled as native code.
+*/
+
+#ifndef PERSISTENCE_TRANSFER_H
+#define PERSISTENCE_TRANSFER_H
+
+#include <math.h>
+#include <stddef.h>
+#include <vector>
+
+#include "persistence1d_simd.hpp"
+
+//Intrinsics are not supported in managed code
+#ifdef _M_CEE
+#pragma managed(push, off)
+#endif
+
+namespace p1d
+{
+
+/** Parameters of the transfer function, as in AutoGain.getTranslatedValue. */
+struct TTransferParams
+{
+	TTransferParams():BinSize(0.005),CountsPerMeter(800 / 0.0254),CDGain(1),MinTimespan(0){}
+
+	///Speed covered by one bin of the gain curve, in m/s.
+	double BinSize;
+
+	///Device counts per meter.
+	double CountsPerMeter;
+
+	///Gains of the curve are multiplied by this, ppi / cpi.
+	double CDGain;
+
+	///Shorter timespans are raised to this, in ms.
+	double MinTimespan;
+};
+
+
+/** Storage of the table. */
+enum TTransferTableType
+{
+	///Gains and slopes as double. Same results as AutoGain.getInterpolatedValue up to rounding.
+	TRANSFER_DOUBLE = 0,
+
+	///Gains and slopes as 16.16 fixed point. Half the table size; gains differ by at most GetTolerance().
+	TRANSFER_FIXED_POINT = 1
+};
+
+
+/*! A gain curve compiled for translation.
+
+	Bin i of the table holds the gain at bin i and the slope towards bin i+1, both multiplied by the CD gain.
+	The speed of an event, divided by the bin size, is its fractional bin index x; its gain is
+	Gain[floor(x)] + Slope[floor(x)] * (x - floor(x)). Indices below 0 (and NaN) use the first bin,
+	indices above the last bin use the last bin, as in AutoGain.getInterpolatedValue.
+*/
+class TTransferTable
+{
+public:
+	TTransferTable():Type(TRANSFER_DOUBLE),Scale(0),MinTimespan(0),LastIndex(0),Tolerance(0){}
+
+	/*!
+		Builds the table. Returns false, and leaves an empty table that translates to 0, if the curve is empty.
+		If the gains do not fit 16.16 fixed point, a fixed point table falls back to double.
+
+		@param[in] curve	Gain of each bin, without the CD gain.
+		@param[in] bins		Number of bins.
+		@param[in] params	Bin size, counts per meter, CD gain and minimum timespan.
+		@param[in] type		Storage of the table, see TTransferTableType.
+	*/
+	bool Compile(const double* curve, const size_t bins, const TTransferParams& params, const TTransferTableType type = TRANSFER_DOUBLE)
+	{
+		Gains.clear();
+		Slopes.clear();
+		FixedGains.clear();
+		FixedSlopes.clear();
+		Type = TRANSFER_DOUBLE;
+		Tolerance = 0;
+		LastIndex = 0;
+
+		//index = speed / binSize = sqrt(dx*dx + dy*dy) / countsPerMeter / (timespan / 1000) / binSize
+		Scale = 1000 / (params.CountsPerMeter * params.BinSize);
+		MinTimespan = params.MinTimespan;
+
+		if (bins == 0) return false;
+
+		Gains.resize(bins);
+		Slopes.resize(bins);
+		for (size_t i = 0; i != bins; i++)
+		{
+			Gains[i] = curve[i] * params.CDGain;
+			Slopes[i] = (i + 1 < bins) ? (curve[i + 1] - curve[i]) * params.CDGain : 0;
+		}
+		LastIndex = (double)(bins - 1);
+
+		if (type == TRANSFER_FIXED_POINT && CompileFixedPoint())
+		{
+			Type = TRANSFER_FIXED_POINT;
+			Gains.clear();
+			Slopes.clear();
+		}
+		return true;
+	}
+
+	/*!
+		Translates one event. Returns its speed divided by the bin size, the fractional bin index.
+
+		@param[in]	dx			Device movement, in counts.
+		@param[in]	dy			Device movement, in counts.
+		@param[in]	timespan	Time since the previous event, in ms.
+		@param[out]	tx			Pointer movement, in pixels.
+		@param[out]	ty			Pointer movement, in pixels.
+	*/
+	double Translate(const double dx, const double dy, const double timespan, double& tx, double& ty) const
+	{
+		const double t = (timespan > MinTimespan) ? timespan : MinTimespan;
+		const double index = sqrt(dx * dx + dy * dy) * Scale / t;
+		const double gain = GetGain(index);
+
+		tx = dx * gain;
+		ty = dy * gain;
+		return index;
+	}
+
+	/*!
+		Translates count events. Gives the same results as Translate for each event.
+
+		@param[in]	dx			Device movements, in counts.
+		@param[in]	dy			Device movements, in counts.
+		@param[in]	timespan	Times since the previous events, in ms.
+		@param[in]	count		Number of events.
+		@param[out]	tx			Pointer movements, in pixels.
+		@param[out]	ty			Pointer movements, in pixels.
+	*/
+	void TranslateBatch(const double* dx, const double* dy, const double* timespan, const size_t count,
+						double* tx, double* ty) const
+	{
+		size_t done = 0;
+#ifdef P1D_SIMD
+		if (!Empty())
+		{
+			switch (simd::SimdLevelLimit())
+			{
+			case SIMD_AVX2:
+				done = (Type == TRANSFER_FIXED_POINT) ? TranslateAvx2Fixed(dx, dy, timespan, count, tx, ty)
+													  : TranslateAvx2(dx, dy, timespan, count, tx, ty);
+				break;
+			case SIMD_SSE2:
+				if (Type == TRANSFER_DOUBLE) done = TranslateSse2(dx, dy, timespan, count, tx, ty);
+				break;
+			default:
+				break;
+			}
+		}
+#endif
+		for (size_t i = done; i != count; i++)
+		{
+			Translate(dx[i], dy[i], timespan[i], tx[i], ty[i]);
+		}
+	}
+
+	/*!
+		Returns the gain at a fractional bin index, including the CD gain.
+	*/
+	double GetGain(double index) const
+	{
+		if (Empty()) return 0;
+
+		if (!(index >= 0)) index = 0;
+		if (index > LastIndex) index = LastIndex;
+
+		const int bin = (int)index;
+		const double fraction = index - bin;
+
+		if (Type == TRANSFER_FIXED_POINT)
+		{
+			return (FixedGains[bin] + FixedSlopes[bin] * fraction) * (1.0 / FIXED_ONE);
+		}
+		return Gains[bin] + Slopes[bin] * fraction;
+	}
+
+	/*!
+		Returns the largest difference of GetGain from the double table, 0 for a double table.
+	*/
+	double GetTolerance() const
+	{
+		return Tolerance;
+	}
+
+	/*!
+		Returns the storage of the table, which is TRANSFER_DOUBLE if a fixed point table did not fit.
+	*/
+	TTransferTableType GetType() const
+	{
+		return Type;
+	}
+
+	/*!
+		Returns true if no curve is compiled.
+	*/
+	bool Empty() const
+	{
+		return Gains.empty() && FixedGains.empty();
+	}
+
+protected:
+	///1.0 in 16.16 fixed point.
+	enum { FIXED_ONE = 65536 };
+
+	/*!
+		Converts Gains and Slopes to FixedGains and FixedSlopes, and sets Tolerance.
+		Returns false if a value does not fit.
+	*/
+	bool CompileFixedPoint()
+	{
+		const double limit = 2147483647.0 / FIXED_ONE;
+		double tolerance = 0;
+
+		for (size_t i = 0; i != Gains.size(); i++)
+		{
+			if (!(fabs(Gains[i]) < limit && fabs(Slopes[i]) < limit)) return false;
+
+			FixedGains.push_back((int)floor(Gains[i] * FIXED_ONE + 0.5));
+			FixedSlopes.push_back((int)floor(Slopes[i] * FIXED_ONE + 0.5));
+
+			//the error is linear within a bin, so it is largest at one of its ends
+			const double gainError = (double)FixedGains[i] / FIXED_ONE - Gains[i];
+			const double endError = gainError + (double)FixedSlopes[i] / FIXED_ONE - Slopes[i];
+			tolerance = std::max(tolerance, std::max(fabs(gainError), fabs(endError)));
+		}
+
+		Tolerance = tolerance;
+		return true;
+	}
+
+#ifdef P1D_SIMD
+	//the kernels repeat the operations of Translate in the same order, so they round the same
+
+	size_t TranslateSse2(const double* dx, const double* dy, const double* timespan, const size_t count,
+						 double* tx, double* ty) const
+	{
+		const __m128d scale = _mm_set1_pd(Scale);
+		const __m128d minTimespan = _mm_set1_pd(MinTimespan);
+		const __m128d last = _mm_set1_pd(LastIndex);
+		const __m128d zero = _mm_setzero_pd();
+
+		size_t i = 0;
+		for (; i + 2 <= count; i += 2)
+		{
+			const __m128d x = _mm_loadu_pd(dx + i);
+			const __m128d y = _mm_loadu_pd(dy + i);
+			const __m128d t = _mm_max_pd(_mm_loadu_pd(timespan + i), minTimespan);
+
+			__m128d index = _mm_div_pd(_mm_mul_pd(_mm_sqrt_pd(_mm_add_pd(_mm_mul_pd(x, x), _mm_mul_pd(y, y))), scale), t);
+			index = _mm_min_pd(_mm_max_pd(index, zero), last);	//max returns zero for NaN
+
+			const __m128i bin = _mm_cvttpd_epi32(index);
+			const __m128d fraction = _mm_sub_pd(index, _mm_cvtepi32_pd(bin));
+			const int bin0 = _mm_cvtsi128_si32(bin);
+			const int bin1 = _mm_cvtsi128_si32(_mm_shuffle_epi32(bin, 1));
+
+			const __m128d gains = _mm_set_pd(Gains[bin1], Gains[bin0]);
+			const __m128d slopes = _mm_set_pd(Slopes[bin1], Slopes[bin0]);
+			const __m128d gain = _mm_add_pd(gains, _mm_mul_pd(slopes, fraction));
+
+			_mm_storeu_pd(tx + i, _mm_mul_pd(x, gain));
+			_mm_storeu_pd(ty + i, _mm_mul_pd(y, gain));
+		}
+		return i;
+	}
+
+	P1D_TARGET_AVX2 size_t TranslateAvx2(const double* dx, const double* dy, const double* timespan, const size_t count,
+										 double* tx, double* ty) const
+	{
+		const __m256d scale = _mm256_set1_pd(Scale);
+		const __m256d minTimespan = _mm256_set1_pd(MinTimespan);
+		const __m256d last = _mm256_set1_pd(LastIndex);
+		const __m256d zero = _mm256_setzero_pd();
+		const __m256d all = _mm256_castsi256_pd(_mm256_set1_epi32(-1));
+
+		size_t i = 0;
+		for (; i + 4 <= count; i += 4)
+		{
+			const __m256d x = _mm256_loadu_pd(dx + i);
+			const __m256d y = _mm256_loadu_pd(dy + i);
+			const __m256d t = _mm256_max_pd(_mm256_loadu_pd(timespan + i), minTimespan);
+
+			__m256d index = _mm256_div_pd(_mm256_mul_pd(_mm256_sqrt_pd(_mm256_add_pd(_mm256_mul_pd(x, x), _mm256_mul_pd(y, y))), scale), t);
+			index = _mm256_min_pd(_mm256_max_pd(index, zero), last);
+
+			//the masked gathers take a defined source, which keeps compilers from warning about the unmasked ones
+			const __m128i bin = _mm256_cvttpd_epi32(index);
+			const __m256d fraction = _mm256_sub_pd(index, _mm256_cvtepi32_pd(bin));
+			const __m256d gain = _mm256_add_pd(_mm256_mask_i32gather_pd(zero, &Gains[0], bin, all, 8),
+											   _mm256_mul_pd(_mm256_mask_i32gather_pd(zero, &Slopes[0], bin, all, 8), fraction));
+
+			_mm256_storeu_pd(tx + i, _mm256_mul_pd(x, gain));
+			_mm256_storeu_pd(ty + i, _mm256_mul_pd(y, gain));
+		}
+		return i;
+	}
+
+	P1D_TARGET_AVX2 size_t TranslateAvx2Fixed(const double* dx, const double* dy, const double* timespan, const size_t count,
+											  double* tx, double* ty) const
+	{
+		const __m256d scale = _mm256_set1_pd(Scale);
+		const __m256d minTimespan = _mm256_set1_pd(MinTimespan);
+		const __m256d last = _mm256_set1_pd(LastIndex);
+		const __m256d zero = _mm256_setzero_pd();
+		const __m256d one = _mm256_set1_pd(1.0 / FIXED_ONE);
+		const __m128i none = _mm_setzero_si128();
+		const __m128i all = _mm_set1_epi32(-1);
+
+		size_t i = 0;
+		for (; i + 4 <= count; i += 4)
+		{
+			const __m256d x = _mm256_loadu_pd(dx + i);
+			const __m256d y = _mm256_loadu_pd(dy + i);
+			const __m256d t = _mm256_max_pd(_mm256_loadu_pd(timespan + i), minTimespan);
+
+			__m256d index = _mm256_div_pd(_mm256_mul_pd(_mm256_sqrt_pd(_mm256_add_pd(_mm256_mul_pd(x, x), _mm256_mul_pd(y, y))), scale), t);
+			index = _mm256_min_pd(_mm256_max_pd(index, zero), last);
+
+			const __m128i bin = _mm256_cvttpd_epi32(index);
+			const __m256d fraction = _mm256_sub_pd(index, _mm256_cvtepi32_pd(bin));
+			const __m256d gains = _mm256_cvtepi32_pd(_mm_mask_i32gather_epi32(none, &FixedGains[0], bin, all, 4));
+			const __m256d slopes = _mm256_cvtepi32_pd(_mm_mask_i32gather_epi32(none, &FixedSlopes[0], bin, all, 4));
+			const __m256d gain = _mm256_mul_pd(_mm256_add_pd(gains, _mm256_mul_pd(slopes, fraction)), one);
+
+			_mm256_storeu_pd(tx + i, _mm256_mul_pd(x, gain));
+			_mm256_storeu_pd(ty + i, _mm256_mul_pd(y, gain));
+		}
+		return i;
+	}
+#endif //P1D_SIMD
+
+	TTransferTableType Type;
+	double Scale;					//bin index per count and ms: 1000 / (countsPerMeter * binSize)
+	double MinTimespan;
+	double LastIndex;				//index of the last bin
+	double Tolerance;
+	std::vector<double> Gains;		//gain of each bin, including the CD gain
+	std::vector<double> Slopes;		//gain of the next bin minus the gain of the bin, 0 for the last bin
+	std::vector<int> FixedGains;	//Gains in 16.16 fixed point
+	std::vector<int> FixedSlopes;	//Slopes in 16.16 fixed point
+};
+}
+
+#ifdef _M_CEE
+#pragma managed(pop)
+#endif
+
+#endif